@@ -0,0 +1,899 @@
+/*
+ * hdtest - check hexdiff's image readers on generated images
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Each test writes small images in code, together with the raw bytes they
+// stand for, and checks that hexdiff prints the same on the images as on
+// the raw files. Images are built by hand rather than with qemu-img or
+// mkfs, so that every layout they cover is there on every machine, and a
+// failure points at the reader rather than at the tools.
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 16
+#define MAX_FILES 64
+
+// Temporary directory holding the images, and the files written to it
+static char dir[PATH_MAX];
+static char *files[MAX_FILES];
+static int nfiles;
+
+static const char *hexdiff = "./hexdiff";
+static int failures;
+
+
+static void show_help(char **argv, int verbose)
+{
+	fprintf(stderr, "Usage: %s [-h] [-x hexdiff]\n", argv[0]);
+	if (verbose) {
+		printf(" -h        show help\n"
+		       " -x path   hexdiff to test (default ./hexdiff)\n");
+	}
+	exit(EXIT_FAILURE);
+}
+
+
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if ((p = calloc(nmemb, size)) == NULL) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+
+// Fill a buffer with noise that depends on seed
+static void fill(uint8_t *buf, size_t len, uint64_t seed)
+{
+	uint64_t state = 0x9e3779b97f4a7c15ULL ^ (seed * 0xff51afd7ed558ccdULL);
+
+	for (size_t i = 0; i < len; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		buf[i] = state >> 56;
+	}
+}
+
+
+// Path of a file in the temporary directory, after a prefix such as qcow2:
+static void tmp_path(char *path, const char *prefix, const char *name)
+{
+	if (snprintf(path, PATH_MAX, "%s%s/%s", prefix, dir, name) >=
+	    PATH_MAX) {
+		fprintf(stderr, "%s: path too long\n", dir);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+// Write a file to the temporary directory
+static void write_file(const char *name, const uint8_t *buf, size_t len)
+{
+	char *path;
+	int fd;
+
+	if (nfiles == MAX_FILES) {
+		fprintf(stderr, "too many files\n");
+		exit(EXIT_FAILURE);
+	}
+	path = xcalloc(PATH_MAX, 1);
+	tmp_path(path, "", name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (write(fd, buf, len) != (ssize_t)len)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	files[nfiles++] = path;
+}
+
+
+// Overwrite bytes of a file written earlier
+static void patch_file(const char *name, unsigned long long int off,
+                       const uint8_t *buf, size_t len)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	tmp_path(path, "", name);
+	fd = open(path, O_WRONLY);
+	if ((fd < 0) || (pwrite(fd, buf, len, off) != (ssize_t)len)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+
+static void remove_files(void)
+{
+	for (int i = 0; i < nfiles; i++) unlink(files[i]);
+	if (dir[0] != '\0') rmdir(dir);
+}
+
+
+// Run hexdiff with args, colors off, and collect what it writes to stdout
+// and stderr. Returns its exit status, or -1 if it didn't exit normally.
+static int run(const char *const *args, char **out, size_t *len)
+{
+	const char *argv[MAX_ARGS + 4];
+	size_t cap = 4096;
+	int fds[2], n, status;
+	ssize_t got;
+	pid_t pid;
+
+	n = 0;
+	argv[n++] = hexdiff;
+	argv[n++] = "--color";
+	argv[n++] = "never";
+	for (int i = 0; (args[i] != NULL) && (n < MAX_ARGS + 3); i++) {
+		argv[n++] = args[i];
+	}
+	argv[n] = NULL;
+
+	if (pipe(fds) != 0) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if ((pid = fork()) < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execv(argv[0], (char **)argv);
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	close(fds[1]);
+
+	*out = xcalloc(cap, 1);
+	*len = 0;
+	for (;;) {
+		if (*len + 1 == cap) {
+			if ((*out = realloc(*out, cap * 2)) == NULL) {
+				fprintf(stderr, "realloc: %s\n",
+				        strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			cap *= 2;
+		}
+		got = read(fds[0], *out + *len, cap - 1 - *len);
+		if ((got < 0) && (errno == EINTR)) continue;
+		if (got <= 0) break;
+		*len += got;
+	}
+	(*out)[*len] = '\0';
+	close(fds[0]);
+
+	while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR));
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+
+static void report(const char *name, const char *opts, int ok)
+{
+	printf("%-4s  %s%s%s\n", ok ? "ok" : "FAIL", name,
+	       (opts[0] != '\0') ? ", " : "", opts);
+	if (!ok) failures++;
+}
+
+
+// Check that hexdiff prints the same, and succeeds, on img1 and img2 as on
+// the raw files they stand for. opts is one option or an empty string, and
+// skips are optional offsets.
+static void check_same(const char *name, const char *opts,
+                       const char *img1, const char *img2, const char *raw1,
+                       const char *raw2, const char *skip1,
+                       const char *skip2)
+{
+	const char *args[8];
+	char *out[2];
+	size_t len[2];
+	int status[2], n;
+
+	for (int i = 0; i < 2; i++) {
+		n = 0;
+		if (opts[0] != '\0') args[n++] = opts;
+		args[n++] = (i == 0) ? img1 : raw1;
+		args[n++] = (i == 0) ? img2 : raw2;
+		if (skip1 != NULL) args[n++] = skip1;
+		if (skip2 != NULL) args[n++] = skip2;
+		args[n] = NULL;
+		status[i] = run(args, &out[i], &len[i]);
+	}
+	report(name, opts, (status[0] == 0) && (status[1] == 0) &&
+	       (len[0] == len[1]) && (memcmp(out[0], out[1], len[0]) == 0));
+	free(out[0]);
+	free(out[1]);
+}
+
+
+// Check that hexdiff refuses img, naming the problem in its message
+static void check_refused(const char *name, const char *img,
+                          const char *message)
+{
+	const char *args[] = { img, img, NULL };
+	char *out;
+	size_t len;
+	int status;
+
+	status = run(args, &out, &len);
+	report(name, "", (status > 0) && (strstr(out, message) != NULL));
+	free(out);
+}
+
+
+// qcow2 images
+//
+// Images use 4 KiB clusters, so one L2 table covers 2 MiB of the guest.
+// The header, the L1 table and the L2 tables come first, then the data
+// clusters in guest order. L2 tables whose clusters are all unallocated
+// are left out, with a zero L1 entry. Refcounts are not written, as hexdiff
+// doesn't read them.
+#define Q_BITS 12
+#define Q_CLUSTER (1 << Q_BITS)
+#define Q_ENTRIES (Q_CLUSTER / 8)
+
+enum q_state {
+	Q_DATA,                    // allocated, read from the image
+	Q_ZERO,                    // zero flag, no host cluster
+	Q_ZERO_ALLOC,              // zero flag over a host cluster of junk
+	Q_UNALLOC,                 // no L2 entry
+};
+
+
+// Write a qcow2 image of size bytes whose clusters are in the given states,
+// with data for the allocated ones, and the raw image it stands for. A
+// backing file name, if given, is recorded in the header. Version 2 has no
+// zero flag, so there the junk under Q_ZERO_ALLOC clusters is guest data.
+static void make_qcow2(const char *name, const char *raw_name,
+                       const enum q_state *state, unsigned long long int size,
+                       const uint8_t *data, const char *backing,
+                       unsigned int version)
+{
+	unsigned long long int clusters, tables, host, entry, l2_at[64];
+	uint8_t *img, *raw, *l1;
+	size_t img_size;
+
+	clusters = (size + Q_CLUSTER - 1) / Q_CLUSTER;
+	tables = (clusters + Q_ENTRIES - 1) / Q_ENTRIES;
+
+	// Lay out the L2 tables that are needed, then the host clusters
+	host = 2;
+	for (unsigned long long int t = 0; t < tables; t++) {
+		l2_at[t] = 0;
+		for (unsigned long long int c = t * Q_ENTRIES;
+		     (c < clusters) && (c < (t + 1) * Q_ENTRIES); c++) {
+			if (state[c] != Q_UNALLOC) l2_at[t] = host;
+		}
+		if (l2_at[t] != 0) l2_at[t] = host++;
+	}
+	for (unsigned long long int c = 0; c < clusters; c++) {
+		if ((state[c] == Q_DATA) || (state[c] == Q_ZERO_ALLOC)) host++;
+	}
+	img_size = host * Q_CLUSTER;
+	img = xcalloc(img_size, 1);
+	raw = xcalloc(clusters, Q_CLUSTER);
+
+	put_be32(img, 0x514649fb);
+	put_be32(img + 4, version);
+	if (backing != NULL) {
+		put_be64(img + 8, 104);
+		put_be32(img + 16, strlen(backing));
+		memcpy(img + 104, backing, strlen(backing));
+	}
+	put_be32(img + 20, Q_BITS);
+	put_be64(img + 24, size);
+	put_be32(img + 36, tables);
+	put_be64(img + 40, Q_CLUSTER);
+	if (version == 3) {
+		put_be32(img + 96, 4);
+		put_be32(img + 100, 104);
+	}
+
+	l1 = img + Q_CLUSTER;
+	host = 2;
+	for (unsigned long long int t = 0; t < tables; t++) {
+		if (l2_at[t] != 0) {
+			put_be64(l1 + t * 8, (l2_at[t] * Q_CLUSTER) |
+			         (1ULL << 63));
+			host++;
+		}
+	}
+	for (unsigned long long int c = 0; c < clusters; c++) {
+		entry = 0;
+		switch (state[c]) {
+		case Q_DATA:
+			memcpy(img + host * Q_CLUSTER, data + c * Q_CLUSTER,
+			       Q_CLUSTER);
+			memcpy(raw + c * Q_CLUSTER, data + c * Q_CLUSTER,
+			       Q_CLUSTER);
+			entry = (host++ * Q_CLUSTER) | (1ULL << 63);
+			break;
+		case Q_ZERO:
+			entry = 1;
+			break;
+		case Q_ZERO_ALLOC:
+			memset(img + host * Q_CLUSTER, 0xa5, Q_CLUSTER);
+			if (version == 2) {
+				memset(raw + c * Q_CLUSTER, 0xa5, Q_CLUSTER);
+			}
+			entry = (host++ * Q_CLUSTER) | (1ULL << 63) | 1;
+			break;
+		case Q_UNALLOC:
+			break;
+		}
+		if (entry != 0) {
+			put_be64(img + l2_at[c / Q_ENTRIES] * Q_CLUSTER +
+			         (c % Q_ENTRIES) * 8, entry);
+		}
+	}
+
+	write_file(name, img, img_size);
+	if (raw_name != NULL) write_file(raw_name, raw, size);
+	free(img);
+	free(raw);
+}
+
+
+static void test_qcow2(void)
+{
+	static const char *const opts[] = { "", "-s", "-l", "-j4" };
+	// Past two L2 tables, not a whole number of clusters
+	const unsigned long long int size = 5 * 512 * Q_CLUSTER - 1000;
+	const unsigned long long int clusters = (size + Q_CLUSTER - 1) /
+	                                        Q_CLUSTER;
+	enum q_state *s1, *s2;
+	uint8_t *d1, *d2, l1_size[4];
+	char img1[PATH_MAX], img2[PATH_MAX], raw1[PATH_MAX], raw2[PATH_MAX];
+
+	s1 = xcalloc(clusters, sizeof(*s1));
+	s2 = xcalloc(clusters, sizeof(*s2));
+	d1 = xcalloc(clusters, Q_CLUSTER);
+	d2 = xcalloc(clusters, Q_CLUSTER);
+	fill(d1, clusters * Q_CLUSTER, 1);
+	memcpy(d2, d1, clusters * Q_CLUSTER);
+
+	// Runs of every state on both sides, each pairing with each, with an
+	// L2 table that is all unallocated in file1 and one that is all data
+	// in file2, and a few changed bytes in clusters that are data in both
+	for (unsigned long long int c = 0; c < clusters; c++) {
+		s1[c] = (c / 7) % 4;
+		s2[c] = (c / 5) % 4;
+		if ((c >= 512) && (c < 1024)) s1[c] = Q_UNALLOC;
+		if ((c >= 1024) && (c < 1536)) s2[c] = Q_DATA;
+		if ((c % 37 == 0) && (s1[c] == Q_DATA) && (s2[c] == Q_DATA)) {
+			d2[c * Q_CLUSTER + c % Q_CLUSTER] ^= 0x5a;
+		}
+	}
+	// The last cluster differs past the guest size, which must not show
+	s1[clusters - 1] = Q_DATA;
+	s2[clusters - 1] = Q_DATA;
+	d2[clusters * Q_CLUSTER - 1] ^= 0xff;
+
+	make_qcow2("a.qcow2", "a.raw", s1, size, d1, NULL, 3);
+	make_qcow2("b.qcow2", "b.raw", s2, size, d2, NULL, 3);
+	tmp_path(img1, "qcow2:", "a.qcow2");
+	tmp_path(img2, "qcow2:", "b.qcow2");
+	tmp_path(raw1, "", "a.raw");
+	tmp_path(raw2, "", "b.raw");
+
+	for (size_t i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+		check_same("qcow2 against raw", opts[i], img1, img2, raw1,
+		           raw2, NULL, NULL);
+	}
+	check_same("qcow2 against raw, skips", "-l", img1, img2, raw1, raw2,
+	           "12345", "12345");
+	check_same("qcow2 file1 against its raw", "-s", img1, raw1, raw1,
+	           raw1, NULL, NULL);
+	check_same("qcow2 file2 against its raw", "-s", img2, raw2, raw2,
+	           raw2, NULL, NULL);
+
+	// Version 2 images read the zero flag's bit as part of the entry
+	make_qcow2("v2.qcow2", "v2.raw", s1, size, d1, NULL, 2);
+	tmp_path(img1, "qcow2:", "v2.qcow2");
+	tmp_path(raw1, "", "v2.raw");
+	check_same("qcow2 version 2 against raw", "", img1, raw2, raw1, raw2,
+	           NULL, NULL);
+
+	// Not supported: unallocated clusters would have to come from the
+	// backing file, so reading them as zeros would be wrong
+	make_qcow2("c.qcow2", NULL, s1, size, d1, "a.raw", 3);
+	tmp_path(img1, "qcow2:", "c.qcow2");
+	check_refused("qcow2 with a backing file", img1,
+	              "backing files are not supported");
+
+	// L1 tables that can't cover the guest, or are larger than the image
+	make_qcow2("d.qcow2", NULL, s1, size, d1, NULL, 3);
+	tmp_path(img1, "qcow2:", "d.qcow2");
+	put_be32(l1_size, 1);
+	patch_file("d.qcow2", 36, l1_size, 4);
+	check_refused("qcow2 with a short L1 table", img1,
+	              "L1 table too small");
+	put_be32(l1_size, 0xffffffff);
+	patch_file("d.qcow2", 36, l1_size, 4);
+	check_refused("qcow2 with an L1 table past the end", img1,
+	              "L1 table doesn't fit");
+
+	free(s1);
+	free(s2);
+	free(d1);
+	free(d2);
+}
+
+
+// ext4 images
+//
+// Groups are laid out as mke2fs does without flex_bg: a copy of the
+// superblock and the descriptors where the group has one, then the block
+// bitmap, the inode bitmap and the inode table, then data. Data units are
+// allocated at random, in runs. Groups other than the first that get no
+// data are flagged BLOCK_UNINIT, with junk in their bitmap blocks that
+// hexdiff must not read. Inodes are not written, as hexdiff reads only the
+// bitmaps.
+#define E_INODES 32                // inodes per group
+#define E_INODE_SIZE 256
+#define E_RESERVED_GDT 2
+#define E_SPARSE_SUPER2 0x200
+#define E_64BIT 0x80
+#define E_SPARSE_SUPER 0x1
+#define E_GDT_CSUM 0x10
+#define E_BIGALLOC 0x200
+#define E_BLOCK_UNINIT 0x2
+
+struct ext4_opts {
+	const char *name;
+	unsigned int log_block;    // log2 of the block size, less 10
+	unsigned int log_cluster;  // log2 of blocks per cluster, for bigalloc
+	unsigned int desc_size;    // 64 for 64bit
+	unsigned int per_group;    // blocks per group
+	unsigned int groups;       // whole groups, then one of 100 blocks
+	int sparse_super2;         // backups in groups 1 and 6 only
+};
+
+struct ext4_img {
+	const struct ext4_opts *o;
+	unsigned int block_size;
+	unsigned int unit;         // bytes per bitmap bit
+	unsigned long long int first, blocks, size, units, groups, gdt_blocks;
+	uint8_t *img;
+	uint8_t *used;             // one byte per unit
+	uint8_t *uninit;           // one byte per group
+};
+
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+
+static int e_has_super(const struct ext4_img *e, unsigned long long int g)
+{
+	unsigned long long int p;
+
+	if (e->o->sparse_super2) return (g == 0) || (g == 1) || (g == 6);
+	if (g <= 1) return 1;
+	for (unsigned int b = 3; b <= 7; b += 2) {
+		for (p = b; p < g; p *= b);
+		if (p == g) return 1;
+	}
+	return 0;
+}
+
+
+// Mark the units holding count blocks from block as in use
+static void e_mark(struct ext4_img *e, unsigned long long int block,
+                   unsigned long long int count)
+{
+	unsigned long long int start = block * e->block_size - e->first;
+	unsigned long long int end = start + count * e->block_size;
+
+	for (unsigned long long int u = start / e->unit; u * e->unit < end;
+	     u++) {
+		if (u < e->units) e->used[u] = 1;
+	}
+}
+
+
+// Lay out an image of the given geometry, with noise from seed everywhere
+// and only the groups' metadata in use
+static void e_init(struct ext4_img *e, const struct ext4_opts *o,
+                   uint64_t seed)
+{
+	unsigned long long int start, meta;
+
+	e->o = o;
+	e->block_size = 1024 << o->log_block;
+	e->unit = e->block_size << o->log_cluster;
+	e->first = ((o->log_block == 0) && (o->log_cluster == 0)) ?
+	           e->block_size : 0;
+	e->groups = o->groups + 1;
+	e->blocks = e->first / e->block_size + o->groups * o->per_group +
+	            100;
+	e->size = e->blocks * e->block_size;
+	e->units = (e->size - e->first + e->unit - 1) / e->unit;
+	e->gdt_blocks = (e->groups * o->desc_size + e->block_size - 1) /
+	                e->block_size;
+	e->img = xcalloc(e->size, 1);
+	e->used = xcalloc(e->units, 1);
+	e->uninit = xcalloc(e->groups, 1);
+	fill(e->img, e->size, seed);
+
+	for (unsigned long long int g = 0; g < e->groups; g++) {
+		start = e->first / e->block_size + g * o->per_group;
+		meta = 2 + E_INODES * E_INODE_SIZE / e->block_size;
+		if (e_has_super(e, g)) meta += 1 + e->gdt_blocks +
+		                               E_RESERVED_GDT;
+		// Group 0 also covers the boot block when it starts at 0
+		if ((g == 0) && (e->first == 0)) meta += 1024 / e->block_size;
+		e_mark(e, start, meta);
+	}
+}
+
+
+// Allocate data at random, leaving out the groups in skip
+static void e_alloc(struct ext4_img *e, uint64_t seed, unsigned int skip)
+{
+	unsigned long long int per = e->o->per_group >> e->o->log_cluster;
+	uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+	int cur = 0;
+
+	for (unsigned long long int g = 0; g < e->groups; g++) {
+		if ((g != 0) && (skip & (1U << g))) {
+			e->uninit[g] = 1;
+			continue;
+		}
+		for (unsigned long long int u = g * per;
+		     (u < (g + 1) * per) && (u < e->units); u++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			if (state % 6 == 0) cur = !cur;
+			if (cur) e->used[u] = 1;
+		}
+	}
+}
+
+
+// Write the superblocks, descriptors and bitmaps over the noise
+static void e_write(struct ext4_img *e)
+{
+	const struct ext4_opts *o = e->o;
+	unsigned long long int per = o->per_group >> o->log_cluster;
+	unsigned long long int first_block = e->first / e->block_size;
+	unsigned long long int start, block, bb, u;
+	uint8_t sb[1024], *gdt, *d, *bitmap;
+
+	memset(sb, 0, sizeof(sb));
+	put_le32(sb, e->groups * E_INODES);
+	put_le32(sb + 4, e->blocks);
+	put_le32(sb + 20, first_block);
+	put_le32(sb + 24, o->log_block);
+	put_le32(sb + 28, o->log_block + o->log_cluster);
+	put_le32(sb + 32, o->per_group);
+	put_le32(sb + 36, per);
+	put_le32(sb + 40, E_INODES);
+	put_le16(sb + 56, 0xef53);
+	put_le16(sb + 88, E_INODE_SIZE);
+	put_le32(sb + 92, o->sparse_super2 ? E_SPARSE_SUPER2 : 0);
+	put_le32(sb + 96, (o->desc_size == 64) ? E_64BIT : 0);
+	put_le32(sb + 100, E_SPARSE_SUPER | E_GDT_CSUM |
+	         (o->log_cluster ? E_BIGALLOC : 0));
+	put_le16(sb + 206, E_RESERVED_GDT);
+	put_le16(sb + 0xfe, o->desc_size);
+	put_le32(sb + 0x24c, 1);
+	put_le32(sb + 0x250, 6);
+
+	gdt = xcalloc(e->gdt_blocks, e->block_size);
+	for (unsigned long long int g = 0; g < e->groups; g++) {
+		start = first_block + g * o->per_group;
+		block = start;
+		if (e_has_super(e, g)) {
+			if (g == 0) block = 1024 / e->block_size;
+			block += 1 + e->gdt_blocks + E_RESERVED_GDT;
+		}
+		if ((g == 0) && (e->first == 0)) block += 1024 / e->block_size;
+		bb = block;
+		d = gdt + g * o->desc_size;
+		put_le32(d, bb);
+		put_le32(d + 4, bb + 1);
+		put_le32(d + 8, bb + 2);
+		put_le16(d + 0x12, e->uninit[g] ? E_BLOCK_UNINIT : 0);
+		// Junk where only 64-bit descriptors have fields hexdiff
+		// doesn't read, to catch a wrong descriptor size
+		if (o->desc_size == 64) memset(d + 0x2c, 0xee, 0x14);
+
+		bitmap = e->img + bb * e->block_size;
+		if (e->uninit[g]) {
+			memset(bitmap, 0xff, e->block_size);
+			continue;
+		}
+		memset(bitmap, 0, e->block_size);
+		for (unsigned long long int i = 0; i < per; i++) {
+			u = g * per + i;
+			if ((u >= e->units) || e->used[u]) {
+				bitmap[i / 8] |= 1 << (i % 8);
+			}
+		}
+	}
+
+	for (unsigned long long int g = 0; g < e->groups; g++) {
+		if (!e_has_super(e, g)) continue;
+		block = (g == 0) ? 1024 / e->block_size :
+		        first_block + g * o->per_group;
+		memcpy(e->img + ((g == 0) ? 1024 : block * e->block_size),
+		       sb, sizeof(sb));
+		memcpy(e->img + (block + 1) * e->block_size, gdt,
+		       e->groups * o->desc_size);
+	}
+	free(gdt);
+}
+
+
+// Bytes of unit u that lie within the image
+static unsigned long long int e_unit_len(const struct ext4_img *e,
+                                         unsigned long long int u)
+{
+	unsigned long long int off = e->first + u * e->unit;
+
+	return (e->size - off < e->unit) ? e->size - off : e->unit;
+}
+
+
+// Check that the -s summary counts only the bytes in use in either image
+static void check_compared(const char *name, const char *img1,
+                           const char *img2, const struct ext4_img *a,
+                           const struct ext4_img *b)
+{
+	const char *args[] = { "-s", img1, img2, NULL };
+	unsigned long long int want, got;
+	char *out;
+	size_t len;
+	int status;
+
+	want = a->first;
+	for (unsigned long long int u = 0; u < a->units; u++) {
+		if (a->used[u] || b->used[u]) want += e_unit_len(a, u);
+	}
+	status = run(args, &out, &len);
+	report(name, "-s", (status == 0) &&
+	       (sscanf(out, "%llu bytes compared", &got) == 1) &&
+	       (got == want));
+	free(out);
+}
+
+
+// Check the --alloc list against the bitmaps
+static void check_alloc(const char *name, const char *img1,
+                        const char *img2, const struct ext4_img *a,
+                        const struct ext4_img *b)
+{
+	const char *args[] = { "-s", "--alloc", img1, img2, NULL };
+	unsigned long long int only[2], start, n;
+	char *out, *want, *p;
+	size_t len, cap;
+	int status, state, prev;
+
+	// Runs of units in use on one side only, then the summary ahead
+	cap = 256 + a->units * 48;
+	want = xcalloc(cap, 1);
+	p = want + 128;
+	only[0] = only[1] = 0;
+	prev = 0;
+	start = 0;
+	for (unsigned long long int u = 0; u <= a->units; u++) {
+		state = (u == a->units) ? 0 : a->used[u] - b->used[u];
+		if ((state != prev) && (prev != 0)) {
+			n = a->first + u * a->unit;
+			if (n > a->size) n = a->size;
+			n -= a->first + start * a->unit;
+			only[prev < 0] += n;
+			p += sprintf(p, "0x%010llx  0x%010llx  %llu  file%d "
+			             "only\n", a->first + start * a->unit,
+			             a->first + start * a->unit, n,
+			             (prev > 0) ? 1 : 2);
+		}
+		if (state != prev) start = u;
+		prev = state;
+	}
+	n = snprintf(want, 128, "%llu bytes allocated in file1 only, %llu "
+	             "in file2 only\n", only[0], only[1]);
+	memmove(want + n, want + 128, p - (want + 128) + 1);
+
+	status = run(args, &out, &len);
+	report(name, "--alloc", (status == 0) && (only[0] > 0) &&
+	       (only[1] > 0) && (strstr(out, want) != NULL));
+	free(out);
+	free(want);
+}
+
+
+static void test_ext4_layout(const struct ext4_opts *o)
+{
+	static const char *const opts[] = { "", "-l", "-j4" };
+	struct ext4_img a, b;
+	char img1[PATH_MAX], img2[PATH_MAX], raw1[PATH_MAX], raw2[PATH_MAX];
+	unsigned long long int off;
+
+	e_init(&a, o, 3);
+	e_init(&b, o, 4);
+	// Groups 3 and 6 have a backup with only one of sparse_super and
+	// sparse_super2
+	e_alloc(&a, 5, (1U << 2) | (1U << 4) | (1U << 6) | (1U << 8));
+	e_alloc(&b, 6, (1U << 2) | (1U << 3) | (1U << 5) | (1U << 8));
+
+	// Units in use on either side start out alike, with a few changed
+	// bytes in those in use on both, while free units keep their noise
+	for (unsigned long long int u = 0; u < a.units; u++) {
+		off = a.first + u * a.unit;
+		if (a.used[u] || b.used[u]) {
+			memcpy(b.img + off, a.img + off, e_unit_len(&a, u));
+		}
+		if (a.used[u] && b.used[u] && (u % 13 == 0)) {
+			b.img[off + u % e_unit_len(&a, u)] ^= 0x5a;
+		}
+	}
+	memcpy(b.img, a.img, a.first);
+	e_write(&a);
+	e_write(&b);
+	write_file("a.ext4", a.img, a.size);
+	write_file("b.ext4", b.img, b.size);
+
+	// The raw files read as the allocated-only compare should: free in
+	// both means matching
+	for (unsigned long long int u = 0; u < a.units; u++) {
+		if (a.used[u] || b.used[u]) continue;
+		off = a.first + u * a.unit;
+		memset(a.img + off, 0, e_unit_len(&a, u));
+		memset(b.img + off, 0, e_unit_len(&a, u));
+	}
+	write_file("a.raw", a.img, a.size);
+	write_file("b.raw", b.img, b.size);
+	tmp_path(img1, "ext4:", "a.ext4");
+	tmp_path(img2, "ext4:", "b.ext4");
+	tmp_path(raw1, "", "a.raw");
+	tmp_path(raw2, "", "b.raw");
+
+	for (size_t i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+		check_same(o->name, opts[i], img1, img2, raw1, raw2, NULL,
+		           NULL);
+	}
+	check_compared(o->name, img1, img2, &a, &b);
+	check_alloc(o->name, img1, img2, &a, &b);
+
+	free(a.img);
+	free(a.used);
+	free(a.uninit);
+	free(b.img);
+	free(b.used);
+	free(b.uninit);
+}
+
+
+static void test_ext4(void)
+{
+	static const struct ext4_opts layouts[] = {
+		{ "ext4, 1 KiB blocks", 0, 0, 32, 256, 9, 0 },
+		{ "ext4, 64-bit descriptors", 2, 0, 64, 128, 9, 0 },
+		{ "ext4, sparse_super2", 0, 0, 32, 256, 9, 1 },
+		{ "ext4, bigalloc", 0, 2, 32, 256, 9, 0 },
+		{ "ext4, 64-bit bigalloc", 2, 2, 64, 512, 9, 0 },
+	};
+	struct ext4_img e;
+	char img[PATH_MAX];
+
+	for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		test_ext4_layout(&layouts[i]);
+	}
+
+	// The high half of a 64-bit descriptor must be read: here it puts
+	// the first group's bitmap past the end of the image
+	e_init(&e, &layouts[1], 7);
+	e_write(&e);
+	e.img[(1024 / e.block_size + 1) * e.block_size + 0x20] = 1;
+	write_file("c.ext4", e.img, e.size);
+	tmp_path(img, "ext4:", "c.ext4");
+	check_refused("ext4, high half of 64-bit descriptors", img,
+	              "bad block bitmap location in group 0");
+	free(e.img);
+	free(e.used);
+	free(e.uninit);
+}
+
+
+int main(int argc, char **argv)
+{
+	char *tmp;
+	int opt;
+
+
+	// Parse the input arguments
+	while ((opt = getopt(argc, argv, "hx:")) != -1) {
+		switch (opt) {
+		case 'h':
+			show_help(argv, 1);
+			break;
+		case 'x':
+			hexdiff = optarg;
+			break;
+		default:
+			show_help(argv, 0);
+		}
+	}
+	if (optind != argc) show_help(argv, 0);
+
+	if ((tmp = getenv("TMPDIR")) == NULL) tmp = "/tmp";
+	snprintf(dir, PATH_MAX, "%s/hdtest.XXXXXX", tmp);
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	atexit(remove_files);
+
+	test_qcow2();
+	test_ext4();
+
+	if (failures > 0) {
+		printf("%d failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
@@ -18,19 +18,51 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <elf.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 
-// ANSI escape sequences
-static const char ansi_green[] = "\x1B""[32m";
-static const char ansi_red[] = "\x1B""[31m";
-static const char ansi_reset[] = "\x1B""[0m";
+// ANSI escape sequences, all empty with --color=never
+static const char *ansi_green = "\x1B""[32m";
+static const char *ansi_red = "\x1B""[31m";
+static const char *ansi_reset = "\x1B""[0m";
+static size_t ansi_reset_len = 4;
 static const char empty_str[] = "";
 
 
@@ -45,19 +77,707 @@ static void sigint_handler(int signum)
 static void show_help(char **argv, int verbose)
 {
 	fprintf(stderr,
-	        "Usage: %s [-ah] [-n len] file1 file2 [skip1 [skip2]]\n",
-	        argv[0]);
+	        "Usage: %s [-achlrs] [-C sock] [-j jobs] [-m mem] [-n len] "
+	        "[-o file] file1 file2 [skip1 [skip2]]\n"
+	        "       %s -D sock [-j jobs]\n"
+	        "       %s --git[=rows] path old-file old-hex old-mode "
+	        "new-file new-hex new-mode\n"
+	        "       %s --textconv file\n"
+	        "       %s store add dir name file\n"
+	        "       %s store diff [-als] dir name1 name2\n",
+	        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
 	if (verbose) {
 		printf(" -a      print all lines\n"
+		       " --alloc list ranges allocated in only one ext4: "
+		       "input\n"
+		       " -C sock send the request to the daemon at sock\n"
+		       " -c      compare ELF core dumps by virtual address\n"
+		       " --checksum algo:size[:pos[:be]]\n"
+		       "         label differing blocks by their crc32 or "
+		       "crc32c at pos\n"
+		       " --color when\n"
+		       "         color the rows always (default), never, or "
+		       "auto on a terminal\n"
+		       " --compact\n"
+		       "         print matching rows once, with both offsets\n"
+		       " --cpus list\n"
+		       "         pin threads in turn to the CPUs in list, "
+		       "as in 0-3,8\n"
+		       " -D sock serve requests on sock as a daemon\n"
+		       " --engine name\n"
+		       "         compare with bulk (default), dense, resync "
+		       "or auto\n"
+		       " --follow[=secs]\n"
+		       "         wait for file2 to grow, until its writer "
+		       "closes it or it\n"
+		       "         has been idle for secs\n"
+		       " --git[=rows]\n"
+		       "         run as a git external diff, summary unless "
+		       "=rows\n"
 		       " -h      show help\n"
+		       " --html  write the rows as a self-contained HTML page\n"
+		       " -j jobs number of threads to compare with, or auto "
+		       "to fit the cgroup\n"
+		       " --key-fd fd\n"
+		       "         read the key for xts: inputs from fd\n"
+		       " -l      list differing byte ranges instead of rows\n"
+		       " --load-addr addr\n"
+		       "         address of file1 offset 0, for --symbols\n"
+		       " -m mem  cap on buffer memory (K, M and G suffixes)\n"
 		       " -n len  maximum number of bytes to compare\n"
+		       " --numa auto\n"
+		       "         keep each thread and its buffers on one NUMA "
+		       "node\n"
+		       " -o file, --output file\n"
+		       "         write output to file, compressed for .gz "
+		       "or .zst\n"
+		       " --pcap  compare the packets of two pcap or pcapng "
+		       "captures\n"
+		       " --perf-counters\n"
+		       "         --profile with hardware counters per stage\n"
+		       " --profile\n"
+		       "         print the time spent reading, comparing and "
+		       "formatting\n"
+		       " -r      compare data already in the page cache first\n"
+		       " -s      print a summary instead of rows\n"
+		       " --sector-size n\n"
+		       "         sector size of xts: inputs (default 512)\n"
+		       " --strings[=N]\n"
+		       "         list printable strings of N (default 4) or "
+		       "more bytes found\n"
+		       "         in only one file\n"
+		       " --symbols file\n"
+		       "         name the symbol of each differing row, from "
+		       "an ELF file,\n"
+		       "         nm output or a linker map\n"
+		       " --textconv\n"
+		       "         dump one file as hex lines, as a git textconv "
+		       "filter\n"
+		       " --transitions[=K]\n"
+		       "         list the K (default 10) most common byte "
+		       "changes\n"
+		       " --transitions-csv file\n"
+		       "         also write the full 256x256 matrix to file\n"
 		       " skip1   starting offset for file1\n"
-		       " skip2   starting offset for file2\n");
+		       " skip2   starting offset for file2\n"
+		       "\n"
+		       "Prefix a file name with hex: to read it as a hex dump "
+		       "(xxd, od -tx1,\n"
+		       "or hexdiff's own left column), with qcow2: for a qcow2 "
+		       "image, simg: for\n"
+		       "an Android sparse image, ext4: to compare only the "
+		       "allocated blocks of\n"
+		       "an ext2/3/4 image, or with xts: for an AES-XTS "
+		       "encrypted image.\n");
 	}
 	exit(EXIT_FAILURE);
 }
 
 
+// Parse a byte count, with an optional K, M or G suffix
+static unsigned long long int parse_size(const char *str)
+{
+	unsigned long long int val;
+	char *end;
+
+	val = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'k': case 'K': val <<= 10; break;
+	case 'm': case 'M': val <<= 20; break;
+	case 'g': case 'G': val <<= 30; break;
+	}
+	return val;
+}
+
+
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if ((ptr = calloc(nmemb, size)) == NULL) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+
+// Profiling
+//
+// --profile splits the time each thread spends into stages: reading the
+// inputs, comparing, formatting rows and writing output. With
+// --perf-counters, each thread also counts cycles, instructions, cache
+// misses and branch misses with perf_event_open(), charged to the stage it
+// is in. Counters are read with rdpmc where the kernel allows it, and with
+// read() otherwise. They are often not permitted at all (in containers, or
+// with a high perf_event_paranoid), and then only the clock is reported.
+enum prof_stage {
+	STAGE_OTHER, STAGE_READ, STAGE_COMPARE, STAGE_FORMAT, STAGE_WRITE,
+	STAGES
+};
+
+enum { PC_CYCLES, PC_INSTRUCTIONS, PC_CACHE_MISSES, PC_BRANCH_MISSES,
+       PC_COUNT };
+
+// Compare engines, chosen with --engine (see the compare engine)
+enum engine { ENGINE_BULK, ENGINE_DENSE, ENGINE_RESYNC, ENGINES,
+              ENGINE_AUTO = ENGINES };
+
+static const char *engine_names[ENGINES + 1] = {
+	"bulk", "dense", "resync", "auto"
+};
+
+// Time in ns, then the counters
+#define PROF_VALUES (1 + PC_COUNT)
+
+struct prof_thread {
+	int fd[PC_COUNT];              // -1 without counters
+	struct perf_event_mmap_page *page[PC_COUNT];
+	enum prof_stage stage;
+	unsigned long long int last[PROF_VALUES];
+	unsigned long long int total[STAGES][PROF_VALUES];
+	unsigned long long int bytes;  // compared
+	unsigned long long int chunks[ENGINES];
+	unsigned long long int switches;
+	unsigned long long int resyncs;
+	struct prof_thread *next;
+};
+
+static struct {
+	int on;
+	int counters;                  // --perf-counters
+	int error;                     // why counters couldn't be opened
+	unsigned long long int start;
+	pthread_mutex_t lock;
+	struct prof_thread *all;
+	unsigned int probes;           // by --engine auto
+	unsigned long long int probe_rows;
+	unsigned long long int probe_diff;
+} prof = { 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+static __thread struct prof_thread *thread_prof;
+
+
+static unsigned long long int prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void prof_open_counters(struct prof_thread *pt)
+{
+	static const unsigned long long int config[PC_COUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+	};
+	struct perf_event_attr attr;
+	void *page;
+
+	for (int i = 0; i < PC_COUNT; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = config[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		pt->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+		                    (i == 0) ? -1 : pt->fd[0], 0);
+		if ((pt->fd[i] < 0) &&
+		    ((errno == EACCES) || (errno == EPERM))) {
+			// Kernel counting may be what's refused
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			pt->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+			                    (i == 0) ? -1 : pt->fd[0], 0);
+		}
+		if (pt->fd[i] < 0) {
+			prof.error = errno;
+			while (i-- > 0) {
+				if (pt->page[i] != NULL) {
+					munmap(pt->page[i], getpagesize());
+				}
+				close(pt->fd[i]);
+			}
+			for (i = 0; i < PC_COUNT; i++) pt->fd[i] = -1;
+			return;
+		}
+		page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED,
+		            pt->fd[i], 0);
+		pt->page[i] = (page == MAP_FAILED) ? NULL : page;
+	}
+}
+
+
+// Read a counter from user space, or return 0 to fall back on read()
+static int prof_rdpmc(struct perf_event_mmap_page *pg,
+                      unsigned long long int *value)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int seq, idx;
+	long long int pmc;
+	int ok;
+
+	if (pg == NULL) return 0;
+	do {
+		seq = pg->lock;
+		__asm__ __volatile__("" ::: "memory");
+		idx = pg->index;
+		ok = pg->cap_user_rdpmc && (idx != 0);
+		*value = pg->offset;
+		if (ok) {
+			pmc = __builtin_ia32_rdpmc(idx - 1);
+			pmc <<= 64 - pg->pmc_width;
+			*value += pmc >> (64 - pg->pmc_width);
+		}
+		__asm__ __volatile__("" ::: "memory");
+	} while (pg->lock != seq);
+	return ok;
+#else
+	return 0;
+#endif
+}
+
+
+static void prof_sample(struct prof_thread *pt, unsigned long long int *v)
+{
+	unsigned long long int group[1 + PC_COUNT];
+	int i;
+
+	v[0] = prof_now();
+	if (pt->fd[0] < 0) {
+		memset(v + 1, 0, PC_COUNT * sizeof(*v));
+		return;
+	}
+	for (i = 0; i < PC_COUNT; i++) {
+		if (!prof_rdpmc(pt->page[i], &v[1 + i])) break;
+	}
+	if ((i < PC_COUNT) &&
+	    (read(pt->fd[0], group, sizeof(group)) == sizeof(group))) {
+		memcpy(v + 1, group + 1, PC_COUNT * sizeof(*v));
+	}
+}
+
+
+static struct prof_thread *prof_thread(void)
+{
+	struct prof_thread *pt;
+
+	if (thread_prof != NULL) return thread_prof;
+	pt = xcalloc(1, sizeof(*pt));
+	if (prof.counters) {
+		prof_open_counters(pt);
+	} else {
+		for (int i = 0; i < PC_COUNT; i++) pt->fd[i] = -1;
+	}
+	prof_sample(pt, pt->last);
+	pthread_mutex_lock(&prof.lock);
+	pt->next = prof.all;
+	prof.all = pt;
+	pthread_mutex_unlock(&prof.lock);
+	thread_prof = pt;
+	return pt;
+}
+
+
+// Charge everything since the last switch to the current stage, and move
+// on to stage. Returns the stage being left, so it can be returned to.
+static enum prof_stage prof_switch(enum prof_stage stage)
+{
+	struct prof_thread *pt = prof_thread();
+	unsigned long long int now[PROF_VALUES];
+	enum prof_stage prev;
+
+	prof_sample(pt, now);
+	for (int i = 0; i < PROF_VALUES; i++) {
+		pt->total[pt->stage][i] += now[i] - pt->last[i];
+	}
+	memcpy(pt->last, now, sizeof(now));
+	prev = pt->stage;
+	pt->stage = stage;
+	return prev;
+}
+
+
+static void prof_bytes(unsigned long long int bytes)
+{
+	prof_thread()->bytes += bytes;
+}
+
+
+// Add up all threads and print the stages to stderr
+static void print_profile(void)
+{
+	static const char *names[STAGES] = {
+		"other", "read", "compare", "format", "write"
+	};
+	unsigned long long int total[STAGES][PROF_VALUES];
+	unsigned long long int chunks[ENGINES], switches, resyncs;
+	unsigned long long int bytes, wall, sum, all;
+	struct prof_thread *pt;
+	int counters;
+
+	prof_switch(STAGE_OTHER);
+	wall = prof_now() - prof.start;
+	memset(total, 0, sizeof(total));
+	memset(chunks, 0, sizeof(chunks));
+	bytes = sum = switches = resyncs = 0;
+	counters = 0;
+	pthread_mutex_lock(&prof.lock);
+	for (pt = prof.all; pt != NULL; pt = pt->next) {
+		for (int s = 0; s < STAGES; s++) {
+			for (int i = 0; i < PROF_VALUES; i++) {
+				total[s][i] += pt->total[s][i];
+			}
+			sum += pt->total[s][0];
+		}
+		bytes += pt->bytes;
+		for (int e = 0; e < ENGINES; e++) chunks[e] += pt->chunks[e];
+		switches += pt->switches;
+		resyncs += pt->resyncs;
+		if (pt->fd[0] >= 0) counters = 1;
+		for (int i = 0; i < PC_COUNT; i++) {
+			if (pt->page[i] != NULL) {
+				munmap(pt->page[i], getpagesize());
+			}
+			if (pt->fd[i] >= 0) close(pt->fd[i]);
+		}
+	}
+	pthread_mutex_unlock(&prof.lock);
+
+	if (prof.counters && !counters) {
+		fprintf(stderr, "perf counters unavailable (%s), timing "
+		        "only\n", strerror(prof.error));
+	}
+	fprintf(stderr, "stage        time  share");
+	if (counters) {
+		fprintf(stderr, "        cycles  instructions   IPC  "
+		        "cache-miss  branch-miss  cycles/B");
+	}
+	fprintf(stderr, "\n");
+	for (int s = 0; s < STAGES; s++) {
+		fprintf(stderr, "%-8s %7.3fs %5.1f%%", names[s],
+		        total[s][0] / 1e9,
+		        (sum > 0) ? 100.0 * total[s][0] / sum : 0.0);
+		if (counters) {
+			fprintf(stderr, "  %12llu  %12llu  %4.2f  %10llu  "
+			        "%11llu  %8.3f", total[s][1 + PC_CYCLES],
+			        total[s][1 + PC_INSTRUCTIONS],
+			        (total[s][1 + PC_CYCLES] > 0) ?
+			        (double)total[s][1 + PC_INSTRUCTIONS] /
+			        total[s][1 + PC_CYCLES] : 0.0,
+			        total[s][1 + PC_CACHE_MISSES],
+			        total[s][1 + PC_BRANCH_MISSES],
+			        (bytes > 0) ?
+			        (double)total[s][1 + PC_CYCLES] / bytes : 0.0);
+		}
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "%llu bytes compared in %.3fs wall clock, %.1f MB/s\n",
+	        bytes, wall / 1e9, (wall > 0) ? bytes * 1e3 / wall : 0.0);
+
+	// Which engines did the comparing, and what made --engine auto pick
+	all = 0;
+	for (int e = 0; e < ENGINES; e++) all += chunks[e];
+	if (all == 0) return;
+	fprintf(stderr, "engine    chunks  share\n");
+	for (int e = 0; e < ENGINES; e++) {
+		fprintf(stderr, "%-8s %7llu %5.1f%%\n", engine_names[e],
+		        chunks[e], 100.0 * chunks[e] / all);
+	}
+	fprintf(stderr, "%llu engine switches, %llu resyncs", switches,
+	        resyncs);
+	if (prof.probes > 0) {
+		fprintf(stderr, ", %u probes found %.1f%% of rows differing",
+		        prof.probes, (prof.probe_rows > 0) ?
+		        100.0 * prof.probe_diff / prof.probe_rows : 0.0);
+	}
+	fprintf(stderr, "\n");
+}
+
+
+// Thread placement
+//
+// --cpus pins the main thread and then each thread as it starts, readers
+// and compare workers alike, to the next CPU of the list, going round. With
+// --numa auto on a machine with more than one node, threads are also dealt
+// out to the nodes in turn: a --cpus list is reordered to take its CPUs a
+// node at a time, and without one a thread may run on any allowed CPU of
+// its node. Each thread's chunk buffers then come from slabs placed on its
+// node (see the buffer pool). With only one node, --numa auto leaves
+// threads where the scheduler puts them.
+#define PLACE_NODES 64
+#define PLACE_NODE_DIR "/sys/devices/system/node"
+#define MPOL_PREFERRED 1           // from linux/mempolicy.h
+
+static struct {
+	int on;
+	int ncpus;                 // in the --cpus list, 0 without one
+	int cpus[CPU_SETSIZE];
+	int cpu_node[CPU_SETSIZE]; // index of each one's node
+	int nnodes;
+	int node_id[PLACE_NODES];
+	cpu_set_t node_cpus[PLACE_NODES];  // allowed CPUs of each node
+	int next;                  // threads placed so far
+} place = { .nnodes = 1 };
+
+static __thread int thread_node;   // index of this thread's node
+
+
+// Parse a CPU or node list such as 0-3,8,10-11 into ids, in order.
+// Returns how many, or -1 if the list is malformed.
+static int place_list(const char *str, int *ids, int max)
+{
+	unsigned long int lo, hi;
+	int n = 0;
+	char *end;
+
+	for (;;) {
+		if (!isdigit((unsigned char)*str)) return -1;
+		lo = hi = strtoul(str, &end, 10);
+		if (*end == '-') {
+			if (!isdigit((unsigned char)end[1])) return -1;
+			hi = strtoul(end + 1, &end, 10);
+		}
+		if ((lo > hi) || (hi >= CPU_SETSIZE)) return -1;
+		for (; lo <= hi; lo++) {
+			if (n == max) return -1;
+			ids[n++] = lo;
+		}
+		if (*end != ',') break;
+		str = end + 1;
+	}
+	return ((*end == '\0') || (*end == '\n')) ? n : -1;
+}
+
+
+// Read a small sysfs file, returning 0 if it isn't there
+static int place_read(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return 0;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0) return 0;
+	buf[n] = '\0';
+	return 1;
+}
+
+
+// Find the online nodes that hold any of the allowed CPUs
+static void place_nodes(const cpu_set_t *allowed)
+{
+	int ids[PLACE_NODES], cpus[CPU_SETSIZE], nids, n, m;
+	char path[PATH_MAX], buf[4096];
+	cpu_set_t set;
+
+	n = 0;
+	nids = -1;
+	if (place_read(PLACE_NODE_DIR "/online", buf, sizeof(buf))) {
+		nids = place_list(buf, ids, PLACE_NODES);
+	}
+	for (int i = 0; i < nids; i++) {
+		snprintf(path, sizeof(path), "%s/node%d/cpulist",
+		         PLACE_NODE_DIR, ids[i]);
+		if (!place_read(path, buf, sizeof(buf))) continue;
+
+		// Nodes with no CPUs, or none we may use, are left out
+		m = place_list(buf, cpus, CPU_SETSIZE);
+		CPU_ZERO(&set);
+		for (int j = 0; j < m; j++) {
+			if (CPU_ISSET(cpus[j], allowed)) CPU_SET(cpus[j], &set);
+		}
+		if (CPU_COUNT(&set) == 0) continue;
+		place.node_id[n] = ids[i];
+		place.node_cpus[n++] = set;
+	}
+	place.nnodes = (n > 1) ? n : 1;
+}
+
+
+static int place_node_of(int cpu)
+{
+	for (int i = 0; i < place.nnodes; i++) {
+		if (CPU_ISSET(cpu, &place.node_cpus[i])) return i;
+	}
+	return 0;
+}
+
+
+// Pin the calling thread to its turn of the CPUs or nodes, and take its
+// buffers from that node from now on
+static void place_thread(void)
+{
+	cpu_set_t set;
+	int k, err;
+
+	if (!place.on) return;
+	k = __atomic_fetch_add(&place.next, 1, __ATOMIC_RELAXED);
+	if (place.ncpus > 0) {
+		k %= place.ncpus;
+		CPU_ZERO(&set);
+		CPU_SET(place.cpus[k], &set);
+		thread_node = place.cpu_node[k];
+	} else {
+		thread_node = k % place.nnodes;
+		set = place.node_cpus[thread_node];
+	}
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0) {
+		fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+// Set up --cpus (list, or NULL) and --numa auto, and place the calling
+// thread
+static void place_init(const char *list, int numa)
+{
+	int ids[CPU_SETSIZE], node[CPU_SETSIZE], next[PLACE_NODES], n, k;
+	cpu_set_t allowed;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		fprintf(stderr, "sched_getaffinity: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (numa) place_nodes(&allowed);
+
+	n = 0;
+	if (list != NULL) {
+		if ((n = place_list(list, ids, CPU_SETSIZE)) < 0) {
+			fprintf(stderr, "--cpus: bad list %s\n", list);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (!CPU_ISSET(ids[i], &allowed)) {
+			fprintf(stderr, "--cpus: CPU %d is not available\n",
+			        ids[i]);
+			exit(EXIT_FAILURE);
+		}
+		node[i] = place_node_of(ids[i]);
+	}
+
+	// Order the listed CPUs by taking one from each node in turn, each
+	// node's CPUs in list order
+	memset(next, 0, sizeof(next));
+	for (k = 0; k < n; ) {
+		for (int j = 0; j < place.nnodes; j++) {
+			while ((next[j] < n) && (node[next[j]] != j)) next[j]++;
+			if (next[j] == n) continue;
+			place.cpus[k] = ids[next[j]];
+			place.cpu_node[k++] = j;
+			next[j]++;
+		}
+	}
+	place.ncpus = n;
+	place.on = (n > 0) || (place.nnodes > 1);
+	place_thread();
+}
+
+
+// Output buffers
+//
+// All output is formatted straight into an output buffer. When the buffer
+// fills up, its flush hook passes it on: to a FILE, to a compressor, or,
+// for memory buffers, it just grows. need is the room the caller wants.
+#define OUTBUF_SIZE (64 * 1024)
+
+struct outbuf {
+	char *buf;
+	size_t len;
+	size_t cap;
+	void (*flush)(struct outbuf *ob, size_t need);
+	FILE *file;
+};
+
+
+static void ob_grow(struct outbuf *ob, size_t need)
+{
+	while (ob->cap - ob->len < need) ob->cap *= 2;
+	if ((ob->buf = realloc(ob->buf, ob->cap)) == NULL) {
+		fprintf(stderr, "realloc: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+static void ob_file_flush(struct outbuf *ob, size_t need)
+{
+	enum prof_stage stage = STAGE_OTHER;
+
+	if (prof.on) stage = prof_switch(STAGE_WRITE);
+	if ((ob->len > 0) &&
+	    (fwrite(ob->buf, 1, ob->len, ob->file) != ob->len)) {
+		fprintf(stderr, "write: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (prof.on) prof_switch(stage);
+	ob->len = 0;
+	if (need > ob->cap) ob_grow(ob, need);
+}
+
+
+static void ob_init_file(struct outbuf *ob, FILE *file)
+{
+	ob->cap = OUTBUF_SIZE;
+	ob->buf = xcalloc(1, ob->cap);
+	ob->len = 0;
+	ob->flush = ob_file_flush;
+	ob->file = file;
+}
+
+
+static void ob_init_mem(struct outbuf *ob)
+{
+	ob->cap = OUTBUF_SIZE;
+	ob->buf = xcalloc(1, ob->cap);
+	ob->len = 0;
+	ob->flush = ob_grow;
+	ob->file = NULL;
+}
+
+
+static void ob_write(struct outbuf *ob, const void *data, size_t len)
+{
+	if (ob->cap - ob->len < len) ob->flush(ob, len);
+	memcpy(ob->buf + ob->len, data, len);
+	ob->len += len;
+}
+
+
+__attribute__((format(printf, 2, 3)))
+static void ob_printf(struct outbuf *ob, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(ob->buf + ob->len, ob->cap - ob->len, fmt, ap);
+	va_end(ap);
+	if ((n >= 0) && ((size_t)n >= ob->cap - ob->len)) {
+		ob->flush(ob, n + 1);
+		va_start(ap, fmt);
+		vsnprintf(ob->buf + ob->len, ob->cap - ob->len, fmt, ap);
+		va_end(ap);
+	}
+	if (n > 0) ob->len += n;
+}
+
+
+// Push out everything buffered so far
+static void ob_flush(struct outbuf *ob)
+{
+	if (ob->flush == ob_grow) return;
+	ob->flush(ob, 0);
+	if (ob->file != NULL) fflush(ob->file);
+}
+
+
 static void printicize(uint8_t * buf)
 {
 	// Convert non-ASCII printable values to '.'
@@ -69,37 +789,41 @@ static void printicize(uint8_t * buf)
 }
 
 
-static void print_same(uint8_t *buf1, uint8_t *buf2,
-                       unsigned long long int skip1,
+static void print_same(struct outbuf *out, const uint8_t *in1,
+                       const uint8_t *in2, unsigned long long int skip1,
                        unsigned long long int skip2,
 		       unsigned long long int cnt)
 {
+	uint8_t buf1[8], buf2[8];
+
+	// printicize() works in place, so format from copies of the rows
+	memcpy(buf1, in1, 8);
+	memcpy(buf2, in2, 8);
+
 	// Print the left side
-	printf("%s0x%010llx  "
-	       "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx ",
-	       ansi_reset, skip1 + cnt, buf1[0], buf1[1], buf1[2], buf1[3],
-	       buf1[4], buf1[5], buf1[6], buf1[7]);
+	ob_printf(out, "%s0x%010llx  "
+	          "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx ",
+	          ansi_reset, skip1 + cnt, buf1[0], buf1[1], buf1[2],
+	          buf1[3], buf1[4], buf1[5], buf1[6], buf1[7]);
 	printicize(buf1);
-	printf("%c%c%c%c%c%c%c%c    ", buf1[0], buf1[1], buf1[2], buf1[3],
-	       buf1[4], buf1[5], buf1[6], buf1[7]);
+	ob_printf(out, "%c%c%c%c%c%c%c%c    ", buf1[0], buf1[1], buf1[2],
+	          buf1[3], buf1[4], buf1[5], buf1[6], buf1[7]);
 
 	// Print the right side
-	printf("0x%010llx  "
-	       "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx ",
-	       skip2 + cnt, buf2[0], buf2[1], buf2[2], buf2[3], buf2[4],
-	       buf2[5], buf2[6], buf2[7]);
+	ob_printf(out, "0x%010llx  "
+	          "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx ",
+	          skip2 + cnt, buf2[0], buf2[1], buf2[2], buf2[3], buf2[4],
+	          buf2[5], buf2[6], buf2[7]);
 	printicize(buf2);
-	printf("%c%c%c%c%c%c%c%c\n", buf2[0], buf2[1], buf2[2], buf2[3],
-	       buf2[4], buf2[5], buf2[6], buf2[7]);
+	ob_printf(out, "%c%c%c%c%c%c%c%c\n", buf2[0], buf2[1], buf2[2],
+	          buf2[3], buf2[4], buf2[5], buf2[6], buf2[7]);
 }
 
 
-static void print_diff(uint8_t *buf1, uint8_t *buf2,
-                       unsigned long long int skip1,
-                       unsigned long long int skip2,
-		       unsigned long long int cnt)
+// Escape sequence to put before each byte of a differing row
+static void diff_colors(const uint8_t *buf1, const uint8_t *buf2,
+                        const char **color)
 {
-	const char *color[8];
 	const char *color_last;
 
 	// Assign escape sequences as appropriate for each byte
@@ -126,141 +850,7360 @@ static void print_diff(uint8_t *buf1, uint8_t *buf2,
 			color_last = color[i];
 		}
 	}
+}
+
+
+// Print a differing row, leaving the line open for an annotation
+static void print_diff(struct outbuf *out, const uint8_t *in1,
+                       const uint8_t *in2, unsigned long long int skip1,
+                       unsigned long long int skip2,
+		       unsigned long long int cnt)
+{
+	const char *color[8];
+	uint8_t buf1[8], buf2[8];
+
+	memcpy(buf1, in1, 8);
+	memcpy(buf2, in2, 8);
+	diff_colors(buf1, buf2, color);
 
 	// Print the left side
-	printf("%s0x%010llx  "
-	       "%s%02hhx%s%02hhx%s%02hhx%s%02hhx"
-	       "%s%02hhx%s%02hhx%s%02hhx%s%02hhx ",
-	       ansi_red, skip1 + cnt, color[0], buf1[0], color[1], buf1[1],
-	       color[2], buf1[2], color[3], buf1[3], color[4], buf1[4],
-	       color[5], buf1[5], color[6], buf1[6], color[7], buf1[7]);
+	ob_printf(out, "%s0x%010llx  "
+	          "%s%02hhx%s%02hhx%s%02hhx%s%02hhx"
+	          "%s%02hhx%s%02hhx%s%02hhx%s%02hhx ",
+	          ansi_red, skip1 + cnt, color[0], buf1[0], color[1],
+	          buf1[1], color[2], buf1[2], color[3], buf1[3], color[4],
+	          buf1[4], color[5], buf1[5], color[6], buf1[6], color[7],
+	          buf1[7]);
 	printicize(buf1);
-	printf("%s%c%s%c%s%c%s%c%s%c%s%c%s%c%s%c    ", color[0], buf1[0],
-	       color[1], buf1[1], color[2], buf1[2], color[3], buf1[3],
-	       color[4], buf1[4], color[5], buf1[5], color[6], buf1[6],
-	       color[7], buf1[7]);
+	ob_printf(out, "%s%c%s%c%s%c%s%c%s%c%s%c%s%c%s%c    ", color[0],
+	          buf1[0], color[1], buf1[1], color[2], buf1[2], color[3],
+	          buf1[3], color[4], buf1[4], color[5], buf1[5], color[6],
+	          buf1[6], color[7], buf1[7]);
 
 	// Print the right side
-	printf("%s0x%010llx  "
-	       "%s%02hhx%s%02hhx%s%02hhx%s%02hhx"
-	       "%s%02hhx%s%02hhx%s%02hhx%s%02hhx ",
-	       ansi_red, skip2 + cnt, color[0], buf2[0], color[1], buf2[1],
-	       color[2], buf2[2], color[3], buf2[3], color[4], buf2[4],
-	       color[5], buf2[5], color[6], buf2[6], color[7], buf2[7]);
+	ob_printf(out, "%s0x%010llx  "
+	          "%s%02hhx%s%02hhx%s%02hhx%s%02hhx"
+	          "%s%02hhx%s%02hhx%s%02hhx%s%02hhx ",
+	          ansi_red, skip2 + cnt, color[0], buf2[0], color[1],
+	          buf2[1], color[2], buf2[2], color[3], buf2[3], color[4],
+	          buf2[4], color[5], buf2[5], color[6], buf2[6], color[7],
+	          buf2[7]);
 	printicize(buf2);
-	printf("%s%c%s%c%s%c%s%c%s%c%s%c%s%c%s%c\n", color[0], buf2[0],
-	       color[1], buf2[1], color[2], buf2[2], color[3], buf2[3],
-	       color[4], buf2[4], color[5], buf2[5], color[6], buf2[6],
-	       color[7], buf2[7]);
-	printf("%s", ansi_reset);
+	ob_printf(out, "%s%c%s%c%s%c%s%c%s%c%s%c%s%c%s%c", color[0],
+	          buf2[0], color[1], buf2[1], color[2], buf2[2], color[3],
+	          buf2[3], color[4], buf2[4], color[5], buf2[5], color[6],
+	          buf2[6], color[7], buf2[7]);
 }
 
 
-int main(int argc, char **argv)
-{
-	int opt, show_all, input_end;
-	unsigned long long int max_len, skip1, skip2, cnt, eq_run;
-	char *fname1, *fname2;
-	FILE *file1, *file2;
-	struct sigaction sigint_action;
-	uint8_t buf1[8], buf2[8];
+// Compact layout
+//
+// With --compact, matching rows are printed once, with both offsets, and only
+// differing rows are shown side by side. Matching rows are most of what a -a
+// run prints, so they get a formatter of their own that fills in the
+// fixed-width line from a digit table rather than going through ob_printf().
+#define COMPACT_ROW_LEN (ansi_reset_len + 2 * 14 + 16 + 1 + 8 + 1)
 
+static const char hex_digits[] = "0123456789abcdef";
 
-	// Parse the input arguments
-	show_all = 0;
-	max_len = 0;
-	while ((opt = getopt(argc, argv, "ahn:")) != -1) {
-		switch (opt) {
-		case 'a':
-			show_all = 1;
-			break;
-		case 'h':
-			show_help(argv, 1);
-		case 'n':
-			max_len = strtoull(optarg, NULL, 0);
-			break;
-		default:
-			show_help(argv, 0);
-		}
+
+static char *put_addr(char *p, unsigned long long int addr)
+{
+	p[0] = '0';
+	p[1] = 'x';
+	for (int i = 11; i >= 2; i--) {
+		p[i] = hex_digits[addr & 0xf];
+		addr >>= 4;
 	}
+	p[12] = ' ';
+	p[13] = ' ';
+	return p + 14;
+}
 
-	// Get the filenames and any skip values
-	if ((argc - optind) < 2) show_help(argv, 0);
-	fname1 = argv[optind++];
-	fname2 = argv[optind++];
-	skip1 = (optind < argc) ? strtoull(argv[optind++], NULL, 0) : 0;
-	skip2 = (optind < argc) ? strtoull(argv[optind++], NULL, 0) : 0;
-	if (optind < argc) show_help(argv, 0); //Leftover arguments
 
-	// Open the files and seek to the appropriate spots
-	if ((file1 = fopen(fname1, "r")) == NULL) {
-		fprintf(stderr, "fopen: %s: %s\n", fname1, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	if ((file2 = fopen(fname2, "r")) == NULL) {
-		fprintf(stderr, "fopen: %s: %s\n", fname2, strerror(errno));
-		exit(EXIT_FAILURE);
+static void print_compact(struct outbuf *out, const uint8_t *in,
+                          unsigned long long int skip1,
+                          unsigned long long int skip2,
+                          unsigned long long int cnt)
+{
+	char *p;
+
+	// Offsets past 10 digits don't fit the fixed layout
+	if (((skip1 + cnt) | (skip2 + cnt)) >> 40) {
+		uint8_t buf[8];
+
+		memcpy(buf, in, 8);
+		ob_printf(out, "%s0x%010llx  0x%010llx  "
+		          "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx ",
+		          ansi_reset, skip1 + cnt, skip2 + cnt, buf[0], buf[1],
+		          buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
+		printicize(buf);
+		ob_printf(out, "%c%c%c%c%c%c%c%c\n", buf[0], buf[1], buf[2],
+		          buf[3], buf[4], buf[5], buf[6], buf[7]);
+		return;
 	}
 
-	if (fseeko(file1, skip1, 0) != 0) {
-		fprintf(stderr,
-		        "fseek to 0x%x in %s: %s\n", skip1, fname1,
-		        strerror(errno));
-		exit(EXIT_FAILURE);
+	if (out->cap - out->len < COMPACT_ROW_LEN) {
+		out->flush(out, COMPACT_ROW_LEN);
 	}
-	if (fseeko(file2, skip2, 0) != 0) {
-		fprintf(stderr,
-		        "fseek to 0x%x in %s: %s\n", skip2, fname2,
-		        strerror(errno));
-		exit(EXIT_FAILURE);
+	p = out->buf + out->len;
+	memcpy(p, ansi_reset, ansi_reset_len);
+	p += ansi_reset_len;
+	p = put_addr(p, skip1 + cnt);
+	p = put_addr(p, skip2 + cnt);
+	for (int i = 0; i < 8; i++) {
+		p[2 * i] = hex_digits[in[i] >> 4];
+		p[2 * i + 1] = hex_digits[in[i] & 0xf];
+		p[17 + i] = ((in[i] < 0x20) || (in[i] > 0x7e)) ? '.' : in[i];
 	}
+	p[16] = ' ';
+	p[25] = '\n';
+	out->len += COMPACT_ROW_LEN;
+}
 
-	// Set up signal handler for SIGINT
-	sigint_action.sa_handler = sigint_handler;
-	sigaction(SIGINT, &sigint_action, NULL);
 
-	// Begin printing output
-	printf("%s   offset      0 1 2 3 4 5 6 7 01234567    "
-	       "   offset      0 1 2 3 4 5 6 7 01234567\n",
-	       ansi_reset);
-	
-	input_end = 0;
-	cnt = 0;
-	eq_run = 0;
-	while ((input_end == 0) && ((cnt < max_len) || (max_len == 0)) &&
-	       (sigint_recv == 0)) {
-		// If we fail to fill the buffer due to EOF, we want
-		// the residual values to be 0
-		memset(buf1, 0, 8);
-		memset(buf2, 0, 8);
-
-		// TODO: Probably less I/O overhead if we read more than
-		// 8 bytes at a time. Or, threads...
-		if (fread(buf1, 1, 8, file1) != 8) {
-			input_end = 1;
-		}
-		if (fread(buf2, 1, 8, file2) != 8) {
-			input_end = 1;
-		}
-		
-		if (memcmp(buf1, buf2, 8) == 0) {
-			if ((eq_run == 0) || (show_all == 1)) {
-				print_same(buf1, buf2, skip1, skip2, cnt);	
-			} else if (eq_run == 1) {
-				printf("...\n");
-			}
-			eq_run++;
-		} else {
-			print_diff(buf1, buf2, skip1, skip2, cnt);
-			eq_run = 0;
+// Longest line put_diff() writes: two sides of an address, eight colored
+// hex pairs and eight colored characters, then the end of the line
+#define DIFF_ROW_MAX (2 * (5 + 14 + 8 * (5 + 2 + 5 + 1) + 1 + 4) + 1 + 4)
+
+
+static char *put_str(char *p, const char *s)
+{
+	while (*s != '\0') *p++ = *s++;
+	return p;
+}
+
+
+// A whole differing row as print_diff() and text_diff() write it without
+// symbols, filled in from the digit table. The offsets must fit in 10
+// digits.
+static void put_diff(struct outbuf *out, const uint8_t *in1,
+                     const uint8_t *in2, unsigned long long int skip1,
+                     unsigned long long int skip2, unsigned long long int cnt)
+{
+	const char *color[8];
+	const uint8_t *in;
+	char *p;
+
+	diff_colors(in1, in2, color);
+	if (out->cap - out->len < DIFF_ROW_MAX) {
+		out->flush(out, DIFF_ROW_MAX);
+	}
+	p = out->buf + out->len;
+	for (int side = 0; side < 2; side++) {
+		in = (side == 0) ? in1 : in2;
+		p = put_str(p, ansi_red);
+		p = put_addr(p, ((side == 0) ? skip1 : skip2) + cnt);
+		for (int i = 0; i < 8; i++) {
+			p = put_str(p, color[i]);
+			*p++ = hex_digits[in[i] >> 4];
+			*p++ = hex_digits[in[i] & 0xf];
+		}
+		*p++ = ' ';
+		for (int i = 0; i < 8; i++) {
+			p = put_str(p, color[i]);
+			*p++ = ((in[i] < 0x20) || (in[i] > 0x7e)) ? '.' : in[i];
 		}
-	
-		cnt += 8;
+		if (side == 0) p = put_str(p, "    ");
 	}
+	*p++ = '\n';
+	p = put_str(p, ansi_reset);
+	out->len = p - out->buf;
+}
 
-	fclose(file1);
-	fclose(file2);
 
-	return 0;
-}
+// Input sources
+//
+// Every input file is read through a struct source, which hides how the
+// bytes are stored on disk. Reads are positional, but the compare loop only
+// ever moves forward, so streaming sources (like hex dumps) can refuse to
+// go backwards. A short read means the end of the input.
+//
+// Sources that know where their holes are can also provide extent(), which
+// reports whether the bytes at off are data, known zeros, a known 4-byte
+// fill pattern (given as it lies at 4-aligned offsets) or unused space whose
+// contents don't matter, and how far that extends. Only data extents run
+// past the end of the input.
+enum extent_kind { EXTENT_DATA, EXTENT_ZERO, EXTENT_FILL, EXTENT_UNUSED };
+
+struct source {
+	const char *name;
+	size_t (*read)(struct source *src, uint8_t *buf, size_t len,
+	               unsigned long long int off);
+	enum extent_kind (*extent)(struct source *src,
+	                           unsigned long long int off,
+	                           unsigned long long int *len,
+	                           uint8_t *fill);
+	void (*close)(struct source *src);
+	int fd;
+	FILE *file;
+	unsigned long long int pos;
+	int growing;               // a short read may not be the end yet
+	void *priv;
+};
 
+
+// Plain files are read with pread(), so one source can be shared between
+// threads. Pipes can't be seeked, but still work as long as they are read
+// straight through.
+static size_t file_read(struct source *src, uint8_t *buf, size_t len,
+                        unsigned long long int off)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = pread(src->fd, buf + done, len - done, off + done);
+		if ((n < 0) && (errno == ESPIPE) && (off + done == src->pos)) {
+			n = read(src->fd, buf + done, len - done);
+			if (n > 0) src->pos += n;
+		}
+		if ((n < 0) && (errno == EINTR)) {
+			n = 0;
+			continue;
+		}
+		if (n < 0) {
+			fprintf(stderr, "read at 0x%llx in %s: %s\n",
+			        off + done, src->name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) break;
+	}
+
+	return done;
+}
+
+
+// Holes in sparse files read as zeros
+static enum extent_kind file_extent(struct source *src,
+                                    unsigned long long int off,
+                                    unsigned long long int *len,
+                                    uint8_t *fill)
+{
+	off_t data, hole;
+	struct stat sb;
+
+	data = lseek(src->fd, off, SEEK_DATA);
+	if ((data < 0) && (errno == ENXIO) && (fstat(src->fd, &sb) == 0) &&
+	    ((unsigned long long int)sb.st_size > off)) {
+		// Trailing hole
+		*len = sb.st_size - off;
+		return EXTENT_ZERO;
+	}
+	if (data < 0) {
+		// No hole information (or past the end), so just read it
+		*len = ULLONG_MAX - off;
+		return EXTENT_DATA;
+	}
+	if ((unsigned long long int)data > off) {
+		*len = data - off;
+		return EXTENT_ZERO;
+	}
+	if ((hole = lseek(src->fd, off, SEEK_HOLE)) < 0) {
+		*len = ULLONG_MAX - off;
+	} else {
+		*len = hole - off;
+	}
+	return EXTENT_DATA;
+}
+
+
+static void file_close(struct source *src)
+{
+	close(src->fd);
+}
+
+
+static void file_open(struct source *src, const char *path)
+{
+	if ((src->fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	src->read = file_read;
+	src->extent = file_extent;
+	src->close = file_close;
+}
+
+
+static unsigned long long int source_size(struct source *src)
+{
+	struct stat sb;
+
+	if ((src->read != file_read) || (fstat(src->fd, &sb) != 0) ||
+	    !S_ISREG(sb.st_mode)) {
+		return ULLONG_MAX;
+	}
+	return sb.st_size;
+}
+
+
+static void read_exact(struct source *src, void *buf, size_t len,
+                       unsigned long long int off)
+{
+	if (src->read(src, buf, len, off) != len) {
+		fprintf(stderr, "%s: truncated at 0x%llx\n", src->name, off);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+// Hex dump sources
+//
+// Parses text dumps back into bytes. Understood formats are xxd
+// ("00000010: 4865 6c6c ...  Hello..."), od -tx1 ("0000020 48 65 6c ...",
+// with the offset radix worked out from consecutive lines) and the left
+// column of hexdiff's own output ("0x0000000010  48656c6c6f20776f ...").
+// The dump's offsets are honoured: a "*" line repeats the previous row up
+// to the next offset, as od and xxd -a intend, and any other gap (such as
+// hexdiff's "...") reads back as zeros.
+enum hex_style { HEX_UNKNOWN, HEX_XXD, HEX_OD, HEX_HEXDIFF };
+
+#define HEX_ROW_MAX 256
+
+struct hex_dump {
+	enum hex_style style;
+	int radix;                 // od offset radix, 0 until known
+	char *line;
+	size_t line_cap;
+	unsigned long long int lineno;
+	int eof;
+	int star;                  // saw "*", so the gap repeats last row
+	unsigned long long int gap_off; // where the gap before the row starts
+	uint8_t row[HEX_ROW_MAX];  // bytes of the current row
+	size_t row_len;
+	unsigned long long int row_off;
+	uint8_t last[HEX_ROW_MAX]; // previous row, for "*" repeats
+	size_t last_len;
+	char od_off[32];           // first od offset, until radix is known
+	size_t od_len;
+};
+
+
+static int hex_nibble(char c)
+{
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+
+// Decode eight hex characters into four bytes at once. Each byte lane of
+// the 64-bit word is range checked and converted independently (lanes never
+// carry into each other because valid characters are below 0x80), then the
+// nibbles are folded together. Returns 0 if any character is not hex.
+static int hex_decode8(const char *in, uint8_t *out)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t high = 0x8080808080808080ULL;
+	uint64_t v, lc, digit, alpha, w;
+
+	memcpy(&v, in, 8);
+	if (v & high) return 0;
+
+	// For x < 0x80, bit 7 of x + (0x80 - lo) is set iff x >= lo, and
+	// bit 7 of x + (0x7f - hi) is set iff x > hi.
+	digit = (v + (0x80 - '0') * ones) & ~(v + (0x7f - '9') * ones) & high;
+	lc = v | (0x20 * ones);
+	alpha = (lc + (0x80 - 'a') * ones) & ~(lc + (0x7f - 'f') * ones) &
+	        high;
+	if ((digit | alpha) != high) return 0;
+
+	// '0'-'9' are already their value in the low nibble, 'a'-'f' and
+	// 'A'-'F' are one more than their value minus nine
+	w = (v & (0x0f * ones)) + (alpha >> 7) * 9;
+
+	// Pair up the nibbles (first character is the high nibble), then
+	// squeeze the 16-bit lanes down to bytes
+	w = ((w & 0x000f000f000f000fULL) << 4) |
+	    ((w >> 8) & 0x000f000f000f000fULL);
+	w = (w | (w >> 8)) & 0x0000ffff0000ffffULL;
+	w = (w | (w >> 16)) & 0x00000000ffffffffULL;
+
+	out[0] = w;
+	out[1] = w >> 8;
+	out[2] = w >> 16;
+	out[3] = w >> 24;
+	return 1;
+}
+
+
+// Decode a run of 2 * n hex characters into n bytes
+static int hex_decode(const char *in, size_t n, uint8_t *out)
+{
+	int hi, lo;
+
+	while (n >= 4) {
+		if (!hex_decode8(in, out)) return 0;
+		in += 8;
+		out += 4;
+		n -= 4;
+	}
+	while (n-- > 0) {
+		if (((hi = hex_nibble(in[0])) < 0) ||
+		    ((lo = hex_nibble(in[1])) < 0)) {
+			return 0;
+		}
+		*out++ = (hi << 4) | lo;
+		in += 2;
+	}
+	return 1;
+}
+
+
+// Remove ANSI escape sequences and the trailing newline in place
+static void strip_line(char *line)
+{
+	char *in, *out;
+
+	for (in = out = line; *in != '\0'; in++) {
+		if ((in[0] == '\x1B') && (in[1] == '[')) {
+			for (in += 2; (*in != '\0') && ((*in < 0x40) ||
+			     (*in > 0x7e)); in++);
+			if (*in == '\0') break;
+			continue;
+		}
+		if ((*in == '\n') || (*in == '\r')) break;
+		*out++ = *in;
+	}
+	*out = '\0';
+}
+
+
+static int parse_offset(const char *str, size_t len, int radix,
+                        unsigned long long int *off)
+{
+	char tmp[32], *end;
+
+	if ((len == 0) || (len >= sizeof(tmp))) return 0;
+	memcpy(tmp, str, len);
+	tmp[len] = '\0';
+	errno = 0;
+	*off = strtoull(tmp, &end, radix);
+	return (errno == 0) && (*end == '\0');
+}
+
+
+// Pick the od offset radix by finding the one in which the second offset
+// lands a whole number of rows after the first.
+static int od_radix(struct hex_dump *hd, const char *str, size_t len)
+{
+	static const int radixes[] = {8, 16, 10};
+	unsigned long long int first, second;
+
+	for (int i = 0; i < 3; i++) {
+		if (!parse_offset(hd->od_off, hd->od_len, radixes[i], &first) ||
+		    !parse_offset(str, len, radixes[i], &second)) {
+			continue;
+		}
+		if ((second > first) && (hd->last_len > 0) &&
+		    ((second - first) % hd->last_len == 0)) {
+			return radixes[i];
+		}
+	}
+	return 8;
+}
+
+
+// Read and parse the next dump line. Returns 1 with the row filled in,
+// 0 at the end of the dump. Lines that are not part of a dump (headers,
+// blank lines, hexdiff's "...") are skipped.
+static int hex_next_row(struct source *src)
+{
+	struct hex_dump *hd = src->priv;
+	char *p, *q, hexbuf[2 * HEX_ROW_MAX];
+	size_t hexlen, olen;
+	unsigned long long int off;
+
+	while (getline(&hd->line, &hd->line_cap, src->file) != -1) {
+		hd->lineno++;
+		strip_line(hd->line);
+		for (p = hd->line; (*p == ' ') || (*p == '\t'); p++);
+		if ((p[0] == '*') && (p[1] == '\0')) {
+			hd->star = 1;
+			continue;
+		}
+
+		// Work out the dump style from the first offset we see
+		if (hd->style == HEX_UNKNOWN) {
+			for (q = p; hex_nibble(*q) >= 0 || *q == 'x'; q++);
+			if ((p[0] == '0') && (p[1] == 'x') && (q > p + 2) &&
+			    (q[0] == ' ') && (q[1] == ' ')) {
+				hd->style = HEX_HEXDIFF;
+			} else if ((q > p) && (*q == ':')) {
+				hd->style = HEX_XXD;
+			} else if ((q > p) && ((*q == ' ') || (*q == '\0'))) {
+				hd->style = HEX_OD;
+			} else {
+				continue;
+			}
+		}
+
+		// Offset
+		if (hd->style == HEX_HEXDIFF) {
+			if ((p[0] != '0') || (p[1] != 'x')) continue;
+			p += 2;
+		}
+		for (q = p; hex_nibble(*q) >= 0; q++);
+		olen = q - p;
+		if (hd->style == HEX_XXD) {
+			if ((*q != ':') ||
+			    !parse_offset(p, olen, 16, &off)) continue;
+			q++;
+		} else if (hd->style == HEX_HEXDIFF) {
+			if ((q[0] != ' ') || (q[1] != ' ') ||
+			    !parse_offset(p, olen, 16, &off)) continue;
+		} else {
+			if (((*q != ' ') && (*q != '\0')) || (olen == 0) ||
+			    (olen >= sizeof(hd->od_off))) continue;
+			if ((hd->radix == 0) && (hd->od_len > 0)) {
+				hd->radix = od_radix(hd, p, olen);
+			}
+			if (hd->radix == 0) {
+				memcpy(hd->od_off, p, olen);
+				hd->od_len = olen;
+				if (!parse_offset(p, olen, 8, &off)) continue;
+			} else if (!parse_offset(p, olen, hd->radix, &off)) {
+				continue;
+			}
+		}
+
+		// Collect the hex digits. Groups are separated by single
+		// spaces, and two spaces start the ASCII column. Rows in
+		// hexdiff's output are always one 8-byte group.
+		hexlen = 0;
+		for (p = q; ; ) {
+			while (*p == ' ') {
+				if (p[1] == ' ' && (hexlen > 0)) break;
+				p++;
+			}
+			if ((*p == ' ') || (*p == '\0')) break;
+			for (q = p; hex_nibble(*q) >= 0; q++);
+			if ((q == p) || ((q - p) % 2 != 0) ||
+			    ((*q != ' ') && (*q != '\0')) ||
+			    (hexlen + (q - p) > sizeof(hexbuf))) {
+				break;
+			}
+			memcpy(hexbuf + hexlen, p, q - p);
+			hexlen += q - p;
+			p = q;
+			if (hd->style == HEX_HEXDIFF) break;
+		}
+		if (!hex_decode(hexbuf, hexlen / 2, hd->row)) {
+			fprintf(stderr, "%s:%llu: invalid hex\n", src->name,
+			        hd->lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		hd->row_len = hexlen / 2;
+		hd->row_off = off;
+		return 1;
+	}
+
+	if (ferror(src->file)) {
+		fprintf(stderr, "getline: %s: %s\n", src->name,
+		        strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+
+static size_t hex_read(struct source *src, uint8_t *buf, size_t len,
+                       unsigned long long int off)
+{
+	struct hex_dump *hd = src->priv;
+	size_t done, n, i;
+
+	if (off < src->pos) {
+		fprintf(stderr, "%s: hex dumps can only be read forwards\n",
+		        src->name);
+		exit(EXIT_FAILURE);
+	}
+
+	done = 0;
+	while ((done < len) || (src->pos < off)) {
+		if (src->pos >= hd->row_off + hd->row_len) {
+			// Current row used up, move on to the next one
+			if (hd->row_len > 0) {
+				memcpy(hd->last, hd->row, hd->row_len);
+				hd->last_len = hd->row_len;
+			}
+			hd->gap_off = src->pos;
+			hd->row_off = src->pos;
+			hd->row_len = 0;
+			hd->star = 0;
+			if (hd->eof || !hex_next_row(src)) {
+				hd->eof = 1;
+				break;
+			}
+			continue;
+		}
+
+		if (src->pos >= hd->row_off) {
+			n = hd->row_len - (src->pos - hd->row_off);
+		} else {
+			n = hd->row_off - src->pos;
+		}
+		if (src->pos < off) {
+			// Skipping forwards to the requested offset
+			if (n > off - src->pos) n = off - src->pos;
+			src->pos += n;
+			continue;
+		}
+		if (n > len - done) n = len - done;
+
+		if (src->pos >= hd->row_off) {
+			memcpy(buf + done, hd->row + (src->pos - hd->row_off),
+			       n);
+		} else if (hd->star && (hd->last_len > 0)) {
+			for (i = 0; i < n; i++) {
+				buf[done + i] = hd->last[(src->pos + i -
+				                          hd->gap_off) %
+				                         hd->last_len];
+			}
+		} else {
+			memset(buf + done, 0, n);
+		}
+		done += n;
+		src->pos += n;
+	}
+
+	return done;
+}
+
+
+static void hex_close(struct source *src)
+{
+	struct hex_dump *hd = src->priv;
+
+	free(hd->line);
+	free(hd);
+	fclose(src->file);
+}
+
+
+static void hex_open(struct source *src, const char *path)
+{
+	if ((src->file = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	src->priv = xcalloc(1, sizeof(struct hex_dump));
+	src->read = hex_read;
+	src->close = hex_close;
+}
+
+
+// qcow2 images
+//
+// Guest offsets are translated through the L1 and L2 tables and served
+// straight from the host clusters. Unallocated and (in version 3)
+// zero-flagged clusters read as zeros and are reported as zero extents, so
+// the compare engine can skip clusters that are unallocated on both sides.
+// Backing files, compression, encryption and external data files are not
+// supported.
+#define QCOW2_MAGIC 0x514649fbU
+#define QCOW2_OFFSET_MASK 0x00fffffffffffe00ULL
+#define QCOW2_COMPRESSED (1ULL << 62)
+#define QCOW2_ZERO 1ULL
+#define QCOW2_INCOMPAT_DATA_FILE (1ULL << 2)
+#define QCOW2_INCOMPAT_EXTL2 (1ULL << 4)
+
+struct qcow2 {
+	struct source file;
+	unsigned int version;
+	unsigned int cluster_bits;
+	unsigned long long int size;
+	uint64_t *l1;
+	unsigned long long int l1_size;
+	uint64_t *l2;              // cached L2 table
+	unsigned long long int l2_offset;
+	pthread_mutex_t lock;
+};
+
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+static uint64_t get_be64(const uint8_t *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+
+// Look up the L2 entry for a guest offset. Returns 0 for an unallocated
+// cluster. Called with the lock held.
+static uint64_t qcow2_l2_entry(struct source *src, unsigned long long int off)
+{
+	struct qcow2 *q = src->priv;
+	unsigned long long int cluster_size = 1ULL << q->cluster_bits;
+	unsigned long long int l2_entries = cluster_size / 8;
+	unsigned long long int idx = off >> q->cluster_bits;
+	unsigned long long int l1_idx = idx / l2_entries;
+	unsigned long long int l2_off;
+
+	if (l1_idx >= q->l1_size) return 0;
+	if ((l2_off = q->l1[l1_idx] & QCOW2_OFFSET_MASK) == 0) return 0;
+
+	if (l2_off != q->l2_offset) {
+		read_exact(&q->file, q->l2, cluster_size, l2_off);
+		for (unsigned long long int i = 0; i < l2_entries; i++) {
+			q->l2[i] = get_be64((uint8_t *)&q->l2[i]);
+		}
+		q->l2_offset = l2_off;
+	}
+
+	return q->l2[idx % l2_entries];
+}
+
+
+// Map a guest offset to a host offset (0 if the cluster reads as zeros),
+// and the number of bytes left in the cluster. Called with the lock held.
+static unsigned long long int qcow2_map(struct source *src,
+                                        unsigned long long int off,
+                                        unsigned long long int *len)
+{
+	struct qcow2 *q = src->priv;
+	unsigned long long int cluster_size = 1ULL << q->cluster_bits;
+	uint64_t entry;
+
+	*len = cluster_size - (off & (cluster_size - 1));
+	entry = qcow2_l2_entry(src, off);
+	if (entry & QCOW2_COMPRESSED) {
+		fprintf(stderr, "%s: compressed clusters are not supported\n",
+		        src->name);
+		exit(EXIT_FAILURE);
+	}
+	// The zero flag is new in version 3; in version 2 the bit is reserved
+	if (((entry & QCOW2_ZERO) && (q->version == 3)) ||
+	    ((entry & QCOW2_OFFSET_MASK) == 0)) {
+		return 0;
+	}
+	return (entry & QCOW2_OFFSET_MASK) + (off & (cluster_size - 1));
+}
+
+
+static size_t qcow2_read(struct source *src, uint8_t *buf, size_t len,
+                         unsigned long long int off)
+{
+	struct qcow2 *q = src->priv;
+	unsigned long long int host, n;
+	size_t done;
+
+	if (off >= q->size) return 0;
+	if (len > q->size - off) len = q->size - off;
+
+	// Only the lookup needs the lock, as it may refill the cached L2
+	// table; the guest data is read outside it so workers don't queue
+	for (done = 0; done < len; done += n) {
+		pthread_mutex_lock(&q->lock);
+		host = qcow2_map(src, off + done, &n);
+		pthread_mutex_unlock(&q->lock);
+		if (n > len - done) n = len - done;
+		if (host == 0) {
+			memset(buf + done, 0, n);
+		} else {
+			read_exact(&q->file, buf + done, n, host);
+		}
+	}
+
+	return done;
+}
+
+
+static enum extent_kind qcow2_extent(struct source *src,
+                                     unsigned long long int off,
+                                     unsigned long long int *len,
+                                     uint8_t *fill)
+{
+	struct qcow2 *q = src->priv;
+	unsigned long long int cluster_size = 1ULL << q->cluster_bits;
+	unsigned long long int l1_span = cluster_size / 8 * cluster_size;
+	unsigned long long int host, n, end;
+	int zero;
+
+	if (off >= q->size) {
+		*len = ULLONG_MAX - off;
+		return EXTENT_DATA;
+	}
+
+	// Merge neighbouring clusters of the same kind, but don't go beyond
+	// the current L2 table, to bound the work done per call
+	pthread_mutex_lock(&q->lock);
+	end = (off / l1_span + 1) * l1_span;
+	if (end > q->size) end = q->size;
+	if ((off / l1_span >= q->l1_size) ||
+	    ((q->l1[off / l1_span] & QCOW2_OFFSET_MASK) == 0)) {
+		zero = 1;
+		*len = end - off;
+	} else {
+		zero = (qcow2_map(src, off, &n) == 0);
+		for (*len = n; off + *len < end; *len += n) {
+			host = qcow2_map(src, off + *len, &n);
+			if ((host == 0) != zero) break;
+		}
+		if (off + *len > end) *len = end - off;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return zero ? EXTENT_ZERO : EXTENT_DATA;
+}
+
+
+static void qcow2_close(struct source *src)
+{
+	struct qcow2 *q = src->priv;
+
+	q->file.close(&q->file);
+	pthread_mutex_destroy(&q->lock);
+	free(q->l1);
+	free(q->l2);
+	free(q);
+}
+
+
+static void qcow2_open(struct source *src, const char *path)
+{
+	struct qcow2 *q;
+	uint8_t hdr[104];
+	unsigned int version;
+	unsigned long long int incompat, l1_offset, l1_span, size;
+
+	q = xcalloc(1, sizeof(*q));
+	q->file.name = path;
+	file_open(&q->file, path);
+	read_exact(&q->file, hdr, 72, 0);
+
+	version = get_be32(hdr + 4);
+	if ((get_be32(hdr) != QCOW2_MAGIC) ||
+	    ((version != 2) && (version != 3))) {
+		fprintf(stderr, "%s: not a qcow2 image\n", path);
+		exit(EXIT_FAILURE);
+	}
+	incompat = 0;
+	if (version == 3) {
+		read_exact(&q->file, hdr + 72, 32, 72);
+		incompat = get_be64(hdr + 72);
+	}
+	if (get_be64(hdr + 8) != 0) {
+		fprintf(stderr, "%s: backing files are not supported\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (get_be32(hdr + 32) != 0) {
+		fprintf(stderr, "%s: encrypted images are not supported\n",
+		        path);
+		exit(EXIT_FAILURE);
+	}
+	if (incompat & (QCOW2_INCOMPAT_DATA_FILE | QCOW2_INCOMPAT_EXTL2)) {
+		fprintf(stderr, "%s: unsupported qcow2 features 0x%llx\n",
+		        path, incompat);
+		exit(EXIT_FAILURE);
+	}
+
+	q->cluster_bits = get_be32(hdr + 20);
+	if ((q->cluster_bits < 9) || (q->cluster_bits > 21)) {
+		fprintf(stderr, "%s: bad cluster size\n", path);
+		exit(EXIT_FAILURE);
+	}
+	q->version = version;
+	q->size = get_be64(hdr + 24);
+	q->l1_size = get_be32(hdr + 36);
+	l1_offset = get_be64(hdr + 40);
+
+	// The L1 table has to cover the guest and fit in the image, which
+	// bounds it before anything is allocated for it
+	l1_span = (1ULL << q->cluster_bits) / 8 << q->cluster_bits;
+	if (q->l1_size < q->size / l1_span + (q->size % l1_span != 0)) {
+		fprintf(stderr, "%s: L1 table too small for the guest\n",
+		        path);
+		exit(EXIT_FAILURE);
+	}
+	size = source_size(&q->file);
+	if ((size != ULLONG_MAX) &&
+	    ((l1_offset > size) || (q->l1_size > (size - l1_offset) / 8))) {
+		fprintf(stderr, "%s: L1 table doesn't fit in the image\n",
+		        path);
+		exit(EXIT_FAILURE);
+	}
+
+	q->l1 = xcalloc(q->l1_size + 1, sizeof(uint64_t));
+	read_exact(&q->file, q->l1, q->l1_size * 8, l1_offset);
+	for (unsigned long long int i = 0; i < q->l1_size; i++) {
+		q->l1[i] = get_be64((uint8_t *)&q->l1[i]);
+	}
+	q->l2 = xcalloc(1, 1ULL << q->cluster_bits);
+	pthread_mutex_init(&q->lock, NULL);
+
+	src->priv = q;
+	src->read = qcow2_read;
+	src->extent = qcow2_extent;
+	src->close = qcow2_close;
+}
+
+
+// Android sparse images
+//
+// A sparse image is a header followed by chunks, each covering a run of
+// output blocks: raw chunks carry the data, fill chunks repeat a 4-byte
+// value, don't-care chunks are left undefined (read here as zeros) and
+// CRC32 chunks cover no blocks at all. Only the chunk headers are read up
+// front. Raw chunks are served straight from the file, don't-care chunks
+// are reported as zero extents and fill chunks as fill extents, so the
+// compare engine checks the other side against the fill value instead of
+// expanding it.
+#define SIMG_MAGIC 0xed26ff3aU
+#define SIMG_RAW 0xcac1
+#define SIMG_FILL 0xcac2
+#define SIMG_DONT_CARE 0xcac3
+#define SIMG_CRC32 0xcac4
+
+struct simg_chunk {
+	unsigned long long int start;  // output offset
+	unsigned long long int len;
+	unsigned int type;
+	unsigned long long int data;   // file offset of raw data
+	uint8_t fill[4];
+};
+
+struct simg {
+	struct source file;
+	struct simg_chunk *chunks;
+	size_t nchunks;
+	unsigned long long int size;
+};
+
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) |
+	       ((uint32_t)p[1] << 8) | p[0];
+}
+
+
+// Chunk holding output offset off, which must be within the image
+static struct simg_chunk *simg_chunk(struct simg *s,
+                                     unsigned long long int off)
+{
+	size_t lo = 0, hi = s->nchunks, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (s->chunks[mid].start <= off) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return &s->chunks[lo];
+}
+
+
+static size_t simg_read(struct source *src, uint8_t *buf, size_t len,
+                        unsigned long long int off)
+{
+	struct simg *s = src->priv;
+	struct simg_chunk *c;
+	unsigned long long int pos;
+	size_t done, n, k;
+
+	if (off >= s->size) return 0;
+	if (len > s->size - off) len = s->size - off;
+
+	c = simg_chunk(s, off);
+	for (done = 0; done < len; done += n, c++) {
+		pos = off + done;
+		n = c->start + c->len - pos;
+		if (n > len - done) n = len - done;
+		switch (c->type) {
+		case SIMG_RAW:
+			read_exact(&s->file, buf + done, n,
+			           c->data + (pos - c->start));
+			break;
+		case SIMG_FILL:
+			// Chunks start on 4-aligned offsets, so the phase
+			// of the pattern follows from pos alone
+			for (k = 0; (k < 4) && (k < n); k++) {
+				buf[done + k] = c->fill[(pos + k) % 4];
+			}
+			for (; k < n; k *= 2) {
+				memcpy(buf + done + k, buf + done,
+				       (k < n - k) ? k : n - k);
+			}
+			break;
+		default:
+			memset(buf + done, 0, n);
+			break;
+		}
+	}
+
+	return done;
+}
+
+
+static enum extent_kind simg_extent(struct source *src,
+                                    unsigned long long int off,
+                                    unsigned long long int *len,
+                                    uint8_t *fill)
+{
+	static const uint8_t zero[4];
+	struct simg *s = src->priv;
+	struct simg_chunk *c, *end;
+	enum extent_kind kind;
+
+	if (off >= s->size) {
+		*len = ULLONG_MAX - off;
+		return EXTENT_DATA;
+	}
+
+	c = simg_chunk(s, off);
+	if (c->type == SIMG_RAW) {
+		kind = EXTENT_DATA;
+	} else if ((c->type == SIMG_FILL) && memcmp(c->fill, zero, 4)) {
+		kind = EXTENT_FILL;
+		memcpy(fill, c->fill, 4);
+	} else {
+		kind = EXTENT_ZERO;
+	}
+
+	// Merge neighbouring chunks that read the same way
+	end = s->chunks + s->nchunks;
+	*len = c->start + c->len - off;
+	for (c++; c < end; c++) {
+		if ((c->type == SIMG_RAW) != (kind == EXTENT_DATA)) break;
+		if ((kind != EXTENT_DATA) &&
+		    memcmp((c->type == SIMG_FILL) ? c->fill : zero,
+		           (kind == EXTENT_FILL) ? fill : zero, 4)) {
+			break;
+		}
+		*len += c->len;
+	}
+
+	return kind;
+}
+
+
+static void simg_close(struct source *src)
+{
+	struct simg *s = src->priv;
+
+	s->file.close(&s->file);
+	free(s->chunks);
+	free(s);
+}
+
+
+static void simg_open(struct source *src, const char *path)
+{
+	struct simg *s;
+	struct simg_chunk *c;
+	uint8_t hdr[28], ch[12];
+	unsigned int file_hdr_sz, chunk_hdr_sz, blk_sz, total_blks, chunks;
+	unsigned long long int pos, total_sz, blocks, size;
+	size_t cap;
+
+	s = xcalloc(1, sizeof(*s));
+	s->file.name = path;
+	file_open(&s->file, path);
+	read_exact(&s->file, hdr, 28, 0);
+
+	file_hdr_sz = hdr[8] | (hdr[9] << 8);
+	chunk_hdr_sz = hdr[10] | (hdr[11] << 8);
+	blk_sz = get_le32(hdr + 12);
+	total_blks = get_le32(hdr + 16);
+	chunks = get_le32(hdr + 20);
+	if ((get_le32(hdr) != SIMG_MAGIC) || (hdr[4] != 1) || (hdr[5] != 0)) {
+		fprintf(stderr, "%s: not an Android sparse image\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if ((file_hdr_sz < 28) || (chunk_hdr_sz < 12) || (blk_sz == 0) ||
+	    (blk_sz % 4 != 0)) {
+		fprintf(stderr, "%s: bad sparse image header\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	// Every chunk has a header in the file, which bounds the count before
+	// anything is allocated for it
+	size = source_size(&s->file);
+	if ((size != ULLONG_MAX) &&
+	    ((size < file_hdr_sz) ||
+	     (chunks > (size - file_hdr_sz) / chunk_hdr_sz))) {
+		fprintf(stderr, "%s: %u chunks don't fit in the image\n", path,
+		        chunks);
+		exit(EXIT_FAILURE);
+	}
+
+	// A piped image has no size to check against, so the array grows as
+	// the chunks turn out to be there
+	cap = 64;
+	s->chunks = xcalloc(cap, sizeof(*s->chunks));
+	pos = file_hdr_sz;
+	blocks = 0;
+	for (unsigned int i = 0; i < chunks; i++, pos += total_sz) {
+		read_exact(&s->file, ch, 12, pos);
+		if (s->nchunks + 1 == cap) {
+			s->chunks = realloc(s->chunks,
+			                    2 * cap * sizeof(*s->chunks));
+			if (s->chunks == NULL) {
+				fprintf(stderr, "realloc: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			memset(s->chunks + cap, 0, cap * sizeof(*s->chunks));
+			cap *= 2;
+		}
+		c = &s->chunks[s->nchunks];
+		c->type = ch[0] | (ch[1] << 8);
+		c->start = blocks * blk_sz;
+		c->len = (unsigned long long int)get_le32(ch + 4) * blk_sz;
+		c->data = pos + chunk_hdr_sz;
+		total_sz = get_le32(ch + 8);
+		switch (c->type) {
+		case SIMG_RAW:
+			if (total_sz != chunk_hdr_sz + c->len) goto bad;
+			break;
+		case SIMG_FILL:
+			if (total_sz != chunk_hdr_sz + 4) goto bad;
+			read_exact(&s->file, c->fill, 4, c->data);
+			break;
+		case SIMG_DONT_CARE:
+			if (total_sz != chunk_hdr_sz) goto bad;
+			break;
+		case SIMG_CRC32:
+			if (total_sz != chunk_hdr_sz + 4) goto bad;
+			continue;
+		default:
+			fprintf(stderr, "%s: unknown chunk type 0x%x at "
+			        "0x%llx\n", path, c->type, pos);
+			exit(EXIT_FAILURE);
+		}
+		if (c->len == 0) continue;
+		blocks += get_le32(ch + 4);
+		s->nchunks++;
+	}
+	if (blocks != total_blks) {
+		fprintf(stderr, "%s: chunks cover %llu blocks, not %u\n",
+		        path, blocks, total_blks);
+		exit(EXIT_FAILURE);
+	}
+	s->size = blocks * blk_sz;
+
+	src->priv = s;
+	src->read = simg_read;
+	src->extent = simg_extent;
+	src->close = simg_close;
+	return;
+
+bad:
+	fprintf(stderr, "%s: bad chunk size at 0x%llx\n", path, pos);
+	exit(EXIT_FAILURE);
+}
+
+
+// ext4 filesystem images
+//
+// Only the superblock, the group descriptors and the block bitmaps are read
+// up front. Blocks that are free in the image are reported as unused
+// extents, which the compare engine leaves out when they are free on both
+// sides, so stale data in free space doesn't show up as differences and
+// isn't read at all. Allocated blocks are read straight from the image.
+// Groups whose bitmap was never initialized only hold their own metadata,
+// which is worked out from the layout. With bigalloc, a bitmap bit covers a
+// whole cluster. meta_bg layouts are not supported.
+#define EXT4_MAGIC 0xef53
+#define EXT4_COMPAT_SPARSE_SUPER2 0x200
+#define EXT4_INCOMPAT_META_BG 0x10
+#define EXT4_INCOMPAT_64BIT 0x80
+#define EXT4_RO_COMPAT_SPARSE_SUPER 0x1
+#define EXT4_RO_COMPAT_GDT_CSUM 0x10
+#define EXT4_RO_COMPAT_BIGALLOC 0x200
+#define EXT4_RO_COMPAT_METADATA_CSUM 0x400
+#define EXT4_BG_BLOCK_UNINIT 0x2
+
+struct ext4 {
+	struct source file;
+	unsigned int block_size;
+	unsigned int unit_bits;         // log2 of the bytes per bitmap bit
+	unsigned long long int first;   // byte offset of the first group
+	unsigned long long int size;
+	unsigned long long int units;
+	uint8_t *map;                   // one bit per unit, set if in use
+};
+
+
+static int ext4_used(const struct ext4 *e, unsigned long long int u)
+{
+	return (e->map[u / 8] >> (u % 8)) & 1;
+}
+
+
+static void ext4_mark(struct ext4 *e, unsigned long long int block,
+                      unsigned long long int count)
+{
+	unsigned long long int u, end;
+
+	// Units are counted from the first group
+	if (block * e->block_size < e->first) return;
+	block -= e->first / e->block_size;
+	end = (block + count) * e->block_size;
+	for (u = (block * e->block_size) >> e->unit_bits;
+	     (u << e->unit_bits) < end; u++) {
+		if (u < e->units) e->map[u / 8] |= 1 << (u % 8);
+	}
+}
+
+
+// First unit from u on that is not in the state used, or e->units
+static unsigned long long int ext4_run(const struct ext4 *e,
+                                       unsigned long long int u, int used)
+{
+	uint64_t w, all = used ? ~0ULL : 0;
+
+	for (; (u < e->units) && (u % 64 != 0); u++) {
+		if (ext4_used(e, u) != used) return u;
+	}
+	for (; u + 64 <= e->units; u += 64) {
+		memcpy(&w, e->map + u / 8, 8);
+		if (w != all) break;
+	}
+	for (; (u < e->units) && (ext4_used(e, u) == used); u++);
+	return u;
+}
+
+
+static size_t ext4_read(struct source *src, uint8_t *buf, size_t len,
+                        unsigned long long int off)
+{
+	struct ext4 *e = src->priv;
+
+	return e->file.read(&e->file, buf, len, off);
+}
+
+
+static enum extent_kind ext4_extent(struct source *src,
+                                    unsigned long long int off,
+                                    unsigned long long int *len,
+                                    uint8_t *fill)
+{
+	struct ext4 *e = src->priv;
+	unsigned long long int u, end, n;
+	enum extent_kind kind;
+	int used;
+
+	if (off < e->first) {
+		// Boot block, ahead of the first group
+		*len = e->first - off;
+		return EXTENT_DATA;
+	}
+	if (off >= e->size) {
+		*len = ULLONG_MAX - off;
+		return EXTENT_DATA;
+	}
+
+	u = (off - e->first) >> e->unit_bits;
+	used = ext4_used(e, u);
+	end = e->first + (ext4_run(e, u, used) << e->unit_bits);
+	if (end > e->size) end = e->size;
+	*len = end - off;
+	if (!used) return EXTENT_UNUSED;
+
+	// Allocated blocks can still be holes in a sparse image file
+	kind = e->file.extent(&e->file, off, &n, fill);
+	if (n < *len) *len = n;
+	return kind;
+}
+
+
+static void ext4_close(struct source *src)
+{
+	struct ext4 *e = src->priv;
+
+	e->file.close(&e->file);
+	free(e->map);
+	free(e);
+}
+
+
+// Whether group g holds a backup of the superblock and descriptors
+static int ext4_has_super(unsigned long long int g, const uint8_t *sb)
+{
+	unsigned long long int p;
+
+	if (get_le32(sb + 92) & EXT4_COMPAT_SPARSE_SUPER2) {
+		return (g == 0) || (g == get_le32(sb + 0x24c)) ||
+		       (g == get_le32(sb + 0x250));
+	}
+	if (!(get_le32(sb + 100) & EXT4_RO_COMPAT_SPARSE_SUPER) || (g <= 1)) {
+		return 1;
+	}
+	for (unsigned int b = 3; b <= 7; b += 2) {
+		for (p = b; p < g; p *= b);
+		if (p == g) return 1;
+	}
+	return 0;
+}
+
+
+static void ext4_open(struct source *src, const char *path)
+{
+	struct ext4 *e;
+	uint8_t sb[1024], *gdt, *d, *bitmap;
+	unsigned int log_block, desc_size, incompat, ro_compat, flags;
+	unsigned long long int blocks, first_block, per_group, units_per_group;
+	unsigned long long int groups, gdt_blocks, itable_blocks, start;
+	unsigned long long int bb, ib, it;
+
+	e = xcalloc(1, sizeof(*e));
+	e->file.name = path;
+	file_open(&e->file, path);
+	read_exact(&e->file, sb, 1024, 1024);
+
+	if ((sb[56] | (sb[57] << 8)) != EXT4_MAGIC) {
+		fprintf(stderr, "%s: not an ext2/3/4 filesystem\n", path);
+		exit(EXIT_FAILURE);
+	}
+	incompat = get_le32(sb + 96);
+	ro_compat = get_le32(sb + 100);
+	if (incompat & EXT4_INCOMPAT_META_BG) {
+		fprintf(stderr, "%s: meta_bg is not supported\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	log_block = get_le32(sb + 24);
+	blocks = get_le32(sb + 4);
+	desc_size = 32;
+	if (incompat & EXT4_INCOMPAT_64BIT) {
+		blocks |= (unsigned long long int)get_le32(sb + 0x150) << 32;
+		desc_size = sb[0xfe] | (sb[0xff] << 8);
+	}
+	first_block = get_le32(sb + 20);
+	per_group = get_le32(sb + 32);
+	units_per_group = per_group;
+	e->unit_bits = 10 + log_block;
+	if (ro_compat & EXT4_RO_COMPAT_BIGALLOC) {
+		units_per_group = get_le32(sb + 36);
+		e->unit_bits = 10 + get_le32(sb + 28);
+	}
+	if ((log_block > 6) || (e->unit_bits > 30) ||
+	    (e->unit_bits < 10 + log_block) || (desc_size < 32) ||
+	    (desc_size > 1024) || (per_group == 0) ||
+	    (units_per_group == 0) || (units_per_group % 8 != 0) ||
+	    (units_per_group > 8192ULL << log_block) ||
+	    (blocks <= first_block)) {
+		fprintf(stderr, "%s: bad ext4 superblock\n", path);
+		exit(EXIT_FAILURE);
+	}
+	e->block_size = 1024 << log_block;
+	e->first = first_block * e->block_size;
+	e->size = blocks * e->block_size;
+	groups = (blocks - first_block + per_group - 1) / per_group;
+	e->units = ((e->size - e->first) + (1ULL << e->unit_bits) - 1) >>
+	           e->unit_bits;
+	e->map = xcalloc(groups * units_per_group / 8 + 8, 1);
+
+	// The descriptors follow the block holding the superblock, which is
+	// block 1 with 1 KiB blocks even when bigalloc starts the first group
+	// at block 0
+	gdt = xcalloc(groups, desc_size);
+	read_exact(&e->file, gdt, groups * desc_size,
+	           (1024 / e->block_size + 1) * e->block_size);
+	gdt_blocks = (groups * desc_size + e->block_size - 1) / e->block_size;
+	itable_blocks = ((unsigned long long int)get_le32(sb + 40) *
+	                 (sb[88] | (sb[89] << 8)) + e->block_size - 1) /
+	                e->block_size;
+
+	for (unsigned long long int g = 0; g < groups; g++) {
+		d = gdt + g * desc_size;
+		bb = get_le32(d);
+		ib = get_le32(d + 4);
+		it = get_le32(d + 8);
+		if (desc_size >= 64) {
+			bb |= (unsigned long long int)get_le32(d + 0x20) << 32;
+			ib |= (unsigned long long int)get_le32(d + 0x24) << 32;
+			it |= (unsigned long long int)get_le32(d + 0x28) << 32;
+		}
+		flags = d[0x12] | (d[0x13] << 8);
+		bitmap = e->map + g * units_per_group / 8;
+		if (!(flags & EXT4_BG_BLOCK_UNINIT) ||
+		    !(ro_compat & (EXT4_RO_COMPAT_GDT_CSUM |
+		                   EXT4_RO_COMPAT_METADATA_CSUM))) {
+			if ((bb < first_block) || (bb >= blocks)) {
+				fprintf(stderr, "%s: bad block bitmap "
+				        "location in group %llu\n", path, g);
+				exit(EXIT_FAILURE);
+			}
+			read_exact(&e->file, bitmap, units_per_group / 8,
+			           bb * e->block_size);
+			continue;
+		}
+
+		// An uninitialized bitmap leaves only the group's own metadata
+		// in use
+		start = first_block + g * per_group;
+		if (ext4_has_super(g, sb)) {
+			ext4_mark(e, start, 1 + gdt_blocks +
+			          (sb[206] | (sb[207] << 8)));
+		}
+		if ((bb >= start) && (bb < start + per_group)) {
+			ext4_mark(e, bb, 1);
+		}
+		if ((ib >= start) && (ib < start + per_group)) {
+			ext4_mark(e, ib, 1);
+		}
+		if ((it >= start) && (it < start + per_group)) {
+			ext4_mark(e, it, itable_blocks);
+		}
+	}
+	free(gdt);
+
+	src->priv = e;
+	src->read = ext4_read;
+	src->extent = ext4_extent;
+	src->close = ext4_close;
+}
+
+
+// AES-XTS encrypted images
+//
+// "xts:image" decrypts an AES-XTS volume (as dm-crypt's aes-xts-plain64
+// lays it out) on the fly, so encrypted images can be compared without a
+// plaintext copy ever touching the disk. The key is read raw from the file
+// descriptor given with --key-fd: 32 bytes for AES-128, 64 for AES-256. The
+// tweak of each sector is its number, counting --sector-size units from the
+// start of the image.
+//
+// Plaintext is kept in XTS_SLOTS blocks of XTS_BLOCK bytes, decrypted ahead
+// of the reader by -j worker threads (or by the reader itself with -j 1).
+// Those blocks, the key and the chunk buffers are locked in memory and left
+// out of core dumps, and the key and blocks are wiped when done.
+#if defined(__x86_64__) || defined(__i386__)
+#define XTS_BLOCK (1024 * 1024)
+#define XTS_SLOTS 8
+
+struct xts_key {
+	__m128i dec[15];           // data key, decryption schedule
+	__m128i tweak[15];         // tweak key, encryption schedule
+	int rounds;
+};
+
+struct xts_slot {
+	unsigned long long int block;  // ULLONG_MAX when empty
+	size_t len;                    // short at the end of the image
+	int busy;                      // being decrypted
+	uint8_t *data;
+};
+
+struct xts {
+	struct xts_slot slots[XTS_SLOTS];
+	unsigned long long int head;   // block the reader is in
+	unsigned long long int fill;   // next block to decrypt ahead
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+	int stop;
+	uint8_t *mem;
+};
+#endif
+
+static struct {
+	int key_fd;
+	unsigned int sector;
+	int jobs;
+	int users;
+	struct xts_key *key;
+} xts_cfg = { -1, 512, 1, 0, NULL };
+
+// Set once chunk buffers may hold decrypted data
+static int lock_buffers;
+
+
+// Lock memory holding plaintext or keys, and keep it out of core dumps
+static void lock_secret(void *mem, size_t len)
+{
+	if (mlock(mem, len) != 0) {
+		fprintf(stderr, "mlock: %s (check ulimit -l)\n",
+		        strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	madvise(mem, len, MADV_DONTDUMP);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("aes,sse2")))
+static inline __m128i aes128_assist(__m128i k, __m128i t)
+{
+	t = _mm_shuffle_epi32(t, 0xff);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, t);
+}
+
+
+// Second half of an AES-256 round key pair, from the new first half
+__attribute__((target("aes,sse2")))
+static inline __m128i aes256_assist(__m128i k, __m128i first)
+{
+	__m128i t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(first, 0),
+	                              0xaa);
+
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, t);
+}
+
+
+// The round constant has to be an immediate, hence the macros
+#define AES128_ROUND(rk, i, rcon) \
+	rk[i] = aes128_assist(rk[i - 1], \
+	                      _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+#define AES256_ROUNDS(rk, i, rcon) \
+	do { \
+		rk[i] = aes128_assist(rk[i - 2], \
+		                     _mm_aeskeygenassist_si128(rk[i - 1], rcon)); \
+		if (i + 1 < 15) rk[i + 1] = aes256_assist(rk[i - 1], rk[i]); \
+	} while (0)
+
+__attribute__((target("aes,sse2")))
+static void aes_expand(__m128i *rk, const uint8_t *key, int rounds)
+{
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	if (rounds == 10) {
+		AES128_ROUND(rk, 1, 0x01);
+		AES128_ROUND(rk, 2, 0x02);
+		AES128_ROUND(rk, 3, 0x04);
+		AES128_ROUND(rk, 4, 0x08);
+		AES128_ROUND(rk, 5, 0x10);
+		AES128_ROUND(rk, 6, 0x20);
+		AES128_ROUND(rk, 7, 0x40);
+		AES128_ROUND(rk, 8, 0x80);
+		AES128_ROUND(rk, 9, 0x1b);
+		AES128_ROUND(rk, 10, 0x36);
+	} else {
+		rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+		AES256_ROUNDS(rk, 2, 0x01);
+		AES256_ROUNDS(rk, 4, 0x02);
+		AES256_ROUNDS(rk, 6, 0x04);
+		AES256_ROUNDS(rk, 8, 0x08);
+		AES256_ROUNDS(rk, 10, 0x10);
+		AES256_ROUNDS(rk, 12, 0x20);
+		AES256_ROUNDS(rk, 14, 0x40);
+	}
+}
+
+
+__attribute__((target("aes,sse2")))
+static void xts_set_key(struct xts_key *key, const uint8_t *raw, size_t len)
+{
+	__m128i enc[15];
+
+	key->rounds = (len == 32) ? 10 : 14;
+	aes_expand(enc, raw, key->rounds);
+	aes_expand(key->tweak, raw + len / 2, key->rounds);
+
+	// Equivalent inverse cipher: reversed keys, with InvMixColumns
+	key->dec[0] = enc[key->rounds];
+	for (int i = 1; i < key->rounds; i++) {
+		key->dec[i] = _mm_aesimc_si128(enc[key->rounds - i]);
+	}
+	key->dec[key->rounds] = enc[0];
+	explicit_bzero(enc, sizeof(enc));
+}
+
+
+// Multiply the tweak by x in GF(2^128): shift left one bit, folding the bit
+// shifted out of the top back in as 0x87
+__attribute__((target("aes,sse2")))
+static inline __m128i xts_next_tweak(__m128i t)
+{
+	__m128i carry = _mm_srai_epi32(t, 31);
+
+	carry = _mm_and_si128(_mm_shuffle_epi32(carry, 0x93),
+	                      _mm_set_epi32(1, 1, 1, 0x87));
+	return _mm_xor_si128(_mm_slli_epi32(t, 1), carry);
+}
+
+
+// Decrypt whole sectors of buf in place, the first being sector number
+// sector. Four blocks go through the rounds together to keep the AES unit
+// busy.
+__attribute__((target("aes,sse2")))
+static void xts_decrypt(const struct xts_key *key, uint8_t *buf, size_t len,
+                        unsigned long long int sector)
+{
+	const __m128i *dk = key->dec;
+	int rounds = key->rounds;
+	__m128i t, tw[4], b[4];
+	size_t i, j;
+
+	for (i = 0; i < len; i += xts_cfg.sector, sector++) {
+		t = _mm_xor_si128(_mm_set_epi64x(0, sector), key->tweak[0]);
+		for (int r = 1; r < rounds; r++) {
+			t = _mm_aesenc_si128(t, key->tweak[r]);
+		}
+		t = _mm_aesenclast_si128(t, key->tweak[rounds]);
+
+		for (j = 0; j + 64 <= xts_cfg.sector; j += 64) {
+			for (int k = 0; k < 4; k++) {
+				tw[k] = t;
+				t = xts_next_tweak(t);
+				b[k] = _mm_loadu_si128((__m128i *)
+				                       (buf + i + j + 16 * k));
+				b[k] = _mm_xor_si128(_mm_xor_si128(b[k], tw[k]),
+				                     dk[0]);
+			}
+			for (int r = 1; r < rounds; r++) {
+				for (int k = 0; k < 4; k++) {
+					b[k] = _mm_aesdec_si128(b[k], dk[r]);
+				}
+			}
+			for (int k = 0; k < 4; k++) {
+				b[k] = _mm_aesdeclast_si128(b[k], dk[rounds]);
+				_mm_storeu_si128((__m128i *)(buf + i + j + 16 * k),
+				                 _mm_xor_si128(b[k], tw[k]));
+			}
+		}
+	}
+}
+
+
+static void xts_load_key(void)
+{
+	uint8_t raw[65];
+	size_t len;
+	ssize_t n;
+
+	if (xts_cfg.key_fd < 0) {
+		fprintf(stderr, "xts: no key, use --key-fd\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!__builtin_cpu_supports("aes")) {
+		fprintf(stderr, "xts: this CPU lacks AES-NI\n");
+		exit(EXIT_FAILURE);
+	}
+
+	lock_secret(raw, sizeof(raw));
+	for (len = 0; len < sizeof(raw); len += n) {
+		n = read(xts_cfg.key_fd, raw + len, sizeof(raw) - len);
+		if ((n < 0) && (errno == EINTR)) {
+			n = 0;
+			continue;
+		}
+		if (n < 0) {
+			fprintf(stderr, "read key: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) break;
+	}
+	close(xts_cfg.key_fd);
+	if ((len != 32) && (len != 64)) {
+		explicit_bzero(raw, sizeof(raw));
+		fprintf(stderr, "xts: key must be 32 or 64 bytes, not %zu\n",
+		        len);
+		exit(EXIT_FAILURE);
+	}
+
+	xts_cfg.key = mmap(NULL, sizeof(struct xts_key),
+	                   PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xts_cfg.key == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	lock_secret(xts_cfg.key, sizeof(struct xts_key));
+	xts_set_key(xts_cfg.key, raw, len);
+	explicit_bzero(raw, sizeof(raw));
+	munlock(raw, sizeof(raw));
+}
+
+
+// Decrypt block into sl. Called and returns with the lock held.
+static void xts_fill(struct source *src, struct xts_slot *sl,
+                     unsigned long long int block)
+{
+	struct xts *x = src->priv;
+	size_t n;
+
+	sl->block = block;
+	sl->busy = 1;
+	pthread_mutex_unlock(&x->lock);
+
+	n = file_read(src, sl->data, XTS_BLOCK, block * XTS_BLOCK);
+	n -= n % xts_cfg.sector;
+	xts_decrypt(xts_cfg.key, sl->data, n,
+	            block * (XTS_BLOCK / xts_cfg.sector));
+
+	pthread_mutex_lock(&x->lock);
+	sl->len = n;
+	sl->busy = 0;
+	pthread_cond_broadcast(&x->cond);
+}
+
+
+static void *xts_worker(void *arg)
+{
+	struct source *src = arg;
+	struct xts *x = src->priv;
+	struct xts_slot *sl;
+
+	place_thread();
+	pthread_mutex_lock(&x->lock);
+	while (!x->stop) {
+		sl = &x->slots[x->fill % XTS_SLOTS];
+		if (sl->block == x->fill) {
+			x->fill++;
+		} else if ((x->fill < x->head + XTS_SLOTS) && !sl->busy) {
+			xts_fill(src, sl, x->fill++);
+		} else {
+			pthread_cond_wait(&x->cond, &x->lock);
+		}
+	}
+	pthread_mutex_unlock(&x->lock);
+	return NULL;
+}
+
+
+static size_t xts_read(struct source *src, uint8_t *buf, size_t len,
+                       unsigned long long int off)
+{
+	struct xts *x = src->priv;
+	unsigned long long int block;
+	struct xts_slot *sl;
+	size_t done, in, n;
+
+	pthread_mutex_lock(&x->lock);
+	for (done = 0; done < len; done += n) {
+		block = (off + done) / XTS_BLOCK;
+		in = (off + done) % XTS_BLOCK;
+
+		// Move the read-ahead window along to the block being read
+		if ((block < x->head) || (block >= x->head + XTS_SLOTS)) {
+			x->fill = block;
+		}
+		if (block != x->head) {
+			x->head = block;
+			if (x->fill < block) x->fill = block;
+			pthread_cond_broadcast(&x->cond);
+		}
+
+		sl = &x->slots[block % XTS_SLOTS];
+		n = 0;
+		if (sl->busy) {
+			pthread_cond_wait(&x->cond, &x->lock);
+			continue;
+		}
+		if (sl->block != block) {
+			// Not decrypted yet, so do it here rather than wait
+			if (x->fill == block) x->fill++;
+			xts_fill(src, sl, block);
+			continue;
+		}
+		if (in >= sl->len) break;
+		n = (sl->len - in < len - done) ? sl->len - in : len - done;
+		memcpy(buf + done, sl->data + in, n);
+	}
+	pthread_mutex_unlock(&x->lock);
+
+	return done;
+}
+
+
+static void xts_close(struct source *src)
+{
+	struct xts *x = src->priv;
+
+	pthread_mutex_lock(&x->lock);
+	x->stop = 1;
+	pthread_cond_broadcast(&x->cond);
+	pthread_mutex_unlock(&x->lock);
+	for (int i = 0; i < x->nthreads; i++) {
+		pthread_join(x->threads[i], NULL);
+	}
+
+	explicit_bzero(x->mem, XTS_SLOTS * XTS_BLOCK);
+	munmap(x->mem, XTS_SLOTS * XTS_BLOCK);
+	pthread_mutex_destroy(&x->lock);
+	pthread_cond_destroy(&x->cond);
+	free(x->threads);
+	free(x);
+	file_close(src);
+
+	if (--xts_cfg.users == 0) {
+		explicit_bzero(xts_cfg.key, sizeof(struct xts_key));
+		munmap(xts_cfg.key, sizeof(struct xts_key));
+		xts_cfg.key = NULL;
+	}
+}
+
+
+static void xts_open(struct source *src, const char *path)
+{
+	struct xts *x;
+	struct stat sb;
+	int err;
+
+	file_open(src, path);
+	if ((fstat(src->fd, &sb) != 0) ||
+	    !(S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode))) {
+		fprintf(stderr, "%s: not a file or block device\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (xts_cfg.key == NULL) xts_load_key();
+	xts_cfg.users++;
+	lock_buffers = 1;
+
+	x = xcalloc(1, sizeof(*x));
+	x->mem = mmap(NULL, XTS_SLOTS * XTS_BLOCK, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (x->mem == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	lock_secret(x->mem, XTS_SLOTS * XTS_BLOCK);
+	for (int i = 0; i < XTS_SLOTS; i++) {
+		x->slots[i].block = ULLONG_MAX;
+		x->slots[i].data = x->mem + (size_t)i * XTS_BLOCK;
+	}
+	pthread_mutex_init(&x->lock, NULL);
+	pthread_cond_init(&x->cond, NULL);
+	src->priv = x;
+	src->read = xts_read;
+	src->extent = NULL;        // holes decrypt to garbage, not zeros
+	src->close = xts_close;
+
+	x->nthreads = (xts_cfg.jobs > 1) ? xts_cfg.jobs : 0;
+	x->threads = xcalloc(x->nthreads + 1, sizeof(*x->threads));
+	for (int i = 0; i < x->nthreads; i++) {
+		err = pthread_create(&x->threads[i], NULL, xts_worker, src);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+#else
+static void xts_open(struct source *src, const char *path)
+{
+	fprintf(stderr, "xts: AES-NI is only supported on x86\n");
+	exit(EXIT_FAILURE);
+}
+#endif
+
+
+// Source types are picked by a "type:" prefix on the file name. Anything
+// without a known prefix is a plain file.
+static const struct source_type {
+	const char *prefix;
+	void (*open)(struct source *src, const char *path);
+} source_types[] = {
+	{"hex:", hex_open},
+	{"qcow2:", qcow2_open},
+	{"simg:", simg_open},
+	{"ext4:", ext4_open},
+	{"xts:", xts_open},
+	{"", file_open},
+};
+
+
+static void source_open(struct source *src, const char *spec)
+{
+	const struct source_type *type;
+	size_t len;
+
+	memset(src, 0, sizeof(*src));
+	for (type = source_types; ; type++) {
+		len = strlen(type->prefix);
+		if (strncmp(spec, type->prefix, len) == 0) break;
+	}
+	src->name = spec + len;
+	type->open(src, src->name);
+}
+
+
+
+// Followed files
+//
+// With --follow, file2 may still be being written, like a capture coming in
+// over a slow link. Reads that reach its end wait for more data rather than
+// ending the compare, handing back whole rows as soon as there are any, so
+// the compare carries on from where it was. Waiting uses inotify, or polls
+// where that isn't available. The file counts as finished once its writer
+// has closed it and a whole poll interval passes without it being written
+// again, as writers that reopen or rotate the file close it along the way.
+// It also ends after an optional idle timeout, or on Ctrl-C.
+#define FOLLOW_POLL_MS 250
+
+struct follow {
+	int ifd;                         // inotify, or -1 to poll
+	int closed;                      // closed since last written
+	unsigned long long int size;     // size at the last wait
+	unsigned long long int idle_ms;  // waited without growth
+	unsigned long long int timeout;  // idle ms before giving up, or 0
+};
+
+// Output to push out before waiting, so differences show up right away
+static struct outbuf *follow_out;
+
+
+static void follow_wait(struct source *src)
+{
+	struct follow *fl = src->priv;
+	struct pollfd pfd;
+	struct stat sb;
+	char ev[4096]
+	     __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie;
+	ssize_t n;
+	int done;
+
+	if (sigint_recv) {
+		src->growing = 0;
+		return;
+	}
+	if (follow_out != NULL) ob_flush(follow_out);
+
+	// A close seen last time ends the wait unless the file has been
+	// written since
+	done = fl->closed;
+	pfd.fd = fl->ifd;
+	pfd.events = POLLIN;
+	if ((fl->ifd >= 0) && (poll(&pfd, 1, FOLLOW_POLL_MS) > 0)) {
+		n = read(fl->ifd, ev, sizeof(ev));
+		for (char *p = ev; p < ev + n; p += sizeof(*ie) + ie->len) {
+			ie = (struct inotify_event *)p;
+			if (ie->mask & IN_MODIFY) fl->closed = done = 0;
+			if (ie->mask & IN_CLOSE_WRITE) fl->closed = 1;
+		}
+	} else if (fl->ifd < 0) {
+		poll(NULL, 0, FOLLOW_POLL_MS);
+	}
+
+	if ((fstat(src->fd, &sb) == 0) &&
+	    ((unsigned long long int)sb.st_size != fl->size)) {
+		fl->size = sb.st_size;
+		fl->idle_ms = 0;
+		done = 0;
+	} else {
+		fl->idle_ms += FOLLOW_POLL_MS;
+	}
+	if (done || ((fl->timeout != 0) && (fl->idle_ms >= fl->timeout))) {
+		src->growing = 0;
+	}
+}
+
+
+static size_t follow_read(struct source *src, uint8_t *buf, size_t len,
+                          unsigned long long int off)
+{
+	size_t done = 0;
+
+	for (;;) {
+		done += file_read(src, buf + done, len - done, off + done);
+		if ((done == len) || !src->growing) return done;
+		if (done >= 8) return done & ~7ULL;
+		follow_wait(src);
+	}
+}
+
+
+static void follow_close(struct source *src)
+{
+	struct follow *fl = src->priv;
+
+	if (fl->ifd >= 0) close(fl->ifd);
+	free(fl);
+	file_close(src);
+}
+
+
+static void follow_open(struct source *src, unsigned long long int timeout)
+{
+	struct follow *fl;
+	struct stat sb;
+
+	if (src->read != file_read) {
+		fprintf(stderr, "%s: only plain files can be followed\n",
+		        src->name);
+		exit(EXIT_FAILURE);
+	}
+	fl = xcalloc(1, sizeof(*fl));
+	fl->timeout = timeout;
+	if (fstat(src->fd, &sb) == 0) fl->size = sb.st_size;
+
+	// A read lease can only be taken while nobody has the file open for
+	// writing, and with no writer to close it only secs or Ctrl-C will
+	// end the wait
+	if ((timeout == 0) && (fcntl(src->fd, F_SETLEASE, F_RDLCK) == 0)) {
+		fcntl(src->fd, F_SETLEASE, F_UNLCK);
+		fprintf(stderr, "%s isn't open for writing, so --follow waits "
+		        "for a writer until Ctrl-C.\nGive --follow=secs to stop "
+		        "once it stays idle.\n", src->name);
+	}
+	fl->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ((fl->ifd >= 0) &&
+	    (inotify_add_watch(fl->ifd, src->name,
+	                       IN_MODIFY | IN_CLOSE_WRITE) < 0)) {
+		close(fl->ifd);
+		fl->ifd = -1;
+	}
+	src->priv = fl;
+	src->read = follow_read;
+	src->extent = NULL;       // holes may yet be written
+	src->close = follow_close;
+	src->growing = 1;
+}
+
+
+// Buffer pool
+//
+// Chunk buffers all come from one pool. Chunks are CHUNK_SIZE bytes and
+// aligned to CHUNK_SIZE, carved out of 2 MiB slabs that are backed by huge
+// pages where the system allows. Each thread keeps a small cache of free
+// chunks so the pool lock stays cold, and the total mapped is held under
+// an optional cap (-m): once the cap is reached, threads wait for chunks to
+// come back instead of mapping more. Slabs live until exit.
+//
+// With --numa auto, each node has a free list of its own. A thread maps new
+// slabs bound to its own node, and touches them first from that node in
+// case the binding isn't allowed; freed chunks go back to the list of the
+// node their slab is on. Only at the cap does a thread take a chunk from
+// another node's list rather than wait.
+#define CHUNK_SIZE (64 * 1024)
+#define POOL_SLAB (2 * 1024 * 1024)
+#define POOL_CACHE 8
+#define POOL_HASH 256
+
+struct pool_slab {
+	uint8_t *slab;
+	int node;
+	struct pool_slab *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long int cap;    // 0 for no cap
+	unsigned long long int mapped;
+	void *free_list[PLACE_NODES];  // chained through the first word
+	int waiting;
+	struct pool_slab *slabs[POOL_HASH];    // by address, with --numa
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, {NULL},
+          0, {NULL}};
+
+static __thread struct {
+	void *chunks[POOL_CACHE];
+	int n;
+} pool_cache;
+
+
+// Have the pages of a new slab come from this thread's node, where there is
+// more than one. Pages are only placed when first touched, so this comes
+// before anything can touch them.
+static void pool_bind(uint8_t *slab)
+{
+	unsigned long int mask[1024 / (8 * sizeof(unsigned long int))];
+	int id = place.node_id[thread_node];
+
+	if ((place.nnodes == 1) || (id >= 1024)) return;
+	memset(mask, 0, sizeof(mask));
+	mask[id / (8 * sizeof(mask[0]))] |= 1UL << (id % (8 * sizeof(mask[0])));
+	// Failing that, first touch from this thread does nearly as well
+	syscall(SYS_mbind, slab, POOL_SLAB, MPOL_PREFERRED, mask,
+	        8 * sizeof(mask), 0);
+}
+
+
+// Map a slab, preferring explicit huge pages, then transparent ones. Slabs
+// that may hold decrypted data are locked in memory.
+static uint8_t *pool_map_slab(void)
+{
+	uint8_t *map, *slab;
+
+	map = mmap(NULL, POOL_SLAB, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (map != MAP_FAILED) {
+		pool_bind(map);
+		if (lock_buffers) lock_secret(map, POOL_SLAB);
+		return map;
+	}
+
+	// Over-allocate so the slab can be aligned for THP, then trim
+	map = mmap(NULL, 2 * POOL_SLAB, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	slab = (uint8_t *)(((uintptr_t)map + POOL_SLAB - 1) &
+	                   ~(uintptr_t)(POOL_SLAB - 1));
+	if (slab > map) munmap(map, slab - map);
+	munmap(slab + POOL_SLAB, map + POOL_SLAB - slab);
+	madvise(slab, POOL_SLAB, MADV_HUGEPAGE);
+	pool_bind(slab);
+	if (lock_buffers) lock_secret(slab, POOL_SLAB);
+
+	return slab;
+}
+
+
+// Node of the slab holding chunk
+static int pool_node(void *chunk)
+{
+	uintptr_t slab = (uintptr_t)chunk & ~(uintptr_t)(POOL_SLAB - 1);
+	struct pool_slab *e;
+
+	if (place.nnodes == 1) return 0;
+	e = pool.slabs[(slab / POOL_SLAB) % POOL_HASH];
+	while ((uintptr_t)e->slab != slab) e = e->next;
+	return e->node;
+}
+
+
+static void *chunk_get(void)
+{
+	int node = thread_node, other;
+	struct pool_slab *e;
+	uint8_t *slab;
+	void *chunk;
+	size_t h;
+
+	if (pool_cache.n > 0) return pool_cache.chunks[--pool_cache.n];
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.free_list[node] == NULL) {
+		if ((pool.cap == 0) || (pool.mapped + POOL_SLAB <= pool.cap) ||
+		    (pool.mapped == 0)) {
+			slab = pool_map_slab();
+			pool.mapped += POOL_SLAB;
+			for (size_t i = 0; i < POOL_SLAB; i += CHUNK_SIZE) {
+				*(void **)(slab + i) = pool.free_list[node];
+				pool.free_list[node] = slab + i;
+			}
+			if (place.nnodes > 1) {
+				h = ((uintptr_t)slab / POOL_SLAB) % POOL_HASH;
+				e = xcalloc(1, sizeof(*e));
+				e->slab = slab;
+				e->node = node;
+				e->next = pool.slabs[h];
+				pool.slabs[h] = e;
+			}
+			break;
+		}
+		for (other = 0; other < place.nnodes; other++) {
+			if (pool.free_list[other] != NULL) break;
+		}
+		if (other < place.nnodes) {
+			node = other;
+			break;
+		}
+		pool.waiting++;
+		pthread_cond_wait(&pool.cond, &pool.lock);
+		pool.waiting--;
+	}
+	chunk = pool.free_list[node];
+	pool.free_list[node] = *(void **)chunk;
+	pthread_mutex_unlock(&pool.lock);
+
+	return chunk;
+}
+
+
+static void chunk_put_global(void *chunk)
+{
+	int node;
+
+	pthread_mutex_lock(&pool.lock);
+	node = pool_node(chunk);
+	*(void **)chunk = pool.free_list[node];
+	pool.free_list[node] = chunk;
+	if (pool.waiting > 0) pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
+// Return this thread's cached chunks, for threads about to exit, go idle or
+// park, and for threads waiting on the cap
+static void pool_flush(void)
+{
+	while (pool_cache.n > 0) {
+		chunk_put_global(pool_cache.chunks[--pool_cache.n]);
+	}
+}
+
+
+static void chunk_put(void *chunk)
+{
+	// Hand chunks straight back, cached ones too, if anyone is stuck at
+	// the cap
+	if (__atomic_load_n(&pool.waiting, __ATOMIC_RELAXED)) {
+		chunk_put_global(chunk);
+		pool_flush();
+	} else if (pool_cache.n == POOL_CACHE) {
+		chunk_put_global(chunk);
+	} else {
+		pool_cache.chunks[pool_cache.n++] = chunk;
+	}
+}
+
+
+// Automatic tuning
+//
+// With -j auto, hexdiff works out what it is allowed to use rather than
+// going by what it can see. In a container it may see every CPU of the host
+// but be held to a cgroup v2 quota, so the thread count is the affinity
+// mask cut down to the tightest cpu.max of its cgroup and the ones above.
+// Unless -m says otherwise, buffer memory is capped at a quarter of the
+// headroom left under the tightest memory.max or memory.high. The sysfs
+// queue settings of the devices under the inputs set how far -r reads
+// ahead: not far on a spinning disk, and up to half the request queue on
+// flash.
+//
+// Those are starting points. While comparing, throughput is measured over
+// windows of TUNE_WINDOW, and a knob is moved one way for as long as that
+// helps and back once it doesn't: the -r readahead depth, and the number of
+// -c workers allowed to pick up ranges. When the quota's cgroup reports
+// throttling in the last window, a worker is parked straight away.
+#define TUNE_WINDOW 100000000ULL  // ns between adjustments
+
+struct tune_knob {
+	int val;
+	int min;
+	int max;
+	int dir;                   // +1 or -1, the way it last moved
+	double rate;               // bytes per ns in the last window
+	unsigned long long int start;
+	unsigned long long int bytes;
+};
+
+static struct {
+	int on;
+	int jobs;                  // threads chosen
+	int cpus;                  // in the affinity mask
+	int quota;                 // CPUs allowed by cpu.max, 0 for no limit
+	char *quota_dir;           // cgroup holding that quota
+	unsigned long long int mem;    // headroom under the memory limit
+	int rotational;
+	int queue;                 // shortest nr_requests of the inputs
+	unsigned long long int throttled;
+	struct tune_knob ahead;    // blocks of -r readahead
+	struct tune_knob workers;  // -c workers allowed to run
+} tune;
+
+
+// Read a small sysfs or cgroup file, returning 0 if it isn't there
+static int tune_read(const char *dir, const char *file, char *buf,
+                     size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if ((fd = open(path, O_RDONLY)) < 0) return 0;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0) return 0;
+	buf[n] = '\0';
+	return 1;
+}
+
+
+// Where cgroup v2 is mounted, and this process's group below that, or NULL
+// without cgroup v2
+static char *tune_cgroup(size_t *root_len)
+{
+	char line[PATH_MAX], mount[PATH_MAX], *dir = NULL;
+	size_t len;
+	FILE *file;
+
+	mount[0] = '\0';
+	if ((file = fopen("/proc/self/mountinfo", "r")) == NULL) return NULL;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if ((strstr(line, " - cgroup2 ") != NULL) &&
+		    (sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1)) {
+			break;
+		}
+		mount[0] = '\0';
+	}
+	fclose(file);
+	if (mount[0] == '\0') return NULL;
+
+	if ((file = fopen("/proc/self/cgroup", "r")) == NULL) return NULL;
+	while ((dir == NULL) && (fgets(line, sizeof(line), file) != NULL)) {
+		if (strncmp(line, "0::", 3) != 0) continue;
+		len = strcspn(line + 3, "\n");
+		while ((len > 0) && (line[3 + len - 1] == '/')) len--;
+		*root_len = strlen(mount);
+		dir = xcalloc(1, *root_len + len + 1);
+		memcpy(dir, mount, *root_len);
+		memcpy(dir + *root_len, line + 3, len);
+	}
+	fclose(file);
+	return dir;
+}
+
+
+// Walk from this process's cgroup up to the root, keeping the tightest CPU
+// quota and memory headroom found on the way
+static void tune_limits(void)
+{
+	unsigned long long int quota, period, limit, current;
+	const char *files[2] = { "memory.max", "memory.high" };
+	char buf[256], *dir, *slash;
+	size_t root_len;
+	cpu_set_t set;
+
+	tune.cpus = 1;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		tune.cpus = CPU_COUNT(&set);
+	}
+	tune.mem = ULLONG_MAX;
+	if ((dir = tune_cgroup(&root_len)) == NULL) return;
+
+	for (;;) {
+		if (tune_read(dir, "cpu.max", buf, sizeof(buf)) &&
+		    (sscanf(buf, "%llu %llu", &quota, &period) == 2) &&
+		    (period > 0)) {
+			quota = (quota + period - 1) / period;
+			if ((tune.quota == 0) ||
+			    (quota < (unsigned long long int)tune.quota)) {
+				tune.quota = (quota > 0) ? quota : 1;
+				free(tune.quota_dir);
+				tune.quota_dir = strdup(dir);
+			}
+		}
+		current = 0;
+		if (tune_read(dir, "memory.current", buf, sizeof(buf))) {
+			current = strtoull(buf, NULL, 10);
+		}
+		for (int i = 0; i < 2; i++) {
+			if (!tune_read(dir, files[i], buf, sizeof(buf)) ||
+			    !isdigit((unsigned char)buf[0])) {
+				continue;
+			}
+			limit = strtoull(buf, NULL, 10);
+			limit = (limit > current) ? limit - current : 0;
+			if (limit < tune.mem) tune.mem = limit;
+		}
+		if (strlen(dir) <= root_len) break;
+		slash = strrchr(dir, '/');
+		*slash = '\0';
+	}
+	free(dir);
+}
+
+
+// Microseconds the quota's cgroup has spent throttled so far
+static unsigned long long int tune_throttled(void)
+{
+	char buf[1024], *p;
+
+	if ((tune.quota_dir == NULL) ||
+	    !tune_read(tune.quota_dir, "cpu.stat", buf, sizeof(buf)) ||
+	    ((p = strstr(buf, "throttled_usec ")) == NULL)) {
+		return 0;
+	}
+	return strtoull(p + 15, NULL, 10);
+}
+
+
+// Queue settings of the block device under an input, if it has one
+static void tune_device(struct source *src)
+{
+	char dir[PATH_MAX], buf[64];
+	struct stat sb;
+	dev_t dev;
+	int n;
+
+	if ((src->read != file_read) || (fstat(src->fd, &sb) != 0)) return;
+	dev = S_ISBLK(sb.st_mode) ? sb.st_rdev : sb.st_dev;
+
+	// Partitions keep their queue in the parent disk's directory
+	snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u/queue",
+	         major(dev), minor(dev));
+	if (!tune_read(dir, "nr_requests", buf, sizeof(buf))) {
+		snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u/../queue",
+		         major(dev), minor(dev));
+		if (!tune_read(dir, "nr_requests", buf, sizeof(buf))) return;
+	}
+	n = atoi(buf);
+	if ((n > 0) && ((tune.queue == 0) || (n < tune.queue))) tune.queue = n;
+	if (tune_read(dir, "rotational", buf, sizeof(buf)) &&
+	    (atoi(buf) != 0)) {
+		tune.rotational = 1;
+	}
+}
+
+
+static void knob_init(struct tune_knob *k, int val, int min, int max)
+{
+	k->min = min;
+	k->max = (max > min) ? max : min;
+	k->val = (val < k->min) ? k->min : (val > k->max) ? k->max : val;
+	k->dir = (k->val < k->max) ? 1 : -1;
+	k->rate = 0;
+	k->start = 0;
+	k->bytes = 0;
+}
+
+
+// Count bytes done with the knob where it is. Once a window is up, move it
+// on in the same direction if throughput held up, or turn back if it fell.
+// Returns whether the knob moved.
+static int knob_step(struct tune_knob *k, unsigned long long int bytes)
+{
+	unsigned long long int now = prof_now();
+	double rate;
+	int step;
+
+	if (k->start == 0) k->start = now;
+	k->bytes += bytes;
+	if (now - k->start < TUNE_WINDOW) return 0;
+
+	rate = (double)k->bytes / (now - k->start);
+	if (rate < 0.95 * k->rate) k->dir = -k->dir;
+	k->rate = rate;
+	k->start = now;
+	k->bytes = 0;
+
+	step = (k->val / 4 > 1) ? k->val / 4 : 1;
+	if ((k->val + k->dir * step > k->max) ||
+	    (k->val + k->dir * step < k->min)) {
+		k->dir = -k->dir;
+	}
+	k->val += k->dir * step;
+	if (k->val > k->max) k->val = k->max;
+	if (k->val < k->min) k->val = k->min;
+	return 1;
+}
+
+
+// Resolve -j auto, before anything is started
+static int tune_jobs(void)
+{
+	unsigned long long int cap;
+
+	tune_limits();
+	tune.jobs = tune.cpus;
+	if ((tune.quota > 0) && (tune.quota < tune.jobs)) {
+		tune.jobs = tune.quota;
+	}
+	if ((pool.cap == 0) && (tune.mem != ULLONG_MAX)) {
+		cap = (tune.mem / 4) & ~(POOL_SLAB - 1ULL);
+		pool.cap = (cap > POOL_SLAB) ? cap : POOL_SLAB;
+	}
+	tune.throttled = tune_throttled();
+	return tune.jobs;
+}
+
+
+// Look at what the inputs sit on, and let all the workers run to begin with
+static void tune_inputs(struct source *src1, struct source *src2, int jobs)
+{
+	tune_device(src1);
+	tune_device(src2);
+	knob_init(&tune.workers, jobs, 1, jobs);
+}
+
+
+// Count the bytes of a finished -c range, and adjust the number of
+// workers once a window is up. Called with the ranges locked.
+static void tune_workers(unsigned long long int bytes)
+{
+	unsigned long long int throttled;
+	int val = tune.workers.val;
+
+	if (!knob_step(&tune.workers, bytes)) return;
+	throttled = tune_throttled();
+	if (throttled > tune.throttled) {
+		tune.workers.val = (val > tune.workers.min) ? val - 1 : val;
+		tune.workers.dir = -1;
+	}
+	tune.throttled = throttled;
+}
+
+
+// What -j auto found and where the knobs ended up, for --profile
+static void print_tune(void)
+{
+	fprintf(stderr, "-j auto: %d of %d CPUs", tune.jobs, tune.cpus);
+	if (tune.quota > 0) {
+		fprintf(stderr, ", cpu.max allows %d", tune.quota);
+	}
+	if (pool.cap > 0) {
+		fprintf(stderr, ", buffers capped at %llu MiB", pool.cap >> 20);
+	}
+	if (tune.ahead.max > 0) {
+		fprintf(stderr, ", readahead %d blocks at the end",
+		        tune.ahead.val);
+	}
+	if (tune.workers.max > 1) {
+		fprintf(stderr, ", %d of %d workers running at the end",
+		        tune.workers.val, tune.workers.max);
+	}
+	fprintf(stderr, "\n");
+}
+
+
+// Symbol maps
+//
+// With --symbols, differing rows and ranges are annotated with the section
+// and symbol that contain them, taken from an ELF file's symbol table, nm
+// output or a GNU ld map. Symbols without a size run up to the next one.
+// Starting addresses are kept in Eytzinger (breadth-first) order, so a
+// lookup walks down one cache line after another, and since rows come in
+// increasing order the last hit is checked before searching at all.
+struct symbol {
+	unsigned long long int start;
+	unsigned long long int end;
+	const char *name;
+};
+
+struct symtab {
+	struct symbol *syms;           // sorted by start
+	size_t n;
+	size_t cap;
+	unsigned long long int *keys;  // starts in Eytzinger order, from 1
+	size_t *rank;                  // index in syms of each key
+};
+
+static struct {
+	int on;
+	struct symtab funcs;
+	struct symtab sects;
+	unsigned long long int base;   // address of offset 0 in file1
+} symbols;
+
+static __thread size_t sym_hint[2];
+
+
+static void sym_add(struct symtab *t, unsigned long long int start,
+                    unsigned long long int size, const char *name)
+{
+	if (t->n == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 1024;
+		t->syms = realloc(t->syms, t->cap * sizeof(*t->syms));
+		if (t->syms == NULL) {
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	t->syms[t->n].start = start;
+	t->syms[t->n].end = start + size;
+	t->syms[t->n].name = name;
+	t->n++;
+}
+
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol *sa = a, *sb = b;
+
+	if (sa->start != sb->start) return (sa->start > sb->start) ? 1 : -1;
+	// Sized symbols first, so they win over aliases without a size
+	return (sb->end - sb->start > 0) - (sa->end - sa->start > 0);
+}
+
+
+// Lay out the sorted starts in Eytzinger order, returning the next index
+static size_t sym_layout(struct symtab *t, size_t i, size_t k)
+{
+	if (k <= t->n) {
+		i = sym_layout(t, i, 2 * k);
+		t->keys[k] = t->syms[i].start;
+		t->rank[k] = i++;
+		i = sym_layout(t, i, 2 * k + 1);
+	}
+	return i;
+}
+
+
+static void sym_finish(struct symtab *t)
+{
+	size_t i, n;
+
+	qsort(t->syms, t->n, sizeof(*t->syms), symbol_cmp);
+
+	// Drop aliases, and end unsized symbols where the next one starts
+	n = 0;
+	for (i = 0; i < t->n; i++) {
+		if ((n > 0) && (t->syms[n - 1].start == t->syms[i].start)) {
+			continue;
+		}
+		t->syms[n++] = t->syms[i];
+	}
+	t->n = n;
+	for (i = 0; i < n; i++) {
+		if (t->syms[i].end != t->syms[i].start) continue;
+		t->syms[i].end = (i + 1 < n) ? t->syms[i + 1].start :
+		                 ULLONG_MAX;
+	}
+
+	t->keys = xcalloc(n + 1, sizeof(*t->keys));
+	t->rank = xcalloc(n + 1, sizeof(*t->rank));
+	sym_layout(t, 0, 1);
+}
+
+
+static const struct symbol *sym_find(const struct symtab *t,
+                                     unsigned long long int addr,
+                                     size_t *hint)
+{
+	const struct symbol *s;
+	size_t k, i;
+
+	if (t->n == 0) return NULL;
+	s = &t->syms[*hint];
+	if ((*hint < t->n) && (s->start <= addr) && (addr < s->end)) return s;
+
+	// Find the first start above addr: the path taken is kept in the bits
+	// of k, and the last left turn is where the search ended up
+	k = 1;
+	while (k <= t->n) {
+		__builtin_prefetch(t->keys + 16 * k);
+		k = 2 * k + (t->keys[k] <= addr);
+	}
+	k >>= __builtin_ffsll(~k);
+	i = (k == 0) ? t->n : t->rank[k];
+
+	// The symbol before it is the only one that can hold addr
+	if (i == 0) return NULL;
+	s = &t->syms[--i];
+	if (addr >= s->end) return NULL;
+	*hint = i;
+	return s;
+}
+
+
+// Parse str as a hex number, with or without 0x
+static int parse_hex(const char *str, unsigned long long int *val)
+{
+	char *end;
+
+	if (!isxdigit((unsigned char)str[0])) return 0;
+	*val = strtoull(str, &end, 16);
+	return *end == '\0';
+}
+
+
+// nm output ("addr [size] type name") and GNU ld maps, where symbols are
+// "0xaddr name" and output sections start in the first column as
+// ".name 0xaddr 0xsize"
+static void load_symbol_text(const char *path)
+{
+	char *line, *tok[5], *save;
+	unsigned long long int addr, size;
+	size_t cap;
+	FILE *file;
+	int n;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	line = NULL;
+	cap = 0;
+	while (getline(&line, &cap, file) != -1) {
+		int indented = isspace((unsigned char)line[0]);
+
+		n = 0;
+		tok[0] = strtok_r(line, " \t\r\n", &save);
+		while ((n < 5) && (tok[n] != NULL)) {
+			if (++n < 5) tok[n] = strtok_r(NULL, " \t\r\n", &save);
+		}
+
+		if ((n == 3) && (strlen(tok[1]) == 1) &&
+		    parse_hex(tok[0], &addr)) {
+			sym_add(&symbols.funcs, addr, 0, strdup(tok[2]));
+		} else if ((n == 4) && (strlen(tok[2]) == 1) &&
+		           parse_hex(tok[0], &addr) &&
+		           parse_hex(tok[1], &size)) {
+			sym_add(&symbols.funcs, addr, size, strdup(tok[3]));
+		} else if ((n == 2) && indented &&
+		           (strncmp(tok[0], "0x", 2) == 0) &&
+		           parse_hex(tok[0] + 2, &addr)) {
+			sym_add(&symbols.funcs, addr, 0, strdup(tok[1]));
+		} else if ((n == 3) && !indented && (tok[0][0] == '.') &&
+		           (strncmp(tok[1], "0x", 2) == 0) &&
+		           parse_hex(tok[1] + 2, &addr) &&
+		           (strncmp(tok[2], "0x", 2) == 0) &&
+		           parse_hex(tok[2] + 2, &size) && (size > 0)) {
+			sym_add(&symbols.sects, addr, size, strdup(tok[0]));
+		}
+	}
+	if (ferror(file)) {
+		fprintf(stderr, "getline: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(line);
+	fclose(file);
+}
+
+
+static void load_symbol_elf(struct source *src)
+{
+	unsigned char ident[EI_NIDENT];
+	Elf64_Ehdr eh64;
+	Elf32_Ehdr eh32;
+	Elf64_Shdr *sh, *tab;
+	Elf32_Shdr sh32;
+	Elf64_Sym sym64;
+	Elf32_Sym sym32;
+	unsigned long long int shoff, value, size;
+	size_t shnum, shentsize, shstrndx, entsize;
+	unsigned char type;
+	unsigned int shndx, name;
+	char *shstr, *str;
+
+	read_exact(src, ident, EI_NIDENT, 0);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (ident[EI_DATA] != ELFDATA2LSB) {
+#else
+	if (ident[EI_DATA] != ELFDATA2MSB) {
+#endif
+		fprintf(stderr, "%s: foreign byte order\n", src->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (ident[EI_CLASS] == ELFCLASS64) {
+		read_exact(src, &eh64, sizeof(eh64), 0);
+		shoff = eh64.e_shoff;
+		shnum = eh64.e_shnum;
+		shentsize = eh64.e_shentsize;
+		shstrndx = eh64.e_shstrndx;
+	} else if (ident[EI_CLASS] == ELFCLASS32) {
+		read_exact(src, &eh32, sizeof(eh32), 0);
+		shoff = eh32.e_shoff;
+		shnum = eh32.e_shnum;
+		shentsize = eh32.e_shentsize;
+		shstrndx = eh32.e_shstrndx;
+	} else {
+		fprintf(stderr, "%s: unknown ELF class\n", src->name);
+		exit(EXIT_FAILURE);
+	}
+	if ((shnum == 0) || (shstrndx >= shnum)) {
+		fprintf(stderr, "%s: no section headers\n", src->name);
+		exit(EXIT_FAILURE);
+	}
+
+	// Widen the section headers to the 64-bit layout
+	sh = xcalloc(shnum, sizeof(*sh));
+	for (size_t i = 0; i < shnum; i++) {
+		if (ident[EI_CLASS] == ELFCLASS64) {
+			read_exact(src, &sh[i], sizeof(sh[i]),
+			           shoff + i * shentsize);
+			continue;
+		}
+		read_exact(src, &sh32, sizeof(sh32), shoff + i * shentsize);
+		sh[i].sh_name = sh32.sh_name;
+		sh[i].sh_type = sh32.sh_type;
+		sh[i].sh_flags = sh32.sh_flags;
+		sh[i].sh_addr = sh32.sh_addr;
+		sh[i].sh_offset = sh32.sh_offset;
+		sh[i].sh_size = sh32.sh_size;
+		sh[i].sh_link = sh32.sh_link;
+	}
+
+	// Names are pointed at in the string tables, which are kept for good
+	shstr = xcalloc(1, sh[shstrndx].sh_size + 1);
+	read_exact(src, shstr, sh[shstrndx].sh_size, sh[shstrndx].sh_offset);
+	tab = NULL;
+	for (size_t i = 0; i < shnum; i++) {
+		if ((sh[i].sh_flags & SHF_ALLOC) && (sh[i].sh_addr != 0) &&
+		    (sh[i].sh_size > 0) &&
+		    (sh[i].sh_name < sh[shstrndx].sh_size)) {
+			sym_add(&symbols.sects, sh[i].sh_addr, sh[i].sh_size,
+			        shstr + sh[i].sh_name);
+		}
+		if ((sh[i].sh_type == SHT_SYMTAB) ||
+		    ((sh[i].sh_type == SHT_DYNSYM) && (tab == NULL))) {
+			tab = &sh[i];
+		}
+	}
+	if ((tab == NULL) || (tab->sh_link >= shnum)) {
+		free(sh);
+		return;
+	}
+
+	str = xcalloc(1, sh[tab->sh_link].sh_size + 1);
+	read_exact(src, str, sh[tab->sh_link].sh_size,
+	           sh[tab->sh_link].sh_offset);
+	entsize = (ident[EI_CLASS] == ELFCLASS64) ? sizeof(sym64) :
+	          sizeof(sym32);
+	for (size_t i = 1; i < tab->sh_size / entsize; i++) {
+		if (ident[EI_CLASS] == ELFCLASS64) {
+			read_exact(src, &sym64, entsize,
+			           tab->sh_offset + i * entsize);
+			name = sym64.st_name;
+			value = sym64.st_value;
+			size = sym64.st_size;
+			type = ELF64_ST_TYPE(sym64.st_info);
+			shndx = sym64.st_shndx;
+		} else {
+			read_exact(src, &sym32, entsize,
+			           tab->sh_offset + i * entsize);
+			name = sym32.st_name;
+			value = sym32.st_value;
+			size = sym32.st_size;
+			type = ELF32_ST_TYPE(sym32.st_info);
+			shndx = sym32.st_shndx;
+		}
+		// Skip undefined and absolute symbols, and ARM mapping
+		// symbols like $t and $d
+		if ((shndx == SHN_UNDEF) || (shndx >= SHN_LORESERVE)) continue;
+		if ((type != STT_FUNC) && (type != STT_OBJECT) &&
+		    (type != STT_NOTYPE)) {
+			continue;
+		}
+		if ((name >= sh[tab->sh_link].sh_size) || (str[name] == '\0') ||
+		    (str[name] == '$')) {
+			continue;
+		}
+		sym_add(&symbols.funcs, value, size, str + name);
+	}
+	free(sh);
+}
+
+
+static void load_symbols(const char *path)
+{
+	struct source src;
+	unsigned char magic[SELFMAG];
+
+	source_open(&src, path);
+	if ((src.read(&src, magic, SELFMAG, 0) == SELFMAG) &&
+	    (memcmp(magic, ELFMAG, SELFMAG) == 0)) {
+		load_symbol_elf(&src);
+	} else {
+		load_symbol_text(path);
+	}
+	src.close(&src);
+
+	if ((symbols.funcs.n == 0) && (symbols.sects.n == 0)) {
+		fprintf(stderr, "%s: no symbols found\n", path);
+		exit(EXIT_FAILURE);
+	}
+	sym_finish(&symbols.funcs);
+	sym_finish(&symbols.sects);
+	symbols.on = 1;
+}
+
+
+// Append the section and symbol holding off in file1, if any
+static void print_symbol(struct outbuf *out, unsigned long long int off)
+{
+	const struct symbol *sect, *func;
+	unsigned long long int addr;
+
+	addr = symbols.base + off;
+	sect = sym_find(&symbols.sects, addr, &sym_hint[0]);
+	func = sym_find(&symbols.funcs, addr, &sym_hint[1]);
+	if ((sect != NULL) && (func != NULL)) {
+		ob_printf(out, "  %s %s+0x%llx", sect->name, func->name,
+		          addr - func->start);
+	} else if (func != NULL) {
+		ob_printf(out, "  %s+0x%llx", func->name, addr - func->start);
+	} else if (sect != NULL) {
+		ob_printf(out, "  %s+0x%llx", sect->name, addr - sect->start);
+	}
+}
+
+
+// Byte transitions
+//
+// With --transitions, every differing byte is counted in a 256x256 matrix by
+// its value in file1 and file2. Each thread counts into a matrix of its own,
+// so -j workers never contend, and the matrices are summed for the report.
+#define TRANS_TOP 10
+
+struct trans_matrix {
+	unsigned long long int count[256][256];
+	struct trans_matrix *next;
+};
+
+struct trans_entry {
+	unsigned long long int count;
+	uint8_t from;
+	uint8_t to;
+};
+
+static struct {
+	int on;
+	size_t top;                // transitions to list
+	const char *csv;           // file for the full matrix, if any
+	pthread_mutex_t lock;
+	struct trans_matrix *all;  // every thread's matrix
+} trans = { 0, TRANS_TOP, NULL, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static __thread struct trans_matrix *thread_trans;
+
+
+// This thread's matrix, or NULL when transitions aren't being counted
+static struct trans_matrix *trans_matrix(void)
+{
+	if (!trans.on) return NULL;
+	if (thread_trans == NULL) {
+		thread_trans = xcalloc(1, sizeof(*thread_trans));
+		pthread_mutex_lock(&trans.lock);
+		thread_trans->next = trans.all;
+		trans.all = thread_trans;
+		pthread_mutex_unlock(&trans.lock);
+	}
+	return thread_trans;
+}
+
+
+static int trans_cmp(const void *a, const void *b)
+{
+	const struct trans_entry *ta = a, *tb = b;
+
+	if (ta->count != tb->count) return (ta->count < tb->count) ? 1 : -1;
+	if (ta->from != tb->from) return ta->from - tb->from;
+	return ta->to - tb->to;
+}
+
+
+static void trans_write_csv(const struct trans_matrix *m)
+{
+	FILE *csv;
+
+	csv = fopen(trans.csv, "w");
+	if (csv == NULL) {
+		fprintf(stderr, "%s: %s\n", trans.csv, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fprintf(csv, "from\\to");
+	for (int j = 0; j < 256; j++) fprintf(csv, ",%02x", j);
+	fprintf(csv, "\n");
+	for (int i = 0; i < 256; i++) {
+		fprintf(csv, "%02x", i);
+		for (int j = 0; j < 256; j++) {
+			fprintf(csv, ",%llu", m->count[i][j]);
+		}
+		fprintf(csv, "\n");
+	}
+	if (fclose(csv) != 0) {
+		fprintf(stderr, "%s: %s\n", trans.csv, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+// Merge the per-thread matrices and print the most common transitions
+static void print_transitions(struct outbuf *out)
+{
+	struct trans_matrix *sum, *m, *next;
+	struct trans_entry *top;
+	unsigned long long int total;
+	size_t n;
+
+	sum = xcalloc(1, sizeof(*sum));
+	for (m = trans.all; m != NULL; m = next) {
+		for (int i = 0; i < 256; i++) {
+			for (int j = 0; j < 256; j++) {
+				sum->count[i][j] += m->count[i][j];
+			}
+		}
+		next = m->next;
+		free(m);
+	}
+	trans.all = NULL;
+	thread_trans = NULL;
+
+	top = xcalloc(256 * 256, sizeof(*top));
+	total = 0;
+	n = 0;
+	for (int i = 0; i < 256; i++) {
+		for (int j = 0; j < 256; j++) {
+			if (sum->count[i][j] == 0) continue;
+			top[n].count = sum->count[i][j];
+			top[n].from = i;
+			top[n].to = j;
+			total += top[n++].count;
+		}
+	}
+	qsort(top, n, sizeof(*top), trans_cmp);
+
+	ob_printf(out, "%s%llu differing bytes, %zu distinct transitions\n",
+	          ansi_reset, total, n);
+	if (n > trans.top) n = trans.top;
+	if (n > 0) ob_printf(out, "from  to          count   share\n");
+	for (size_t i = 0; i < n; i++) {
+		ob_printf(out, "0x%02x  0x%02x  %12llu  %5.1f%%\n",
+		          top[i].from, top[i].to, top[i].count,
+		          100.0 * top[i].count / total);
+	}
+
+	if (trans.csv != NULL) trans_write_csv(sum);
+	free(top);
+	free(sum);
+}
+
+
+// Block checksums
+//
+// With --checksum, both inputs are taken to be made of fixed-size blocks
+// that each carry a CRC32 or CRC32C of the rest of the block at a set
+// position. When a row differs, the blocks holding it on both sides are
+// read again and checked, and the difference is labelled by which copy is
+// still self-consistent. Matching blocks are never checked, so the bulk of
+// the compare costs no more than before. CRC32C uses the SSE4.2 crc32
+// instruction where the CPU has it, and otherwise both go through
+// slicing-by-8 tables.
+enum ck_class { CK_REAL, CK_LEFT, CK_RIGHT, CK_BOTH, CK_CLASSES };
+
+static const char *const ck_labels[CK_CLASSES] = {
+	"both valid - real change", "left corrupt", "right corrupt",
+	"both corrupt"
+};
+
+static struct {
+	int on;
+	int castagnoli;            // CRC32C rather than CRC32
+	int big_endian;            // byte order of the stored checksum
+	int hardware;              // CRC32C with the SSE4.2 instruction
+	size_t size;               // block size
+	size_t pos;                // offset of the checksum in a block
+	uint32_t table[8][256];    // for a byte followed by 0 to 7 zeros
+} cksum;
+
+
+// Parse ALGO:SIZE[:POS[:be]], where a negative POS counts back from the end
+// of the block and the default is the last four bytes
+static int ck_parse(const char *spec)
+{
+	long long int pos;
+	uint32_t poly, c;
+	size_t n;
+	char *end;
+
+	n = strcspn(spec, ":");
+	if ((n == 5) && (strncmp(spec, "crc32", n) == 0)) {
+		cksum.castagnoli = 0;
+	} else if ((n == 6) && (strncmp(spec, "crc32c", n) == 0)) {
+		cksum.castagnoli = 1;
+	} else {
+		return 0;
+	}
+	if (spec[n] != ':') return 0;
+	cksum.size = strtoull(spec + n + 1, &end, 0);
+	if ((cksum.size < 4) || (cksum.size > CHUNK_SIZE)) return 0;
+	pos = cksum.size - 4;
+	if ((end[0] == ':') && (end[1] != ':')) {
+		pos = strtoll(end + 1, &end, 0);
+		if (pos < 0) pos += cksum.size;
+	} else if (end[0] == ':') {
+		end++;
+	}
+	if (strcmp(end, ":be") == 0) {
+		cksum.big_endian = 1;
+	} else if (*end != '\0') {
+		return 0;
+	}
+	if ((pos < 0) || (pos + 4 > (long long int)cksum.size)) return 0;
+	cksum.pos = pos;
+
+	poly = cksum.castagnoli ? 0x82f63b78 : 0xedb88320;
+	for (int i = 0; i < 256; i++) {
+		c = i;
+		for (int k = 0; k < 8; k++) c = (c >> 1) ^ (poly & -(c & 1));
+		cksum.table[0][i] = c;
+	}
+	for (int i = 0; i < 256; i++) {
+		c = cksum.table[0][i];
+		for (int t = 1; t < 8; t++) {
+			c = (c >> 8) ^ cksum.table[0][c & 0xff];
+			cksum.table[t][i] = c;
+		}
+	}
+#if defined(__x86_64__)
+	cksum.hardware = cksum.castagnoli && __builtin_cpu_supports("sse4.2");
+#endif
+	cksum.on = 1;
+	return 1;
+}
+
+
+// Eight bytes a step, each looked up in its own table, so the steps don't
+// wait on each other byte by byte
+static uint32_t ck_crc_soft(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t (*t)[256] = cksum.table, lo, hi;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+		            ((uint32_t)p[3] << 24));
+		hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+		      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+		      t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+	}
+	for (; len > 0; len--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t ck_crc_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = c;
+	for (; len > 0; len--) crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+
+static uint32_t ck_crc(uint32_t crc, const uint8_t *p, size_t len)
+{
+#if defined(__x86_64__)
+	if (cksum.hardware) return ck_crc_sse42(crc, p, len);
+#endif
+	return ck_crc_soft(crc, p, len);
+}
+
+
+// Whether the block at off in src carries the right checksum, taken over
+// the bytes before and after it. A block cut short by the end of the input
+// counts as corrupt.
+static int ck_valid(struct source *src, unsigned long long int off,
+                    uint8_t *buf)
+{
+	const uint8_t *s;
+	uint32_t crc, want;
+
+	if (src->read(src, buf, cksum.size, off) != cksum.size) return 0;
+	s = buf + cksum.pos;
+	if (cksum.big_endian) {
+		want = ((uint32_t)s[0] << 24) | (s[1] << 16) | (s[2] << 8) |
+		       s[3];
+	} else {
+		want = s[0] | (s[1] << 8) | (s[2] << 16) |
+		       ((uint32_t)s[3] << 24);
+	}
+	crc = ck_crc(0xffffffff, buf, cksum.pos);
+	crc = ck_crc(crc, s + 4, cksum.size - cksum.pos - 4);
+	return ~crc == want;
+}
+
+
+// Check the blocks holding off1 in src1 and off2 in src2
+static enum ck_class ck_classify(struct source *src1,
+                                 unsigned long long int off1,
+                                 struct source *src2,
+                                 unsigned long long int off2)
+{
+	enum prof_stage stage = STAGE_OTHER;
+	uint8_t *buf;
+	int ok1, ok2;
+
+	if (prof.on) stage = prof_switch(STAGE_READ);
+	buf = chunk_get();
+	ok1 = ck_valid(src1, off1 - off1 % cksum.size, buf);
+	ok2 = ck_valid(src2, off2 - off2 % cksum.size, buf);
+	chunk_put(buf);
+	if (prof.on) prof_switch(stage);
+
+	if (ok1 && ok2) return CK_REAL;
+	if (ok2) return CK_LEFT;
+	if (ok1) return CK_RIGHT;
+	return CK_BOTH;
+}
+
+
+// Compare engine
+//
+// Inputs are read a chunk at a time and compared row by row. Once a run of
+// matching rows has been reduced to "...", the rest of the run is skipped
+// in bulk rather than one row at a time.
+//
+// Results go to a sink. In the default mode the sink gets every row that
+// would be printed; with -l it only gets the differing byte ranges, and
+// with -s only a summary at the end.
+enum diff_mode { MODE_ROWS, MODE_RANGES, MODE_SUMMARY };
+
+struct diff_state;
+
+struct diff_sink {
+	void (*same)(struct diff_state *st, const uint8_t *buf1,
+	             const uint8_t *buf2, unsigned long long int skip1,
+	             unsigned long long int skip2, unsigned long long int cnt);
+	void (*diff)(struct diff_state *st, const uint8_t *buf1,
+	             const uint8_t *buf2, unsigned long long int skip1,
+	             unsigned long long int skip2, unsigned long long int cnt);
+	void (*gap)(struct diff_state *st);
+	void (*range)(struct diff_state *st, unsigned long long int off1,
+	              unsigned long long int off2, unsigned long long int len);
+	void (*summary)(struct diff_state *st);
+	void (*realign)(struct diff_state *st, unsigned long long int off1,
+	                unsigned long long int off2, long long int shift);
+};
+
+struct diff_state {
+	struct outbuf *out;
+	int show_all;
+	unsigned long long int eq_run;
+	enum diff_mode mode;
+	const struct diff_sink *sink;
+	unsigned long long int range1;      // differing range being built
+	unsigned long long int range2;
+	unsigned long long int range_len;
+	unsigned long long int compared;    // totals for the summary
+	unsigned long long int diff_bytes;
+	unsigned long long int diff_rows;
+	unsigned long long int first1;
+	unsigned long long int first2;
+	struct trans_matrix *trans;         // byte transitions, if counted
+	struct source *src1;                // inputs of the current range,
+	struct source *src2;                // for --checksum
+	unsigned long long int base1;       // their offsets less addresses
+	unsigned long long int base2;
+	unsigned long long int ck_end1;     // end of the blocks last labelled
+	unsigned long long int ck_end2;
+	unsigned long long int ck_count[CK_CLASSES];
+	enum ck_class ck_last;              // label of the last blocks
+	enum ck_class range_ck;             // and of the range being built
+};
+
+
+// Label the blocks holding a differing row, once for each pair of blocks.
+// In row mode the label goes above the first row that differs in them.
+static void ck_row(struct diff_state *st, unsigned long long int addr1,
+                   unsigned long long int addr2)
+{
+	unsigned long long int off1, off2;
+	enum ck_class c;
+
+	off1 = addr1 + st->base1;
+	off2 = addr2 + st->base2;
+	if ((off1 < st->ck_end1) && (off1 + cksum.size >= st->ck_end1) &&
+	    (off2 < st->ck_end2) && (off2 + cksum.size >= st->ck_end2)) {
+		return;
+	}
+	st->ck_end1 = off1 - off1 % cksum.size + cksum.size;
+	st->ck_end2 = off2 - off2 % cksum.size + cksum.size;
+	c = ck_classify(st->src1, off1, st->src2, off2);
+	st->ck_last = c;
+	st->ck_count[c]++;
+	if (st->mode == MODE_ROWS) {
+		ob_printf(st->out, "%s### 0x%010llx  0x%010llx  %s\n",
+		          ansi_reset, st->ck_end1 - cksum.size - st->base1,
+		          st->ck_end2 - cksum.size - st->base2, ck_labels[c]);
+	}
+}
+
+
+static void text_same(struct diff_state *st, const uint8_t *buf1,
+                      const uint8_t *buf2, unsigned long long int skip1,
+                      unsigned long long int skip2, unsigned long long int cnt)
+{
+	print_same(st->out, buf1, buf2, skip1, skip2, cnt);
+}
+
+
+static void text_diff(struct diff_state *st, const uint8_t *buf1,
+                      const uint8_t *buf2, unsigned long long int skip1,
+                      unsigned long long int skip2, unsigned long long int cnt)
+{
+	print_diff(st->out, buf1, buf2, skip1, skip2, cnt);
+	if (symbols.on) {
+		ob_printf(st->out, "%s", ansi_reset);
+		print_symbol(st->out, skip1 + cnt);
+	}
+	ob_printf(st->out, "\n%s", ansi_reset);
+}
+
+
+static void text_gap(struct diff_state *st)
+{
+	ob_printf(st->out, "...\n");
+}
+
+
+static void text_range(struct diff_state *st, unsigned long long int off1,
+                       unsigned long long int off2, unsigned long long int len)
+{
+	ob_printf(st->out, "0x%010llx  0x%010llx  %llu", off1, off2, len);
+	if (cksum.on) ob_printf(st->out, "  %s", ck_labels[st->range_ck]);
+	if (symbols.on) print_symbol(st->out, off1);
+	ob_printf(st->out, "\n");
+}
+
+
+static void text_summary(struct diff_state *st)
+{
+	if (st->diff_bytes == 0) {
+		ob_printf(st->out, "%llu bytes compared, no differences\n",
+		          st->compared);
+	} else {
+		ob_printf(st->out, "%llu bytes compared, %llu differ in %llu "
+		          "rows, first at 0x%010llx  0x%010llx\n", st->compared,
+		          st->diff_bytes, st->diff_rows, st->first1, st->first2);
+	}
+	if (cksum.on) {
+		ob_printf(st->out, "%llu block pairs differ: %llu left "
+		          "corrupt, %llu right corrupt,\n%llu both corrupt, "
+		          "%llu both valid - real change\n",
+		          st->ck_count[CK_LEFT] + st->ck_count[CK_RIGHT] +
+		          st->ck_count[CK_BOTH] + st->ck_count[CK_REAL],
+		          st->ck_count[CK_LEFT],
+		          st->ck_count[CK_RIGHT], st->ck_count[CK_BOTH],
+		          st->ck_count[CK_REAL]);
+	}
+}
+
+
+// file2 was found shifted by resync, so from here on off1 lines up with off2
+static void text_realign(struct diff_state *st, unsigned long long int off1,
+                         unsigned long long int off2, long long int shift)
+{
+	if (st->mode != MODE_ROWS) return;
+	ob_printf(st->out, "~~~ 0x%010llx  0x%010llx  file2 shifted by %+lld\n",
+	          off1, off2, shift);
+}
+
+
+static const struct diff_sink text_sink = {
+	text_same, text_diff, text_gap, text_range, text_summary,
+	text_realign
+};
+
+
+static void compact_same(struct diff_state *st, const uint8_t *buf1,
+                         const uint8_t *buf2, unsigned long long int skip1,
+                         unsigned long long int skip2,
+                         unsigned long long int cnt)
+{
+	print_compact(st->out, buf1, skip1, skip2, cnt);
+}
+
+
+static const struct diff_sink compact_sink = {
+	compact_same, text_diff, text_gap, text_range, text_summary,
+	text_realign
+};
+
+// Sink that diff_init() hands out, chosen by the output options
+static const struct diff_sink *out_sink = &text_sink;
+
+
+static void diff_init(struct diff_state *st, struct outbuf *out,
+                      int show_all, enum diff_mode mode)
+{
+	memset(st, 0, sizeof(*st));
+	st->out = out;
+	st->show_all = show_all;
+	st->mode = mode;
+	st->sink = out_sink;
+	st->trans = trans_matrix();
+}
+
+
+// Pass on the last differing range, and the summary
+static void diff_finish(struct diff_state *st)
+{
+	if (st->range_len > 0) {
+		st->sink->range(st, st->range1, st->range2, st->range_len);
+		st->range_len = 0;
+	}
+	if (st->mode == MODE_SUMMARY) st->sink->summary(st);
+}
+
+
+// Collect the differing bytes of a row into ranges and totals
+static void count_diff(struct diff_state *st, const uint8_t *buf1,
+                       const uint8_t *buf2, unsigned long long int skip1,
+                       unsigned long long int skip2, unsigned long long int cnt)
+{
+	unsigned long long int off1, off2;
+
+	if (st->diff_rows++ == 0) {
+		st->first1 = skip1 + cnt;
+		st->first2 = skip2 + cnt;
+	}
+	for (int i = 0; i < 8; i++) {
+		if (buf1[i] == buf2[i]) continue;
+		st->diff_bytes++;
+		if (st->trans != NULL) st->trans->count[buf1[i]][buf2[i]]++;
+		if (st->mode != MODE_RANGES) continue;
+
+		off1 = skip1 + cnt + i;
+		off2 = skip2 + cnt + i;
+		if ((st->range_len > 0) &&
+		    (st->range1 + st->range_len == off1) &&
+		    (st->range2 + st->range_len == off2)) {
+			st->range_len++;
+			continue;
+		}
+		if (st->range_len > 0) {
+			st->sink->range(st, st->range1, st->range2,
+			                st->range_len);
+		}
+		st->range1 = off1;
+		st->range2 = off2;
+		st->range_len = 1;
+		st->range_ck = st->ck_last;
+	}
+}
+
+
+// Offset of the first differing byte in a and b, or len if there is none
+static size_t first_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	uint64_t x, y;
+	size_t i = 0;
+
+	// libc's memcmp is vectorized, so let it rule out big blocks
+	while ((len - i >= 256) && (memcmp(a + i, b + i, 256) == 0)) {
+		i += 256;
+	}
+	for (; len - i >= 8; i += 8) {
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y) break;
+	}
+	while ((i < len) && (a[i] == b[i])) i++;
+
+	return i;
+}
+
+
+static void diff_row(struct diff_state *st, const uint8_t *buf1,
+                     const uint8_t *buf2, unsigned long long int skip1,
+                     unsigned long long int skip2, unsigned long long int cnt)
+{
+	enum prof_stage stage = STAGE_OTHER;
+
+	// In row mode nearly every row that gets here is printed
+	if (prof.on && (st->mode == MODE_ROWS)) {
+		stage = prof_switch(STAGE_FORMAT);
+	}
+	st->compared += 8;
+	if (memcmp(buf1, buf2, 8) == 0) {
+		if (st->mode != MODE_ROWS) {
+			// Nothing to show
+		} else if ((st->eq_run == 0) || (st->show_all == 1)) {
+			st->sink->same(st, buf1, buf2, skip1, skip2, cnt);
+		} else if (st->eq_run == 1) {
+			st->sink->gap(st);
+		}
+		st->eq_run++;
+	} else {
+		if (cksum.on) ck_row(st, skip1 + cnt, skip2 + cnt);
+		if (st->mode == MODE_ROWS) {
+			st->sink->diff(st, buf1, buf2, skip1, skip2, cnt);
+		}
+		count_diff(st, buf1, buf2, skip1, skip2, cnt);
+		st->eq_run = 0;
+	}
+	if (prof.on && (st->mode == MODE_ROWS)) prof_switch(stage);
+}
+
+
+static void diff_rows(struct diff_state *st, const uint8_t *buf1,
+                      const uint8_t *buf2, size_t rows,
+                      unsigned long long int skip1,
+                      unsigned long long int skip2, unsigned long long int cnt)
+{
+	size_t i, same;
+
+	for (i = 0; i < rows; i++) {
+		if ((st->eq_run >= 2) && (st->show_all == 0)) {
+			same = first_diff(buf1 + 8 * i, buf2 + 8 * i,
+			                  8 * (rows - i)) / 8;
+			st->eq_run += same;
+			st->compared += 8 * same;
+			i += same;
+			if (i == rows) break;
+		}
+		diff_row(st, buf1 + 8 * i, buf2 + 8 * i, skip1, skip2,
+		         cnt + 8 * i);
+	}
+}
+
+
+// Account for rows known to hold the same pattern on both sides without
+// reading them
+static void fill_rows(struct diff_state *st, unsigned long long int rows,
+                      const uint8_t *row, unsigned long long int skip1,
+                      unsigned long long int skip2, unsigned long long int cnt)
+{
+	unsigned long long int i;
+
+	for (i = 0; (i < rows) && ((st->eq_run < 2) || st->show_all); i++) {
+		diff_row(st, row, row, skip1, skip2, cnt + 8 * i);
+		if (sigint_recv) return;
+	}
+	st->eq_run += rows - i;
+	st->compared += 8 * (rows - i);
+}
+
+
+// Whether all len bytes of buf (a multiple of 8) repeat row. The words are
+// or-ed together in fixed blocks so the compiler can vectorize the loop,
+// with a check for a mismatch after each block.
+static int fill_match(const uint8_t *buf, size_t len, const uint8_t *row)
+{
+	uint64_t pat, w, acc;
+	size_t i, j;
+
+	memcpy(&pat, row, 8);
+	for (i = 0; i + 256 <= len; i += 256) {
+		acc = 0;
+		for (j = 0; j < 256; j += 8) {
+			memcpy(&w, buf + i + j, 8);
+			acc |= w ^ pat;
+		}
+		if (acc != 0) return 0;
+	}
+	for (acc = 0; i < len; i += 8) {
+		memcpy(&w, buf + i, 8);
+		acc |= w ^ pat;
+	}
+	return acc == 0;
+}
+
+
+struct extent_cache {
+	unsigned long long int end;
+	enum extent_kind kind;
+	uint8_t fill[4];
+};
+
+
+// Kind of extent at off in src, cached until off passes the end of the
+// cached extent. Zero extents are cached as a zero fill.
+static enum extent_kind cached_extent(struct source *src,
+                                      unsigned long long int off,
+                                      struct extent_cache *ext)
+{
+	unsigned long long int len;
+
+	if (src->extent == NULL) return EXTENT_DATA;
+	if (off >= ext->end) {
+		memset(ext->fill, 0, 4);
+		ext->kind = src->extent(src, off, &len, ext->fill);
+		ext->end = off + len;
+	}
+	return ext->kind;
+}
+
+
+// The row starting at off in a zero or fill extent
+static void extent_row(const struct extent_cache *ext,
+                       unsigned long long int off, uint8_t *row)
+{
+	for (int i = 0; i < 8; i++) row[i] = ext->fill[(off + i) % 4];
+}
+
+
+// Engines
+//
+// The bulk engine is diff_rows() above, which is quickest when differences
+// are few and far between. Where most rows differ, the dense engine writes
+// them straight into the output buffer instead of going through the sink
+// and ob_printf(). Where bytes have been inserted into or deleted from
+// file2, every row after that differs. On a burst of differing rows the
+// resync engine looks for the bytes that follow in file1 a little way
+// either side in file2, with a rolling hash, and if they are there carries
+// on with file2 shifted to match.
+//
+// --engine auto starts with bulk or dense going by a probe of a few blocks
+// of the inputs, then switches between the two chunk by chunk on the share
+// of rows that differed. Resync is tried on every chunk with a burst, as a
+// shift is what makes most rows differ in the first place.
+#define RESYNC_BLOCK 32            // bytes of file1 looked for in file2
+#define RESYNC_RANGE 4096          // furthest shift tried either way
+#define RESYNC_CHECK 256           // bytes that must match once shifted
+#define RESYNC_BURST 4             // differing rows that start a search
+#define PROBE_BLOCKS 8
+#define PROBE_SIZE 4096
+#define PROBE_MIN (4 * 1024 * 1024)
+
+static enum engine engine = ENGINE_BULK;
+
+struct engine_state {
+	enum engine cur;
+	int switching;             // chosen by --engine auto
+	int shifting;              // resync may shift file2
+};
+
+
+// Whether src can be read at any offset, as a shift of file2 needs
+static int source_seekable(struct source *src)
+{
+	if (src->growing || (src->read == hex_read)) return 0;
+	return (src->read != file_read) || (lseek(src->fd, 0, SEEK_CUR) >= 0);
+}
+
+
+// Pick bulk or dense from the share of differing rows in blocks spread
+// evenly over the range and in a few more at random
+static enum engine probe_engine(struct source *src1,
+                                unsigned long long int off1,
+                                struct source *src2,
+                                unsigned long long int off2,
+                                unsigned long long int len)
+{
+	unsigned long long int size1, size2, span, pos, seed, rows, diff;
+	uint8_t *buf1, *buf2;
+	size_t n;
+
+	size1 = source_size(src1);
+	size2 = source_size(src2);
+	if ((size1 == ULLONG_MAX) || (size2 == ULLONG_MAX) ||
+	    (size1 <= off1) || (size2 <= off2)) {
+		return ENGINE_BULK;
+	}
+	span = (size1 - off1 < size2 - off2) ? size1 - off1 : size2 - off2;
+	if ((len != 0) && (len < span)) span = len;
+	if (span < PROBE_MIN) return ENGINE_BULK;
+
+	buf1 = chunk_get();
+	buf2 = chunk_get();
+	rows = diff = 0;
+	seed = span ^ off1 ^ (off2 << 1);
+	for (int i = 0; i < PROBE_BLOCKS; i++) {
+		if (i < PROBE_BLOCKS / 2) {
+			pos = span / (PROBE_BLOCKS / 2) * i;
+			pos &= ~(PROBE_SIZE - 1ULL);
+		} else {
+			seed = seed * 6364136223846793005ULL +
+			       1442695040888963407ULL;
+			pos = ((seed >> 17) % (span - PROBE_SIZE)) & ~7ULL;
+		}
+		n = src1->read(src1, buf1, PROBE_SIZE, off1 + pos);
+		if (src2->read(src2, buf2, PROBE_SIZE, off2 + pos) < n) {
+			n = 0;
+		}
+		for (size_t j = 0; j + 8 <= n; j += 8) {
+			diff += memcmp(buf1 + j, buf2 + j, 8) != 0;
+			rows++;
+		}
+	}
+	chunk_put(buf1);
+	chunk_put(buf2);
+
+	if (prof.on) {
+		pthread_mutex_lock(&prof.lock);
+		prof.probes += PROBE_BLOCKS;
+		prof.probe_rows += rows;
+		prof.probe_diff += diff;
+		pthread_mutex_unlock(&prof.lock);
+	}
+	return (2 * diff >= rows) ? ENGINE_DENSE : ENGINE_BULK;
+}
+
+
+// Rows that mostly differ. Rows that match still go through diff_row(), so
+// gaps come out as usual, and only plain text rows have a faster way out.
+static void dense_rows(struct diff_state *st, const uint8_t *buf1,
+                       const uint8_t *buf2, size_t rows,
+                       unsigned long long int skip1,
+                       unsigned long long int skip2, unsigned long long int cnt)
+{
+	enum prof_stage stage = STAGE_OTHER;
+	unsigned long long int off;
+	const uint8_t *a, *b;
+
+	if ((st->mode != MODE_ROWS) || symbols.on || cksum.on ||
+	    ((st->sink != &text_sink) && (st->sink != &compact_sink))) {
+		diff_rows(st, buf1, buf2, rows, skip1, skip2, cnt);
+		return;
+	}
+
+	if (prof.on) stage = prof_switch(STAGE_FORMAT);
+	for (size_t i = 0; i < rows; i++) {
+		a = buf1 + 8 * i;
+		b = buf2 + 8 * i;
+		off = cnt + 8 * i;
+		if ((memcmp(a, b, 8) == 0) ||
+		    (((skip1 + off) | (skip2 + off)) >> 40)) {
+			diff_row(st, a, b, skip1, skip2, off);
+			continue;
+		}
+		st->compared += 8;
+		put_diff(st->out, a, b, skip1, skip2, off);
+		count_diff(st, a, b, skip1, skip2, off);
+		st->eq_run = 0;
+	}
+	if (prof.on) prof_switch(stage);
+}
+
+
+// Shift of file2 that lines the bytes after the row at r in buf1 up again
+// for at least RESYNC_CHECK bytes, or 0 if there is none nearby. The
+// smallest shift wins.
+static long long int find_shift(const uint8_t *buf1, const uint8_t *buf2,
+                                size_t len, size_t r)
+{
+	const uint64_t mult = 0x100000001b3ULL;
+	const uint8_t *key = buf1 + r + 8;
+	size_t at = r + 8, lo, hi, j, best, dist;
+	uint64_t h, want, top;
+
+	if (at + RESYNC_CHECK > len) return 0;
+
+	// A run of a single value would match anywhere
+	for (j = 1; (j < RESYNC_BLOCK) && (key[j] == key[0]); j++);
+	if (j == RESYNC_BLOCK) return 0;
+
+	lo = (at > RESYNC_RANGE) ? at - RESYNC_RANGE : 0;
+	hi = len - RESYNC_CHECK;
+	if (at + RESYNC_RANGE < hi) hi = at + RESYNC_RANGE;
+	h = want = 0;
+	top = 1;
+	for (j = 0; j < RESYNC_BLOCK; j++) {
+		want = want * mult + key[j];
+		h = h * mult + buf2[lo + j];
+		if (j > 0) top *= mult;
+	}
+
+	best = at;
+	dist = SIZE_MAX;
+	for (j = lo; ; j++) {
+		if ((h == want) && (j != at) &&
+		    (((j > at) ? j - at : at - j) < dist) &&
+		    (memcmp(buf2 + j, key, RESYNC_CHECK) == 0)) {
+			dist = (j > at) ? j - at : at - j;
+			best = j;
+		}
+		if (j == hi) break;
+		h = (h - buf2[j] * top) * mult + buf2[j + RESYNC_BLOCK];
+	}
+	return (long long int)best - (long long int)at;
+}
+
+
+// Compare rows from a chunk with the engine in es, returning how many were
+// done. That is fewer than rows if file2 turned out to be shifted, in which
+// case *shift says by how much.
+static size_t engine_rows(struct diff_state *st, struct engine_state *es,
+                          const uint8_t *buf1, const uint8_t *buf2,
+                          size_t rows, unsigned long long int skip1,
+                          unsigned long long int skip2,
+                          unsigned long long int cnt, long long int *shift)
+{
+	unsigned long long int before = st->diff_rows, diff;
+	size_t r, i;
+
+	*shift = 0;
+	if (prof.on) prof_thread()->chunks[es->cur]++;
+
+	if (es->shifting) {
+		r = first_diff(buf1, buf2, 8 * rows) / 8;
+		if ((r == rows) && (st->eq_run >= 2) && !st->show_all) {
+			// Nothing to show, and already compared
+			st->eq_run += rows;
+			st->compared += 8 * rows;
+			return rows;
+		}
+		for (i = 1; (i <= RESYNC_BURST) && (r + i < rows) &&
+		     (memcmp(buf1 + 8 * (r + i), buf2 + 8 * (r + i), 8) != 0);
+		     i++);
+		if (i > RESYNC_BURST) {
+			*shift = find_shift(buf1, buf2, 8 * rows, 8 * r);
+		}
+		if (*shift != 0) {
+			diff_rows(st, buf1, buf2, r + 1, skip1, skip2, cnt);
+			st->sink->realign(st, skip1 + cnt + 8 * (r + 1),
+			                  skip2 + cnt + 8 * (r + 1) + *shift,
+			                  *shift);
+			if (prof.on) prof_thread()->resyncs++;
+			return r + 1;
+		}
+	}
+	if (es->cur == ENGINE_DENSE) {
+		dense_rows(st, buf1, buf2, rows, skip1, skip2, cnt);
+	} else {
+		diff_rows(st, buf1, buf2, rows, skip1, skip2, cnt);
+	}
+
+	// Switch with some hysteresis, so a chunk near the threshold doesn't
+	// flip back and forth
+	diff = st->diff_rows - before;
+	if (es->switching && (es->cur == ENGINE_BULK) && (2 * diff >= rows) &&
+	    (rows >= 64)) {
+		es->cur = ENGINE_DENSE;
+		if (prof.on) prof_thread()->switches++;
+	} else if (es->switching && (es->cur == ENGINE_DENSE) &&
+	           (8 * diff < rows)) {
+		es->cur = ENGINE_BULK;
+		if (prof.on) prof_thread()->switches++;
+	}
+	return rows;
+}
+
+
+// Compare len bytes (0 for no limit) from off1 in src1 and off2 in src2,
+// printing offsets relative to addr1 and addr2. When either input ends, the
+// last row is padded out with zeros.
+static void diff_range(struct diff_state *st,
+                       struct source *src1, unsigned long long int off1,
+                       struct source *src2, unsigned long long int off2,
+                       unsigned long long int len,
+                       unsigned long long int addr1,
+                       unsigned long long int addr2)
+{
+	uint8_t *buf1, *buf2, last1[8], last2[8], row1[8], row2[8];
+	unsigned long long int cnt, rows, left, off, skip_end;
+	struct extent_cache ext1, ext2;
+	enum extent_kind kind1, kind2;
+	struct engine_state es;
+	struct source *src;
+	uint8_t *buf, *row;
+	size_t want, n1, n2, n, *np, done;
+	long long int shift;
+
+	es.cur = engine;
+	es.switching = engine == ENGINE_AUTO;
+	if (es.switching) es.cur = probe_engine(src1, off1, src2, off2, len);
+	es.shifting = ((engine == ENGINE_RESYNC) || es.switching) &&
+	              (st->sink->realign != NULL) && source_seekable(src2);
+
+	st->src1 = src1;
+	st->src2 = src2;
+	st->base1 = off1 - addr1;
+	st->base2 = off2 - addr2;
+
+	buf1 = chunk_get();
+	buf2 = chunk_get();
+
+	cnt = 0;
+	skip_end = ULLONG_MAX;
+	ext1.end = ext2.end = 0;
+	while (((cnt < len) || (len == 0)) && (sigint_recv == 0)) {
+		kind1 = cached_extent(src1, off1 + cnt, &ext1);
+		kind2 = cached_extent(src2, off2 + cnt, &ext2);
+		rows = ext1.end - (off1 + cnt);
+		if (ext2.end - (off2 + cnt) < rows) {
+			rows = ext2.end - (off2 + cnt);
+		}
+		if ((len != 0) && (len - cnt < rows)) rows = len - cnt;
+		rows /= 8;
+
+		// Leave out whole rows that are unused on both sides, showing
+		// them as a gap
+		if ((kind1 == EXTENT_UNUSED) && (kind2 == EXTENT_UNUSED) &&
+		    (rows > 0)) {
+			if ((st->mode == MODE_ROWS) && (cnt != skip_end) &&
+			    ((st->eq_run < 2) || st->show_all)) {
+				st->sink->gap(st);
+			}
+			if (st->eq_run < 2) st->eq_run = 2;
+			cnt += 8 * rows;
+			skip_end = cnt;
+			continue;
+		}
+
+		// Unused space on one side only is compared like data
+		if (kind1 == EXTENT_UNUSED) kind1 = EXTENT_DATA;
+		if (kind2 == EXTENT_UNUSED) kind2 = EXTENT_DATA;
+		if (kind1 != EXTENT_DATA) extent_row(&ext1, off1 + cnt, row1);
+		if (kind2 != EXTENT_DATA) extent_row(&ext2, off2 + cnt, row2);
+
+		// Skip whole rows that hold the same pattern on both sides
+		if ((kind1 != EXTENT_DATA) && (kind2 != EXTENT_DATA) &&
+		    (memcmp(row1, row2, 8) == 0)) {
+			if (rows > 0) {
+				if (prof.on) prof_bytes(8 * rows);
+				fill_rows(st, rows, row1, addr1, addr2, cnt);
+				cnt += 8 * rows;
+				continue;
+			}
+		}
+
+		// Stop at the next extent boundary on either side, so unused
+		// and pattern extents further on are still picked up
+		want = CHUNK_SIZE;
+		if ((len != 0) && (len - cnt < want)) {
+			want = (len - cnt + 7) & ~7ULL;
+		}
+		if ((rows > 0) && (8 * rows < want)) want = 8 * rows;
+		n1 = n2 = SIZE_MAX;
+
+		// Where only one side is a pattern, check the other side
+		// against it and only produce the pattern if that fails
+		if ((kind1 == EXTENT_DATA) != (kind2 == EXTENT_DATA)) {
+			if (kind1 == EXTENT_DATA) {
+				left = ext2.end - (off2 + cnt);
+				src = src1;
+				off = off1 + cnt;
+				buf = buf1;
+				row = row2;
+				np = &n1;
+			} else {
+				left = ext1.end - (off1 + cnt);
+				src = src2;
+				off = off2 + cnt;
+				buf = buf2;
+				row = row1;
+				np = &n2;
+			}
+			if (left >= 8) {
+				if (left < want) want = left & ~7ULL;
+				if (prof.on) prof_switch(STAGE_READ);
+				*np = src->read(src, buf, want, off);
+				if (prof.on) prof_switch(STAGE_COMPARE);
+				if ((*np == want) &&
+				    fill_match(buf, want, row)) {
+					if (prof.on) prof_bytes(want);
+					fill_rows(st, want / 8, row,
+					          addr1, addr2, cnt);
+					cnt += want;
+					continue;
+				}
+			}
+		}
+
+		if (prof.on) prof_switch(STAGE_READ);
+		if (n1 == SIZE_MAX) {
+			n1 = src1->read(src1, buf1, want, off1 + cnt);
+		}
+		if (n2 == SIZE_MAX) {
+			n2 = src2->read(src2, buf2, want, off2 + cnt);
+		}
+		n = (n1 < n2) ? n1 : n2;
+		if (prof.on) prof_switch(STAGE_COMPARE);
+
+		done = engine_rows(st, &es, buf1, buf2, n / 8, addr1, addr2,
+		                   cnt, &shift);
+		if (prof.on) prof_bytes((shift != 0) ? 8 * done : n);
+		if (shift != 0) {
+			// Carry on from the row after the burst, with file2
+			// shifted
+			cnt += 8 * done;
+			off2 += shift;
+			addr2 += shift;
+			ext2.end = 0;
+			continue;
+		}
+		n -= n % 8;
+		cnt += n;
+
+		// A followed file can come up short while it still grows
+		if (((n1 < want) && !src1->growing) ||
+		    ((n2 < want) && !src2->growing)) {
+			n1 = (n1 - n < 8) ? n1 - n : 8;
+			n2 = (n2 - n < 8) ? n2 - n : 8;
+			memset(last1, 0, 8);
+			memset(last2, 0, 8);
+			memcpy(last1, buf1 + n, n1);
+			memcpy(last2, buf2 + n, n2);
+			diff_row(st, last1, last2, addr1, addr2, cnt);
+			// -s counts only the bytes there are in the last row
+			st->compared -= 8 - ((n1 > n2) ? n1 : n2);
+			break;
+		}
+	}
+	if (prof.on) prof_switch(STAGE_OTHER);
+
+	chunk_put(buf1);
+	chunk_put(buf2);
+}
+
+
+// Walk the extents of both inputs for ranges that are in use on one side
+// and unused on the other, adding up their lengths. The ranges themselves
+// are printed if out is given.
+static void alloc_walk(struct outbuf *out, struct source *src1,
+                       unsigned long long int off1, struct source *src2,
+                       unsigned long long int off2,
+                       unsigned long long int len,
+                       unsigned long long int *only1,
+                       unsigned long long int *only2)
+{
+	struct extent_cache ext1, ext2;
+	unsigned long long int cnt, n, end1, end2, start;
+	int state, prev;
+
+	ext1.end = ext2.end = 0;
+	*only1 = *only2 = 0;
+	start = 0;
+	prev = 0;
+	for (cnt = 0; ; cnt += n) {
+		state = 0;
+		end1 = end2 = ULLONG_MAX;
+		if ((len == 0) || (cnt < len)) {
+			state = (cached_extent(src1, off1 + cnt, &ext1) !=
+			         EXTENT_UNUSED) -
+			        (cached_extent(src2, off2 + cnt, &ext2) !=
+			         EXTENT_UNUSED);
+			if (src1->extent != NULL) end1 = ext1.end;
+			if (src2->extent != NULL) end2 = ext2.end;
+		}
+		if ((state != prev) && (prev != 0)) {
+			if (prev > 0) {
+				*only1 += cnt - start;
+			} else {
+				*only2 += cnt - start;
+			}
+			if (out != NULL) {
+				ob_printf(out, "0x%010llx  0x%010llx  %llu  "
+				          "file%d only\n", off1 + start,
+				          off2 + start, cnt - start,
+				          (prev > 0) ? 1 : 2);
+			}
+		}
+		if (state != prev) start = cnt;
+		prev = state;
+
+		// Nothing more to tell once both are past their allocation
+		// information
+		if ((end1 == ULLONG_MAX) && (end2 == ULLONG_MAX)) break;
+		n = end1 - (off1 + cnt);
+		if (end2 - (off2 + cnt) < n) n = end2 - (off2 + cnt);
+		if ((len != 0) && (len - cnt < n)) n = len - cnt;
+	}
+}
+
+
+// List the ranges allocated in only one of the inputs, for --alloc
+static void print_alloc(struct outbuf *out, struct source *src1,
+                        unsigned long long int off1, struct source *src2,
+                        unsigned long long int off2,
+                        unsigned long long int len)
+{
+	unsigned long long int only1, only2;
+
+	alloc_walk(NULL, src1, off1, src2, off2, len, &only1, &only2);
+	ob_printf(out, "%s%llu bytes allocated in file1 only, %llu in file2 "
+	          "only\n", ansi_reset, only1, only2);
+	if (only1 + only2 > 0) {
+		alloc_walk(out, src1, off1, src2, off2, len, &only1, &only2);
+	}
+}
+
+
+// Page cache residency
+//
+// With -r, the range is split into blocks. Blocks already in the page cache
+// on both sides are compared up front, while readahead is started for the
+// cold ones. The output pass then goes through the blocks in offset order,
+// skipping over the blocks already known to match and finding the cold
+// ones on their way in. Residency comes from mincore() on a mapping of the
+// file, or failing that from a RWF_NOWAIT read.
+#define RES_BLOCK (1024 * 1024)
+#define RES_AHEAD 64               // blocks of readahead kept in flight
+
+struct res_block {
+	unsigned char hot;
+	unsigned char same;
+};
+
+
+// Mark blocks that are not entirely resident as cold
+static void find_cold(struct source *src, unsigned long long int off,
+                      unsigned long long int len, struct res_block *blocks,
+                      size_t nblocks)
+{
+	unsigned long long int page, base, b_start, b_end, p;
+	unsigned char *vec;
+	uint8_t *probe;
+	struct iovec iov;
+	size_t map_len;
+	void *map;
+
+	page = sysconf(_SC_PAGESIZE);
+	base = off & ~(page - 1);
+	map_len = off + len - base;
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, src->fd, base);
+	if (map != MAP_FAILED) {
+		vec = xcalloc((map_len + page - 1) / page, 1);
+		if (mincore(map, map_len, vec) == 0) {
+			for (size_t i = 0; i < nblocks; i++) {
+				b_start = off + i * RES_BLOCK;
+				b_end = b_start + RES_BLOCK;
+				if (b_end > off + len) b_end = off + len;
+				for (p = (b_start - base) / page;
+				     p < (b_end - base + page - 1) / page; p++) {
+					if (!(vec[p] & 1)) {
+						blocks[i].hot = 0;
+						break;
+					}
+				}
+			}
+			free(vec);
+			munmap(map, map_len);
+			return;
+		}
+		free(vec);
+		munmap(map, map_len);
+	}
+
+	// No mincore(), so ask for each block without blocking on I/O. This
+	// reads the hot blocks, but they are about to be compared anyway.
+	probe = chunk_get();
+	for (size_t i = 0; i < nblocks; i++) {
+		for (p = i * RES_BLOCK; blocks[i].hot &&
+		     (p < (i + 1) * RES_BLOCK) && (p < len); p += CHUNK_SIZE) {
+			iov.iov_base = probe;
+			iov.iov_len = (len - p < CHUNK_SIZE) ? len - p : CHUNK_SIZE;
+			if (preadv2(src->fd, &iov, 1, off + p, RWF_NOWAIT) !=
+			    (ssize_t)iov.iov_len) {
+				blocks[i].hot = 0;
+			}
+		}
+	}
+	chunk_put(probe);
+}
+
+
+// Readahead depth for -j auto to start from and stay within
+static void res_tune(void)
+{
+	int ahead = RES_AHEAD, max = 4 * RES_AHEAD;
+
+	if (tune.rotational) {
+		ahead = 4;
+		max = 16;
+	} else if (tune.queue > 0) {
+		ahead = tune.queue / 4;
+		max = tune.queue / 2;
+	}
+
+	// Page cache filled by readahead is charged to the cgroup as well
+	if ((tune.mem != ULLONG_MAX) &&
+	    ((unsigned long long int)max > tune.mem / 4 / (2 * RES_BLOCK))) {
+		max = tune.mem / 4 / (2 * RES_BLOCK);
+	}
+	knob_init(&tune.ahead, ahead, 2, max);
+}
+
+
+// Start readahead for the next cold blocks, up to RES_AHEAD (or as tuned)
+// past cur
+static void res_readahead(struct source *src1, unsigned long long int off1,
+                          struct source *src2, unsigned long long int off2,
+                          struct res_block *blocks, size_t nblocks,
+                          size_t cur, size_t *ahead)
+{
+	size_t depth = tune.on ? (size_t)tune.ahead.val : RES_AHEAD;
+
+	for (; (*ahead < nblocks) && (*ahead < cur + depth); (*ahead)++) {
+		if (blocks[*ahead].hot) continue;
+		posix_fadvise(src1->fd, off1 + *ahead * RES_BLOCK, RES_BLOCK,
+		              POSIX_FADV_WILLNEED);
+		posix_fadvise(src2->fd, off2 + *ahead * RES_BLOCK, RES_BLOCK,
+		              POSIX_FADV_WILLNEED);
+	}
+}
+
+
+static void diff_resident(struct diff_state *st,
+                          struct source *src1, unsigned long long int off1,
+                          struct source *src2, unsigned long long int off2,
+                          unsigned long long int len)
+{
+	unsigned long long int size1, size2, common, b_len, p;
+	struct res_block *blocks;
+	uint8_t *buf1, *buf2;
+	size_t nblocks, ahead, n;
+
+	// Work out how much both inputs have in common. Anything past that,
+	// where the last row gets padded, is left to diff_range().
+	size1 = source_size(src1);
+	size2 = source_size(src2);
+	if ((size1 == ULLONG_MAX) || (size2 == ULLONG_MAX) ||
+	    (size1 <= off1) || (size2 <= off2)) {
+		diff_range(st, src1, off1, src2, off2, len, off1, off2);
+		return;
+	}
+	common = (size1 - off1 < size2 - off2) ? size1 - off1 : size2 - off2;
+	common &= ~7ULL;
+	if ((len != 0) && (((len + 7) & ~7ULL) < common)) {
+		common = (len + 7) & ~7ULL;
+	}
+
+	nblocks = (common + RES_BLOCK - 1) / RES_BLOCK;
+	blocks = xcalloc(nblocks + 1, sizeof(*blocks));
+	for (size_t i = 0; i < nblocks; i++) blocks[i].hot = 1;
+	if (common > 0) {
+		find_cold(src1, off1, common, blocks, nblocks);
+		find_cold(src2, off2, common, blocks, nblocks);
+	}
+
+	// Get the cold blocks coming while the hot ones are compared
+	if (tune.on) res_tune();
+	ahead = 0;
+	res_readahead(src1, off1, src2, off2, blocks, nblocks, 0, &ahead);
+
+	buf1 = chunk_get();
+	buf2 = chunk_get();
+	for (size_t i = 0; (i < nblocks) && (sigint_recv == 0); i++) {
+		if (!blocks[i].hot) continue;
+		b_len = (i + 1 < nblocks) ? RES_BLOCK : common - i * RES_BLOCK;
+		blocks[i].same = 1;
+		for (p = 0; blocks[i].same && (p < b_len); p += n) {
+			n = (b_len - p < CHUNK_SIZE) ? b_len - p : CHUNK_SIZE;
+			if ((src1->read(src1, buf1, n,
+			                off1 + i * RES_BLOCK + p) != n) ||
+			    (src2->read(src2, buf2, n,
+			                off2 + i * RES_BLOCK + p) != n) ||
+			    (first_diff(buf1, buf2, n) != n)) {
+				blocks[i].same = 0;
+			}
+		}
+	}
+	chunk_put(buf1);
+	chunk_put(buf2);
+
+	// Output pass, in offset order
+	for (size_t i = 0; (i < nblocks) && (sigint_recv == 0); i++) {
+		res_readahead(src1, off1, src2, off2, blocks, nblocks, i,
+		              &ahead);
+		b_len = (i + 1 < nblocks) ? RES_BLOCK : common - i * RES_BLOCK;
+		if (blocks[i].same && (st->eq_run >= 2) && !st->show_all) {
+			st->eq_run += b_len / 8;
+			st->compared += b_len;
+			continue;
+		}
+		diff_range(st, src1, off1 + i * RES_BLOCK, src2,
+		           off2 + i * RES_BLOCK, b_len, off1 + i * RES_BLOCK,
+		           off2 + i * RES_BLOCK);
+		if (tune.on && !blocks[i].hot) knob_step(&tune.ahead, b_len);
+	}
+
+	// Whatever is left runs into the end of the shorter input
+	if ((sigint_recv == 0) && ((len == 0) || (len > common))) {
+		diff_range(st, src1, off1 + common, src2, off2 + common,
+		           (len == 0) ? 0 : len - common, off1 + common,
+		           off2 + common);
+	}
+
+	free(blocks);
+}
+
+
+static void print_header(struct outbuf *out)
+{
+	ob_printf(out, "%s   offset      0 1 2 3 4 5 6 7 01234567    "
+	               "   offset      0 1 2 3 4 5 6 7 01234567\n",
+	          ansi_reset);
+}
+
+
+// HTML reports
+//
+// With --html, the rows that would be printed are gathered into hunks of
+// consecutive rows, and each hunk is embedded in the page as two base64
+// blobs of raw bytes rather than as rendered text. A small script lays out
+// the rows virtually and only decodes and renders the hunks on screen, with
+// the same coloring as print_same() and print_diff().
+#define HTML_HUNK_ROWS 8192
+
+static struct {
+	unsigned long long int addr1;  // offsets of the first row of the hunk
+	unsigned long long int addr2;
+	size_t rows;
+	int gap;                       // a "..." comes before the hunk
+	uint8_t data1[8 * HTML_HUNK_ROWS];
+	uint8_t data2[8 * HTML_HUNK_ROWS];
+} html;
+
+static const char html_head[] =
+"<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>hexdiff</title>\n"
+"<style>\n"
+"body{margin:0;background:#000;color:#ccc;font:13px monospace}\n"
+"#v{height:100vh;overflow-y:auto;position:relative}\n"
+"#p{position:absolute;left:0;right:0;white-space:pre}\n"
+"#p div{height:16px;line-height:16px}\n"
+".d{color:#e33}.g{color:#3c3}\n"
+"</style></head><body><div id=\"v\"><div id=\"s\"></div>"
+"<div id=\"p\"></div></div>\n"
+"<script>var H=[];function h(a,b,n,g,x,y){H.push({a:a,b:b,n:n,g:g,x:x,"
+"y:y})}</script>\n";
+
+static const char html_tail[] =
+"<script>(function(){\n"
+"var R=16,M=1e7,v=document.getElementById('v'),\n"
+"s=document.getElementById('s'),p=document.getElementById('p');\n"
+"var S=[],t=1;\n"
+"for(var i=0;i<H.length;i++){if(H[i].g)t++;S.push(t);t+=H[i].n}\n"
+"s.style.height=Math.min(t*R,M)+'px';\n"
+"function dec(b){var s=atob(b),u=new Uint8Array(s.length);\n"
+" for(var i=0;i<s.length;i++)u[i]=s.charCodeAt(i);return u}\n"
+"function hx(n){return(n<16?'0':'')+n.toString(16)}\n"
+"function ch(n){if(n<32||n>126)return'.';var c=String.fromCharCode(n);\n"
+" return c=='<'?'&lt;':c=='>'?'&gt;':c=='&'?'&amp;':c}\n"
+"function ad(a,k){return'0x'+(BigInt('0x'+a)+BigInt(k)).toString(16)"
+".padStart(10,'0')}\n"
+"function side(a,u,w,o,d){var x='',y='',c,l='';\n"
+" for(var i=0;i<8;i++){c=d?(u[o+i]==w[o+i]?'g':'d'):'';\n"
+"  if(c!=l){if(l){x+='</span>';y+='</span>'}\n"
+"   if(c){x+='<span class='+c+'>';y+='<span class='+c+'>'}l=c}\n"
+"  x+=hx(u[o+i]);y+=ch(u[o+i])}\n"
+" if(l){x+='</span>';y+='</span>'}\n"
+" return(d?'<span class=d>'+a+'</span>':a)+'  '+x+' '+y}\n"
+"function row(i){if(i==0)return'   offset      0 1 2 3 4 5 6 7 01234567  "
+"     offset      0 1 2 3 4 5 6 7 01234567';\n"
+" var lo=0,hi=H.length-1,m;\n"
+" while(lo<hi){m=(lo+hi+1)>>1;if(S[m]-H[m].g<=i)lo=m;else hi=m-1}\n"
+" var k=H[lo];if(i<S[lo])return'...';\n"
+" k.u=k.u||dec(k.x);k.w=k.w||dec(k.y);\n"
+" var r=i-S[lo],o=8*r,d=0;\n"
+" for(var j=0;j<8;j++)if(k.u[o+j]!=k.w[o+j])d=1;\n"
+" return side(ad(k.a,o),k.u,k.w,o,d)+'    '+side(ad(k.b,o),k.w,k.u,o,d)}\n"
+"function draw(){var n=Math.ceil(v.clientHeight/R)+1,\n"
+" f=Math.max(0,Math.min(t-n,Math.round(v.scrollTop/Math.max(1,\n"
+" s.offsetHeight-v.clientHeight)*(t-n)))),h='';\n"
+" if(t*R<=M)f=Math.floor(v.scrollTop/R);\n"
+" for(var i=f;i<f+n&&i<t;i++)h+='<div>'+row(i)+'</div>';\n"
+" p.style.top=v.scrollTop+'px';p.innerHTML=h}\n"
+"v.onscroll=draw;window.onresize=draw;draw()})()</script>\n"
+"</body></html>\n";
+
+
+static void base64(struct outbuf *out, const uint8_t *data, size_t len)
+{
+	static const char digits[] =
+	        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+	        "0123456789+/";
+	char quad[4];
+	uint32_t v;
+
+	for (size_t i = 0; i < len; i += 3) {
+		v = (uint32_t)data[i] << 16;
+		if (i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+		if (i + 2 < len) v |= data[i + 2];
+		quad[0] = digits[v >> 18];
+		quad[1] = digits[(v >> 12) & 0x3f];
+		quad[2] = (i + 1 < len) ? digits[(v >> 6) & 0x3f] : '=';
+		quad[3] = (i + 2 < len) ? digits[v & 0x3f] : '=';
+		ob_write(out, quad, 4);
+	}
+}
+
+
+static void html_flush(struct outbuf *out)
+{
+	if (html.rows == 0) return;
+	ob_printf(out, "<script>h(\"%010llx\",\"%010llx\",%zu,%d,\"",
+	          html.addr1, html.addr2, html.rows, html.gap);
+	base64(out, html.data1, 8 * html.rows);
+	ob_printf(out, "\",\"");
+	base64(out, html.data2, 8 * html.rows);
+	ob_printf(out, "\")</script>\n");
+	html.rows = 0;
+	html.gap = 0;
+}
+
+
+static void html_row(struct diff_state *st, const uint8_t *buf1,
+                     const uint8_t *buf2, unsigned long long int skip1,
+                     unsigned long long int skip2, unsigned long long int cnt)
+{
+	// Rows that don't follow on from the hunk start a new one
+	if ((html.rows == HTML_HUNK_ROWS) || ((html.rows > 0) &&
+	    ((html.addr1 + 8 * html.rows != skip1 + cnt) ||
+	     (html.addr2 + 8 * html.rows != skip2 + cnt)))) {
+		html_flush(st->out);
+	}
+	if (html.rows == 0) {
+		html.addr1 = skip1 + cnt;
+		html.addr2 = skip2 + cnt;
+	}
+	memcpy(html.data1 + 8 * html.rows, buf1, 8);
+	memcpy(html.data2 + 8 * html.rows, buf2, 8);
+	html.rows++;
+}
+
+
+static void html_gap(struct diff_state *st)
+{
+	html_flush(st->out);
+	html.gap = 1;
+}
+
+
+static const struct diff_sink html_sink = {
+	html_row, html_row, html_gap, text_range, text_summary, NULL
+};
+
+
+static void html_begin(struct outbuf *out)
+{
+	ob_write(out, html_head, sizeof(html_head) - 1);
+}
+
+
+static void html_end(struct outbuf *out)
+{
+	html_flush(out);
+	if (html.gap) {
+		// Trailing "..." with no rows after it
+		ob_printf(out, "<script>h(\"0\",\"0\",0,1,\"\",\"\")"
+		               "</script>\n");
+	}
+	ob_write(out, html_tail, sizeof(html_tail) - 1);
+}
+
+
+// Worker threads. Each worker runs fn(arg, index) with its own index.
+struct worker {
+	pthread_t thread;
+	void (*fn)(void *arg, int index);
+	void *arg;
+	int index;
+};
+
+
+static void *worker_main(void *ptr)
+{
+	struct worker *w = ptr;
+
+	place_thread();
+	w->fn(w->arg, w->index);
+	pool_flush();
+	return NULL;
+}
+
+
+static struct worker *start_workers(int jobs,
+                                    void (*fn)(void *arg, int index),
+                                    void *arg)
+{
+	struct worker *workers;
+	int err;
+
+	workers = xcalloc(jobs, sizeof(*workers));
+	for (int i = 0; i < jobs; i++) {
+		workers[i].fn = fn;
+		workers[i].arg = arg;
+		workers[i].index = i;
+		err = pthread_create(&workers[i].thread, NULL, worker_main,
+		                     &workers[i]);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+	return workers;
+}
+
+
+static void join_workers(struct worker *workers, int jobs)
+{
+	for (int i = 0; i < jobs; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	free(workers);
+}
+
+
+static void run_workers(int jobs, void (*fn)(void *arg, int index), void *arg)
+{
+	join_workers(start_workers(jobs, fn, arg), jobs);
+}
+
+
+// Compressed output
+//
+// With --output name.gz or name.zst, output is formatted straight into
+// ZFRAME_SIZE frame buffers. Each full frame is compressed on its own by a
+// worker thread, as an independent gzip member or zstd frame, and frames
+// are written out in order by whichever worker finishes the next one due.
+// Concatenated members and frames decompress as a single stream.
+#define ZFRAME_SIZE (1024 * 1024)
+
+enum zformat { ZFMT_GZIP, ZFMT_ZSTD };
+enum zstate { ZF_FREE, ZF_FILLING, ZF_READY, ZF_BUSY, ZF_DONE };
+
+struct zframe {
+	char *in;
+	size_t in_len;
+	char *out;
+	size_t out_len;
+	enum zstate state;
+};
+
+static struct {
+	enum zformat format;
+	const char *path;
+	FILE *file;
+	struct zframe *frames;
+	int nframes;
+	size_t out_cap;
+	unsigned long long int next_fill;  // sequence numbers of frames
+	unsigned long long int next_comp;
+	unsigned long long int next_write;
+	int writing;
+	int finished;
+	int jobs;
+	struct worker *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} zw = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+
+static void compress_frame(struct zframe *f)
+{
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+	size_t n;
+#endif
+
+	switch (zw.format) {
+#ifdef HAVE_ZLIB
+	case ZFMT_GZIP:
+		memset(&zs, 0, sizeof(zs));
+		// 16 + 15 window bits asks for a gzip wrapper
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15,
+		                 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "deflateInit2 failed\n");
+			exit(EXIT_FAILURE);
+		}
+		zs.next_in = (Bytef *)f->in;
+		zs.avail_in = f->in_len;
+		zs.next_out = (Bytef *)f->out;
+		zs.avail_out = zw.out_cap;
+		if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			fprintf(stderr, "deflate failed\n");
+			exit(EXIT_FAILURE);
+		}
+		f->out_len = zs.total_out;
+		deflateEnd(&zs);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ZFMT_ZSTD:
+		n = ZSTD_compress(f->out, zw.out_cap, f->in, f->in_len, 3);
+		if (ZSTD_isError(n)) {
+			fprintf(stderr, "ZSTD_compress: %s\n",
+			        ZSTD_getErrorName(n));
+			exit(EXIT_FAILURE);
+		}
+		f->out_len = n;
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+
+// Write out finished frames in order. Called with the lock held.
+static void zw_write_done(void)
+{
+	struct zframe *f;
+
+	if (zw.writing) return;
+	zw.writing = 1;
+	for (;;) {
+		f = &zw.frames[zw.next_write % zw.nframes];
+		if ((zw.next_write == zw.next_comp) || (f->state != ZF_DONE)) {
+			break;
+		}
+		pthread_mutex_unlock(&zw.lock);
+		if (fwrite(f->out, 1, f->out_len, zw.file) != f->out_len) {
+			fprintf(stderr, "%s: %s\n", zw.path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		pthread_mutex_lock(&zw.lock);
+		f->state = ZF_FREE;
+		zw.next_write++;
+		pthread_cond_broadcast(&zw.cond);
+	}
+	zw.writing = 0;
+}
+
+
+static void zw_worker(void *arg, int index)
+{
+	struct zframe *f;
+
+	pthread_mutex_lock(&zw.lock);
+	for (;;) {
+		f = &zw.frames[zw.next_comp % zw.nframes];
+		if ((zw.next_comp < zw.next_fill) && (f->state == ZF_READY)) {
+			f->state = ZF_BUSY;
+			zw.next_comp++;
+			pthread_mutex_unlock(&zw.lock);
+			compress_frame(f);
+			pthread_mutex_lock(&zw.lock);
+			f->state = ZF_DONE;
+			zw_write_done();
+			continue;
+		}
+		if (zw.finished && (zw.next_comp == zw.next_fill)) break;
+		pthread_cond_wait(&zw.cond, &zw.lock);
+	}
+	zw_write_done();
+	pthread_cond_broadcast(&zw.cond);
+	pthread_mutex_unlock(&zw.lock);
+}
+
+
+// Take the next free frame to format into. Called with the lock held.
+static void zw_take_frame(struct outbuf *ob)
+{
+	struct zframe *f = &zw.frames[zw.next_fill % zw.nframes];
+
+	while (f->state != ZF_FREE) pthread_cond_wait(&zw.cond, &zw.lock);
+	f->state = ZF_FILLING;
+	ob->buf = f->in;
+	ob->len = 0;
+	ob->cap = ZFRAME_SIZE;
+}
+
+
+// Hand the frame being formatted to the workers, and start the next one
+static void zw_flush(struct outbuf *ob, size_t need)
+{
+	struct zframe *f = &zw.frames[zw.next_fill % zw.nframes];
+
+	if (need > ZFRAME_SIZE) {
+		fprintf(stderr, "output record too large\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((ob->len == 0) && (need <= ob->cap)) return;
+
+	pthread_mutex_lock(&zw.lock);
+	f->in_len = ob->len;
+	f->state = ZF_READY;
+	zw.next_fill++;
+	pthread_cond_broadcast(&zw.cond);
+	zw_take_frame(ob);
+	pthread_mutex_unlock(&zw.lock);
+}
+
+
+static void zw_open(struct outbuf *ob, const char *path, enum zformat format,
+                    int jobs)
+{
+#ifndef HAVE_ZLIB
+	if (format == ZFMT_GZIP) {
+		fprintf(stderr, "%s: hexdiff was built without zlib\n", path);
+		exit(EXIT_FAILURE);
+	}
+#endif
+#ifndef HAVE_ZSTD
+	if (format == ZFMT_ZSTD) {
+		fprintf(stderr, "%s: hexdiff was built without zstd\n", path);
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	zw.format = format;
+	zw.path = path;
+	zw.jobs = jobs;
+	if ((zw.file = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	zw.out_cap = 0;
+#ifdef HAVE_ZLIB
+	if (format == ZFMT_GZIP) zw.out_cap = compressBound(ZFRAME_SIZE) + 64;
+#endif
+#ifdef HAVE_ZSTD
+	if (format == ZFMT_ZSTD) zw.out_cap = ZSTD_compressBound(ZFRAME_SIZE);
+#endif
+
+	// Enough frames for every worker to have one on the go, one being
+	// formatted and one being written
+	zw.nframes = 2 * jobs + 2;
+	zw.frames = xcalloc(zw.nframes, sizeof(*zw.frames));
+	for (int i = 0; i < zw.nframes; i++) {
+		zw.frames[i].in = xcalloc(1, ZFRAME_SIZE);
+		zw.frames[i].out = xcalloc(1, zw.out_cap);
+	}
+
+	pthread_mutex_lock(&zw.lock);
+	zw_take_frame(ob);
+	pthread_mutex_unlock(&zw.lock);
+	ob->flush = zw_flush;
+	ob->file = NULL;
+	zw.workers = start_workers(jobs, zw_worker, NULL);
+}
+
+
+// Compress and write the last frame, and wait for everything to land
+static void zw_close(struct outbuf *ob)
+{
+	zw_flush(ob, ZFRAME_SIZE);
+
+	pthread_mutex_lock(&zw.lock);
+	zw.finished = 1;
+	pthread_cond_broadcast(&zw.cond);
+	pthread_mutex_unlock(&zw.lock);
+	join_workers(zw.workers, zw.jobs);
+
+	if (fclose(zw.file) != 0) {
+		fprintf(stderr, "%s: %s\n", zw.path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < zw.nframes; i++) {
+		free(zw.frames[i].in);
+		free(zw.frames[i].out);
+	}
+	free(zw.frames);
+}
+
+
+// ELF core dumps
+//
+// Two cores of the same program can lay out their PT_LOAD segments
+// differently, so they are compared by virtual address instead. The loaded
+// segments of each core form a sorted map of address to file offset, and
+// the address ranges present in both cores are compared, labelled with
+// their virtual addresses. With -j, each range's output is kept in memory
+// until its turn to be printed, up to OUTBUF_SIZE a range and CORE_HELD for
+// all the finished ones, and the rest goes to a temporary file.
+#define CORE_HELD (16 * OUTBUF_SIZE)
+
+struct segment {
+	unsigned long long int vaddr;
+	unsigned long long int offset;
+	unsigned long long int size;
+};
+
+struct core_range {
+	unsigned long long int vaddr;
+	unsigned long long int off1;
+	unsigned long long int off2;
+	unsigned long long int size;
+	struct outbuf text;        // output, spilled to text.file when large
+	int done;
+};
+
+struct core_diff {
+	struct source *src1;
+	struct source *src2;
+	struct core_range *ranges;
+	size_t nranges;
+	size_t next;
+	int show_all;
+	enum diff_mode mode;
+	struct outbuf *out;
+	size_t held;               // output of finished ranges in memory
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+
+// Keep the first OUTBUF_SIZE of the output in memory, and move it all to a
+// temporary file once there's more
+static void ob_spill_flush(struct outbuf *ob, size_t need)
+{
+	if (ob->file == NULL) {
+		if (need == 0) return;
+		if ((ob->file = tmpfile()) == NULL) {
+			fprintf(stderr, "tmpfile: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	ob_file_flush(ob, need);
+}
+
+
+// Move what is left in memory to the temporary file, and free the buffer
+static void ob_spill(struct outbuf *ob)
+{
+	// Making room for anything opens the file and writes the buffer out
+	ob_spill_flush(ob, 1);
+	free(ob->buf);
+	ob->buf = NULL;
+	ob->cap = 0;
+}
+
+
+static int segment_cmp(const void *a, const void *b)
+{
+	const struct segment *sa = a, *sb = b;
+
+	return (sa->vaddr > sb->vaddr) - (sa->vaddr < sb->vaddr);
+}
+
+
+static size_t load_segments(struct source *src, struct segment **segs)
+{
+	unsigned char ident[EI_NIDENT];
+	Elf64_Ehdr eh64;
+	Elf32_Ehdr eh32;
+	Elf64_Phdr ph64;
+	Elf32_Phdr ph32;
+	unsigned long long int phoff;
+	size_t phnum, phentsize, n;
+
+	read_exact(src, ident, EI_NIDENT, 0);
+	if (memcmp(ident, ELFMAG, SELFMAG) != 0) {
+		fprintf(stderr, "%s: not an ELF file\n", src->name);
+		exit(EXIT_FAILURE);
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (ident[EI_DATA] != ELFDATA2LSB) {
+#else
+	if (ident[EI_DATA] != ELFDATA2MSB) {
+#endif
+		fprintf(stderr, "%s: foreign byte order\n", src->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (ident[EI_CLASS] == ELFCLASS64) {
+		read_exact(src, &eh64, sizeof(eh64), 0);
+		phoff = eh64.e_phoff;
+		phnum = eh64.e_phnum;
+		phentsize = eh64.e_phentsize;
+	} else if (ident[EI_CLASS] == ELFCLASS32) {
+		read_exact(src, &eh32, sizeof(eh32), 0);
+		phoff = eh32.e_phoff;
+		phnum = eh32.e_phnum;
+		phentsize = eh32.e_phentsize;
+	} else {
+		fprintf(stderr, "%s: unknown ELF class\n", src->name);
+		exit(EXIT_FAILURE);
+	}
+
+	*segs = xcalloc(phnum + 1, sizeof(struct segment));
+	n = 0;
+	for (size_t i = 0; i < phnum; i++) {
+		if (ident[EI_CLASS] == ELFCLASS64) {
+			read_exact(src, &ph64, sizeof(ph64),
+			           phoff + i * phentsize);
+			if ((ph64.p_type != PT_LOAD) || (ph64.p_filesz == 0)) {
+				continue;
+			}
+			(*segs)[n].vaddr = ph64.p_vaddr;
+			(*segs)[n].offset = ph64.p_offset;
+			(*segs)[n].size = ph64.p_filesz;
+		} else {
+			read_exact(src, &ph32, sizeof(ph32),
+			           phoff + i * phentsize);
+			if ((ph32.p_type != PT_LOAD) || (ph32.p_filesz == 0)) {
+				continue;
+			}
+			(*segs)[n].vaddr = ph32.p_vaddr;
+			(*segs)[n].offset = ph32.p_offset;
+			(*segs)[n].size = ph32.p_filesz;
+		}
+		n++;
+	}
+
+	qsort(*segs, n, sizeof(struct segment), segment_cmp);
+	return n;
+}
+
+
+// Intersect the two sorted segment maps
+static size_t core_ranges(struct segment *segs1, size_t n1,
+                          struct segment *segs2, size_t n2,
+                          struct core_range **ranges)
+{
+	unsigned long long int start, end1, end2, end;
+	size_t i, j, n;
+
+	*ranges = xcalloc(n1 + n2 + 1, sizeof(struct core_range));
+	i = j = n = 0;
+	while ((i < n1) && (j < n2)) {
+		end1 = segs1[i].vaddr + segs1[i].size;
+		end2 = segs2[j].vaddr + segs2[j].size;
+		start = (segs1[i].vaddr > segs2[j].vaddr) ?
+		        segs1[i].vaddr : segs2[j].vaddr;
+		end = (end1 < end2) ? end1 : end2;
+		if (start < end) {
+			(*ranges)[n].vaddr = start;
+			(*ranges)[n].off1 = segs1[i].offset +
+			                    (start - segs1[i].vaddr);
+			(*ranges)[n].off2 = segs2[j].offset +
+			                    (start - segs2[j].vaddr);
+			(*ranges)[n].size = end - start;
+			n++;
+		}
+		if (end1 <= end2) i++;
+		if (end2 <= end1) j++;
+	}
+	return n;
+}
+
+
+static void diff_core_range(struct core_diff *cd, struct core_range *r,
+                            struct outbuf *out)
+{
+	struct diff_state st;
+
+	diff_init(&st, out, cd->show_all, cd->mode);
+	ob_printf(out, "%s   vaddr 0x%010llx - 0x%010llx\n", ansi_reset,
+	          r->vaddr, r->vaddr + r->size);
+	diff_range(&st, cd->src1, r->off1, cd->src2, r->off2, r->size,
+	           r->vaddr, r->vaddr);
+	diff_finish(&st);
+}
+
+
+static void core_worker(void *arg, int index)
+{
+	struct core_diff *cd = arg;
+	struct core_range *r;
+	int held;
+
+	for (;;) {
+		pthread_mutex_lock(&cd->lock);
+		// Parked by -j auto while more workers don't pay off, with
+		// nothing held back from the others meanwhile
+		while (tune.on && (index > tune.workers.val) &&
+		       (cd->next < cd->nranges)) {
+			pool_flush();
+			pthread_cond_wait(&cd->cond, &cd->lock);
+		}
+		r = (cd->next < cd->nranges) ? &cd->ranges[cd->next++] : NULL;
+		pthread_mutex_unlock(&cd->lock);
+		if (r == NULL) break;
+
+		ob_init_mem(&r->text);
+		r->text.flush = ob_spill_flush;
+		diff_core_range(cd, r, &r->text);
+
+		// Finished output waiting on earlier ranges only stays in
+		// memory while there's room for it
+		pthread_mutex_lock(&cd->lock);
+		held = (r->text.file == NULL) &&
+		       (cd->held + r->text.len <= CORE_HELD);
+		if (held) cd->held += r->text.len;
+		pthread_mutex_unlock(&cd->lock);
+		if (!held) ob_spill(&r->text);
+
+		pthread_mutex_lock(&cd->lock);
+		r->done = 1;
+		if (tune.on) tune_workers(r->size);
+		pthread_cond_broadcast(&cd->cond);
+		pthread_mutex_unlock(&cd->lock);
+	}
+}
+
+
+// Print ranges in address order as they complete
+static void core_printer(void *arg, int index)
+{
+	struct core_diff *cd = arg;
+	struct outbuf *text;
+	char *buf;
+	size_t n;
+
+	buf = xcalloc(1, OUTBUF_SIZE);
+	for (size_t i = 0; i < cd->nranges; i++) {
+		text = &cd->ranges[i].text;
+		pthread_mutex_lock(&cd->lock);
+		while (!cd->ranges[i].done) {
+			pthread_cond_wait(&cd->cond, &cd->lock);
+		}
+		pthread_mutex_unlock(&cd->lock);
+
+		if (text->file == NULL) {
+			ob_write(cd->out, text->buf, text->len);
+			free(text->buf);
+			pthread_mutex_lock(&cd->lock);
+			cd->held -= text->len;
+			pthread_mutex_unlock(&cd->lock);
+			continue;
+		}
+		rewind(text->file);
+		while ((n = fread(buf, 1, OUTBUF_SIZE, text->file)) > 0) {
+			ob_write(cd->out, buf, n);
+		}
+		if (ferror(text->file)) {
+			fprintf(stderr, "read: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		fclose(text->file);
+	}
+	free(buf);
+}
+
+
+static void core_worker_or_printer(void *arg, int index)
+{
+	if (index == 0) {
+		core_printer(arg, index);
+	} else {
+		core_worker(arg, index);
+	}
+}
+
+
+static void diff_cores(struct outbuf *out, struct source *src1,
+                       struct source *src2, int show_all, enum diff_mode mode,
+                       int jobs)
+{
+	struct segment *segs1, *segs2;
+	struct core_diff cd;
+	size_t n1, n2;
+
+	if ((src1->read != file_read) || (src2->read != file_read)) {
+		fprintf(stderr, "core dumps must be plain files\n");
+		exit(EXIT_FAILURE);
+	}
+
+	n1 = load_segments(src1, &segs1);
+	n2 = load_segments(src2, &segs2);
+
+	memset(&cd, 0, sizeof(cd));
+	cd.src1 = src1;
+	cd.src2 = src2;
+	cd.show_all = show_all;
+	cd.mode = mode;
+	cd.out = out;
+	cd.nranges = core_ranges(segs1, n1, segs2, n2, &cd.ranges);
+	pthread_mutex_init(&cd.lock, NULL);
+	pthread_cond_init(&cd.cond, NULL);
+
+	if (mode == MODE_ROWS) print_header(out);
+	if (jobs <= 1) {
+		for (size_t i = 0; i < cd.nranges; i++) {
+			diff_core_range(&cd, &cd.ranges[i], out);
+		}
+	} else {
+		// One extra thread streams finished ranges out in order
+		run_workers(jobs + 1, core_worker_or_printer, &cd);
+	}
+
+	pthread_mutex_destroy(&cd.lock);
+	pthread_cond_destroy(&cd.cond);
+	free(cd.ranges);
+	free(segs1);
+	free(segs2);
+}
+
+
+// Packet captures
+//
+// With --pcap, both inputs are read as pcap or pcapng captures, one packet
+// at a time, and packets are paired by their index. Only the captured bytes
+// are compared, so timestamps and other per-packet metadata never show up
+// as differences. Each differing packet is printed under its own heading,
+// with rows labelled by offset within the packet. Packets left over in the
+// longer capture are counted rather than compared.
+#define PCAP_MAGIC 0xa1b2c3d4U
+#define PCAP_MAGIC_NS 0xa1b23c4dU
+#define PCAPNG_SHB 0x0a0d0d0aU
+#define PCAPNG_BOM 0x1a2b3c4dU
+#define PCAPNG_PB 2                // obsolete packet block
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+#define PCAP_MAX_RECORD (64 * 1024 * 1024)
+
+struct pcap {
+	struct source *src;
+	unsigned long long int pos;
+	int ng;                    // pcapng rather than pcap
+	int swap;                  // written in the other byte order
+	uint8_t *buf;              // current record
+	size_t cap;
+	const uint8_t *pkt;        // current packet within buf
+	size_t len;
+};
+
+
+static uint32_t pcap_u32(const struct pcap *p, const uint8_t *b)
+{
+	uint32_t v;
+
+	memcpy(&v, b, 4);
+	return p->swap ? __builtin_bswap32(v) : v;
+}
+
+
+// Read len bytes of the record at the current position into the buffer
+static void pcap_fill(struct pcap *p, size_t len, unsigned long long int off)
+{
+	if (len > PCAP_MAX_RECORD) {
+		fprintf(stderr, "%s: bad record length at 0x%llx\n",
+		        p->src->name, p->pos);
+		exit(EXIT_FAILURE);
+	}
+	if (len > p->cap) {
+		free(p->buf);
+		p->cap = (len > 65536) ? len : 65536;
+		p->buf = xcalloc(1, p->cap);
+	}
+	read_exact(p->src, p->buf, len, off);
+}
+
+
+static void pcap_open(struct pcap *p, struct source *src)
+{
+	uint8_t hdr[24];
+	uint32_t magic;
+
+	memset(p, 0, sizeof(*p));
+	p->src = src;
+	read_exact(src, hdr, 4, 0);
+	memcpy(&magic, hdr, 4);
+	if (magic == PCAPNG_SHB) {
+		// The byte order comes with each section header block
+		p->ng = 1;
+		return;
+	}
+	if ((magic == PCAP_MAGIC) || (magic == PCAP_MAGIC_NS)) {
+		p->swap = 0;
+	} else if ((__builtin_bswap32(magic) == PCAP_MAGIC) ||
+	           (__builtin_bswap32(magic) == PCAP_MAGIC_NS)) {
+		p->swap = 1;
+	} else {
+		fprintf(stderr, "%s: not a pcap or pcapng capture\n",
+		        src->name);
+		exit(EXIT_FAILURE);
+	}
+	read_exact(src, hdr + 4, 20, 4);
+	p->pos = 24;
+}
+
+
+// Move on to the next packet, returning 0 at the end of the capture
+static int pcap_next(struct pcap *p)
+{
+	uint8_t hdr[16];
+	uint32_t type, bom, total;
+	size_t n, body;
+
+	if (!p->ng) {
+		if ((n = p->src->read(p->src, hdr, 16, p->pos)) == 0) return 0;
+		if (n < 16) read_exact(p->src, hdr, 16, p->pos);
+		p->len = pcap_u32(p, hdr + 8);
+		pcap_fill(p, p->len, p->pos + 16);
+		p->pkt = p->buf;
+		p->pos += 16 + p->len;
+		return 1;
+	}
+
+	for (;;) {
+		if ((n = p->src->read(p->src, hdr, 12, p->pos)) == 0) return 0;
+		if (n < 12) read_exact(p->src, hdr, 12, p->pos);
+		memcpy(&type, hdr, 4);
+		if (type == PCAPNG_SHB) {
+			memcpy(&bom, hdr + 8, 4);
+			if (bom == PCAPNG_BOM) {
+				p->swap = 0;
+			} else if (__builtin_bswap32(bom) == PCAPNG_BOM) {
+				p->swap = 1;
+			} else {
+				fprintf(stderr, "%s: bad section header at "
+				        "0x%llx\n", p->src->name, p->pos);
+				exit(EXIT_FAILURE);
+			}
+		}
+		type = pcap_u32(p, hdr);
+		total = pcap_u32(p, hdr + 4);
+		if ((total < 12) || (total % 4 != 0)) {
+			fprintf(stderr, "%s: bad block length at 0x%llx\n",
+			        p->src->name, p->pos);
+			exit(EXIT_FAILURE);
+		}
+		body = total - 12;
+		if ((type != PCAPNG_EPB) && (type != PCAPNG_SPB) &&
+		    (type != PCAPNG_PB)) {
+			p->pos += total;
+			continue;
+		}
+
+		pcap_fill(p, body, p->pos + 8);
+		if (type == PCAPNG_SPB) {
+			if (body < 4) goto bad;
+			p->len = pcap_u32(p, p->buf);
+			if (p->len > body - 4) p->len = body - 4;
+			p->pkt = p->buf + 4;
+		} else {
+			if (body < 20) goto bad;
+			p->len = pcap_u32(p, p->buf + 12);
+			if (p->len > body - 20) goto bad;
+			p->pkt = p->buf + 20;
+		}
+		p->pos += total;
+		return 1;
+	}
+
+bad:
+	fprintf(stderr, "%s: bad packet block at 0x%llx\n", p->src->name,
+	        p->pos);
+	exit(EXIT_FAILURE);
+}
+
+
+// Serve the current packet as a source, for diff_range()
+static size_t pcap_read(struct source *src, uint8_t *buf, size_t len,
+                        unsigned long long int off)
+{
+	struct pcap *p = src->priv;
+
+	if (off >= p->len) return 0;
+	if (len > p->len - off) len = p->len - off;
+	memcpy(buf, p->pkt + off, len);
+	return len;
+}
+
+
+static void diff_pcaps(struct outbuf *out, struct source *src1,
+                       struct source *src2, int show_all, enum diff_mode mode)
+{
+	unsigned long long int n, differ, first, extra;
+	struct source pkt1, pkt2;
+	struct diff_state st;
+	struct pcap p1, p2;
+	int more1, more2, side;
+
+	pcap_open(&p1, src1);
+	pcap_open(&p2, src2);
+	memset(&pkt1, 0, sizeof(pkt1));
+	memset(&pkt2, 0, sizeof(pkt2));
+	pkt1.name = src1->name;
+	pkt1.read = pcap_read;
+	pkt1.priv = &p1;
+	pkt2.name = src2->name;
+	pkt2.read = pcap_read;
+	pkt2.priv = &p2;
+
+	if (mode == MODE_ROWS) print_header(out);
+	differ = first = 0;
+	more1 = more2 = 0;
+	for (n = 0; sigint_recv == 0; n++) {
+		more1 = pcap_next(&p1);
+		more2 = pcap_next(&p2);
+		if (!more1 || !more2) break;
+		if ((p1.len == p2.len) &&
+		    (first_diff(p1.pkt, p2.pkt, p1.len) == p1.len)) {
+			continue;
+		}
+		if (differ++ == 0) first = n + 1;
+		if (mode == MODE_SUMMARY) {
+			// Still count the byte transitions, if asked for
+			if (trans.on) {
+				diff_init(&st, out, 0, mode);
+				diff_range(&st, &pkt1, 0, &pkt2, 0, 0, 0, 0);
+			}
+			continue;
+		}
+
+		ob_printf(out, "%s   packet %llu, %zu and %zu bytes\n",
+		          ansi_reset, n + 1, p1.len, p2.len);
+		diff_init(&st, out, show_all, mode);
+		diff_range(&st, &pkt1, 0, &pkt2, 0, 0, 0, 0);
+		diff_finish(&st);
+	}
+
+	// Count whatever is left of the longer capture
+	extra = 0;
+	side = more1 ? 1 : 2;
+	if (sigint_recv == 0) {
+		for (; more1 && !more2; more1 = pcap_next(&p1)) extra++;
+		for (; more2 && !more1; more2 = pcap_next(&p2)) extra++;
+	}
+	if ((extra > 0) && (mode != MODE_SUMMARY)) {
+		ob_printf(out, "%s   packets %llu to %llu only in file%d\n",
+		          ansi_reset, n + 1, n + extra, side);
+	}
+
+	if (mode == MODE_SUMMARY) {
+		ob_printf(out, "%llu packets compared, ", n);
+		if (differ == 0) {
+			ob_printf(out, "no differences");
+		} else {
+			ob_printf(out, "%llu differ, first is packet %llu",
+			          differ, first);
+		}
+		if (extra > 0) {
+			ob_printf(out, ", %llu more in file%d", extra, side);
+		}
+		ob_printf(out, "\n");
+	}
+
+	free(p1.buf);
+	free(p2.buf);
+}
+
+
+// Version store
+//
+// "hexdiff store add dir name file" cuts file into chunks where a gear hash
+// of the last 64 bytes hits a pattern, so an insertion only changes the
+// chunks around it and the rest are cut the same way as before. Each chunk
+// is named by its SHA-256 and kept once in dir/pack, with dir/index listing
+// where each one is. The version itself is saved as dir/versions/name, the
+// list of its chunks in order.
+//
+// "hexdiff store diff dir name1 name2" walks the two lists together.
+// Chunks with the same name at the same offset in both versions are equal
+// and are skipped without being read, unless -a wants their rows; only the
+// rest is read back from the pack and compared as usual.
+//
+// The index and version files are arrays of struct store_ref in host byte
+// order. Adds take a lock on the index, so several can run at once.
+#define STORE_MIN (16 * 1024)       // chunk size limits
+#define STORE_MAX (256 * 1024)
+#define STORE_MASK_S 0xffff800000000000ULL  // before 64 KiB, 17 bits
+#define STORE_MASK_L 0xfffe000000000000ULL  // after, 15 bits
+#define STORE_AVG (64 * 1024)
+
+struct store_ref {
+	uint8_t id[32];
+	uint64_t off;                   // in the pack
+	uint32_t len;
+	uint32_t unused;
+};
+
+// The index, as a hash table on id
+struct store_index {
+	struct store_ref *refs;
+	size_t mask;
+	size_t n;
+};
+
+struct store_version {
+	struct store_ref *refs;
+	unsigned long long int *start;  // offset of each chunk in the version
+	size_t n;
+	struct source *pack;
+};
+
+static uint64_t store_gear[256];
+
+struct sha256_ctx {
+	uint32_t h[8];
+	uint8_t buf[64];                // partial block
+	unsigned long long int len;
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static uint32_t ror32(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+
+static void sha256_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[64], v[8], t1, t2;
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+		       (p[4 * i + 2] << 8) | p[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+		        (w[i - 15] >> 3)) +
+		       (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+		        (w[i - 2] >> 10));
+	}
+	memcpy(v, h, sizeof(v));
+	for (int i = 0; i < 64; i++) {
+		t1 = v[7] + (ror32(v[4], 6) ^ ror32(v[4], 11) ^
+		             ror32(v[4], 25)) +
+		     ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+		t2 = (ror32(v[0], 2) ^ ror32(v[0], 13) ^ ror32(v[0], 22)) +
+		     ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof(v[0]));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; i++) h[i] += v[i];
+}
+
+
+static void sha256_init(struct sha256_ctx *c)
+{
+	static const uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(c->h, h, sizeof(h));
+	c->len = 0;
+}
+
+
+static void sha256_update(struct sha256_ctx *c, const uint8_t *p, size_t len)
+{
+	size_t fill = c->len % 64, n;
+
+	c->len += len;
+	if (fill > 0) {
+		n = (len < 64 - fill) ? len : 64 - fill;
+		memcpy(c->buf + fill, p, n);
+		if (fill + n < 64) return;
+		sha256_block(c->h, c->buf);
+		p += n;
+		len -= n;
+	}
+	for (; len >= 64; p += 64, len -= 64) sha256_block(c->h, p);
+	memcpy(c->buf, p, len);
+}
+
+
+static void sha256_final(struct sha256_ctx *c, uint8_t *id)
+{
+	uint8_t last[128];
+	size_t n;
+
+	// Pad with 0x80, zeros and the length in bits
+	n = c->len % 64;
+	memset(last, 0, sizeof(last));
+	memcpy(last, c->buf, n);
+	last[n] = 0x80;
+	n = (n < 56) ? 64 : 128;
+	for (int j = 0; j < 8; j++) {
+		last[n - 1 - j] = (uint8_t)((c->len * 8) >> (8 * j));
+	}
+	sha256_block(c->h, last);
+	if (n == 128) sha256_block(c->h, last + 64);
+
+	for (int j = 0; j < 8; j++) {
+		id[4 * j] = c->h[j] >> 24;
+		id[4 * j + 1] = c->h[j] >> 16;
+		id[4 * j + 2] = c->h[j] >> 8;
+		id[4 * j + 3] = c->h[j];
+	}
+}
+
+
+static void sha256(const uint8_t *p, size_t len, uint8_t *id)
+{
+	struct sha256_ctx c;
+
+	sha256_init(&c);
+	sha256_update(&c, p, len);
+	sha256_final(&c, id);
+}
+
+
+// Length of the chunk at the start of p. The gear hash is shifted left a
+// bit per byte, so its top bits only depend on the last 64 bytes. A mask
+// with more bits before STORE_AVG and fewer after keeps most chunks close to
+// the average.
+static size_t store_cut(const uint8_t *p, size_t len)
+{
+	uint64_t h = 0;
+	size_t i;
+
+	if (len <= STORE_MIN) return len;
+	if (len > STORE_MAX) len = STORE_MAX;
+	for (i = STORE_MIN - 64; i < STORE_MIN; i++) {
+		h = (h << 1) + store_gear[p[i]];
+	}
+	for (; (i < len) && (i < STORE_AVG); i++) {
+		h = (h << 1) + store_gear[p[i]];
+		if ((h & STORE_MASK_S) == 0) return i + 1;
+	}
+	for (; i < len; i++) {
+		h = (h << 1) + store_gear[p[i]];
+		if ((h & STORE_MASK_L) == 0) return i + 1;
+	}
+	return len;
+}
+
+
+// The gear table only has to be the same from one run to the next
+static void store_gear_init(void)
+{
+	uint64_t x = 0x2545f4914f6cdd1dULL, z;
+
+	for (int i = 0; i < 256; i++) {
+		x += 0x9e3779b97f4a7c15ULL;
+		z = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		store_gear[i] = z ^ (z >> 31);
+	}
+}
+
+
+static int store_fd(const char *dir, const char *name, int flags)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fd = open(path, flags, 0644)) < 0) {
+		fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+
+static void store_write(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	for (size_t done = 0; done < len; done += n) {
+		n = write(fd, (const uint8_t *)buf + done, len - done);
+		if ((n < 0) && (errno == EINTR)) {
+			n = 0;
+			continue;
+		}
+		if (n < 0) {
+			fprintf(stderr, "write: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+static void store_sync(int fd)
+{
+	if (fsync(fd) != 0) {
+		fprintf(stderr, "fsync: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+// Read a whole index or version file
+static struct store_ref *store_load(int fd, size_t *n)
+{
+	struct source file;
+	struct stat sb;
+	struct store_ref *refs;
+
+	if (fstat(fd, &sb) != 0) {
+		fprintf(stderr, "fstat: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	*n = sb.st_size / sizeof(*refs);
+	refs = xcalloc(*n + 1, sizeof(*refs));
+	memset(&file, 0, sizeof(file));
+	file.name = "store";
+	file.fd = fd;
+	file.read = file_read;
+	read_exact(&file, refs, *n * sizeof(*refs), 0);
+	return refs;
+}
+
+
+static void store_push(struct store_ref **list, size_t *n, size_t *cap,
+                       const struct store_ref *ref)
+{
+	if (*n == *cap) {
+		*cap = (*cap > 0) ? 2 * *cap : 1024;
+		*list = realloc(*list, *cap * sizeof(**list));
+		if (*list == NULL) {
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	(*list)[(*n)++] = *ref;
+}
+
+
+// Slot holding id, or the empty slot where it would go
+static struct store_ref *store_find(const struct store_index *idx,
+                                    const uint8_t *id)
+{
+	uint64_t h;
+	size_t i;
+
+	memcpy(&h, id, 8);
+	for (i = h & idx->mask; idx->refs[i].len != 0;
+	     i = (i + 1) & idx->mask) {
+		if (memcmp(idx->refs[i].id, id, 32) == 0) break;
+	}
+	return &idx->refs[i];
+}
+
+
+static void store_insert(struct store_index *idx, const struct store_ref *ref)
+{
+	struct store_ref *old = idx->refs;
+	size_t size = idx->mask + 1;
+
+	if (2 * (idx->n + 1) > size) {
+		idx->mask = 2 * size - 1;
+		idx->refs = xcalloc(2 * size, sizeof(*idx->refs));
+		for (size_t i = 0; i < size; i++) {
+			if (old[i].len == 0) continue;
+			*store_find(idx, old[i].id) = old[i];
+		}
+		free(old);
+	}
+	*store_find(idx, ref->id) = *ref;
+	idx->n++;
+}
+
+
+// Names end up as file names, so keep them to one plain component
+static void store_check_name(const char *name)
+{
+	if ((name[0] == '\0') || (name[0] == '.') ||
+	    (strchr(name, '/') != NULL)) {
+		fprintf(stderr, "%s: not a valid version name\n", name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+static void store_add(struct outbuf *out, const char *dir, const char *name,
+                      const char *fname)
+{
+	struct store_ref ref, *found, *list, *fresh, *refs;
+	unsigned long long int size, stored;
+	size_t have, cut, n, nlist, cap, nfresh, cap_fresh;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct store_index idx;
+	struct source src;
+	int pack, index, fd, eof;
+	uint8_t *buf;
+	off_t end;
+
+	store_check_name(name);
+	snprintf(path, sizeof(path), "%s/versions", dir);
+	if (((mkdir(dir, 0755) != 0) && (errno != EEXIST)) ||
+	    ((mkdir(path, 0755) != 0) && (errno != EEXIST))) {
+		fprintf(stderr, "mkdir: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	// Adds hold the index locked from start to finish
+	index = store_fd(dir, "index", O_RDWR | O_CREAT | O_APPEND);
+	if (flock(index, LOCK_EX) != 0) {
+		fprintf(stderr, "flock: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	pack = store_fd(dir, "pack", O_WRONLY | O_CREAT);
+	if ((end = lseek(pack, 0, SEEK_END)) < 0) {
+		fprintf(stderr, "lseek: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	idx.mask = 1023;
+	idx.n = 0;
+	idx.refs = xcalloc(idx.mask + 1, sizeof(*idx.refs));
+	refs = store_load(index, &n);
+	for (size_t i = 0; i < n; i++) store_insert(&idx, &refs[i]);
+	free(refs);
+	store_gear_init();
+
+	source_open(&src, fname);
+	buf = xcalloc(1, 2 * STORE_MAX);
+	list = fresh = NULL;
+	nlist = cap = nfresh = cap_fresh = 0;
+	size = stored = 0;
+	have = 0;
+	eof = 0;
+	while ((have > 0) || !eof) {
+		// Keep a whole chunk's worth buffered while there's more
+		if (!eof && (have < STORE_MAX)) {
+			if (prof.on) prof_switch(STAGE_READ);
+			n = src.read(&src, buf + have, STORE_MAX, size + have);
+			if (prof.on) prof_switch(STAGE_OTHER);
+			eof = n < STORE_MAX;
+			have += n;
+			continue;
+		}
+
+		cut = store_cut(buf, have);
+		memset(&ref, 0, sizeof(ref));
+		sha256(buf, cut, ref.id);
+		ref.len = cut;
+		found = store_find(&idx, ref.id);
+		if (found->len == 0) {
+			ref.off = end;
+			store_write(pack, buf, cut);
+			end += cut;
+			stored += cut;
+			store_insert(&idx, &ref);
+			store_push(&fresh, &nfresh, &cap_fresh, &ref);
+		} else {
+			ref.off = found->off;
+		}
+		store_push(&list, &nlist, &cap, &ref);
+		size += cut;
+		have -= cut;
+		memmove(buf, buf + cut, have);
+	}
+	if (prof.on) prof_bytes(size);
+
+	// Chunks go to disk before the index entries naming them, and those
+	// before the version that uses them
+	store_sync(pack);
+	store_write(index, fresh, nfresh * sizeof(*fresh));
+	store_sync(index);
+	snprintf(tmp, sizeof(tmp), "%s/versions/.%s", dir, name);
+	snprintf(path, sizeof(path), "%s/versions/%s", dir, name);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "open: %s: %s\n", tmp, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	store_write(fd, list, nlist * sizeof(*list));
+	store_sync(fd);
+	if ((close(fd) != 0) || (rename(tmp, path) != 0)) {
+		fprintf(stderr, "rename: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	ob_printf(out, "%s: %llu bytes in %zu chunks, %zu new (%llu bytes "
+	          "stored)\n", name, size, nlist, nfresh, stored);
+
+	src.close(&src);
+	close(pack);
+	close(index);
+	free(buf);
+	free(list);
+	free(fresh);
+	free(idx.refs);
+}
+
+
+// A stored version, read back from the pack as a source
+static size_t store_read(struct source *src, uint8_t *buf, size_t len,
+                         unsigned long long int off)
+{
+	struct store_version *v = src->priv;
+	size_t lo, hi, mid, done, n;
+	unsigned long long int in;
+
+	// Last chunk starting at or before off
+	lo = 0;
+	hi = v->n;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (v->start[mid] <= off) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	for (done = 0; (done < len) && (lo < v->n); lo++) {
+		if (off + done >= v->start[lo + 1]) continue;
+		in = off + done - v->start[lo];
+		n = v->refs[lo].len - in;
+		if (n > len - done) n = len - done;
+		read_exact(v->pack, buf + done, n, v->refs[lo].off + in);
+		done += n;
+	}
+	return done;
+}
+
+
+static void store_version(struct source *src, struct store_version *v,
+                          const char *dir, const char *name,
+                          struct source *pack)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	store_check_name(name);
+	snprintf(path, sizeof(path), "versions/%s", name);
+	fd = store_fd(dir, path, O_RDONLY);
+	v->refs = store_load(fd, &v->n);
+	close(fd);
+	v->start = xcalloc(v->n + 1, sizeof(*v->start));
+	for (size_t i = 0; i < v->n; i++) {
+		v->start[i + 1] = v->start[i] + v->refs[i].len;
+	}
+	v->pack = pack;
+
+	memset(src, 0, sizeof(*src));
+	src->name = name;
+	src->read = store_read;
+	src->priv = v;
+}
+
+
+// Rows [a, b) are known to match. Bring the compare up to a, then account
+// for the rows without reading them, past the two that show as a gap.
+static void store_same(struct diff_state *st, struct source *src1,
+                       struct source *src2, unsigned long long int *pos,
+                       unsigned long long int a, unsigned long long int b)
+{
+	unsigned long long int n;
+
+	if (a > *pos) {
+		diff_range(st, src1, *pos, src2, *pos, a - *pos, *pos, *pos);
+	}
+	n = (b - a < 16) ? b - a : 16;
+	if (st->show_all) n = b - a;
+	diff_range(st, src1, a, src2, a, n, a, a);
+	st->eq_run += (b - a - n) / 8;
+	st->compared += b - a - n;
+	if (prof.on) prof_bytes(b - a - n);
+	*pos = b;
+}
+
+
+static void store_diff(struct diff_state *st, const char *dir,
+                       const char *name1, const char *name2)
+{
+	struct store_version v1, v2;
+	struct source src1, src2, pack;
+	unsigned long long int pos, a, b;
+	char path[PATH_MAX];
+	size_t i, j;
+
+	snprintf(path, sizeof(path), "%s/pack", dir);
+	file_open(&pack, path);
+	pack.name = path;
+	store_version(&src1, &v1, dir, name1, &pack);
+	store_version(&src2, &v2, dir, name2, &pack);
+
+	// Walk both chunk lists for runs of the same chunks at the same
+	// offsets, keeping to whole rows
+	pos = 0;
+	i = j = 0;
+	while ((i < v1.n) && (j < v2.n) && (sigint_recv == 0)) {
+		if ((v1.start[i] != v2.start[j]) ||
+		    (v1.refs[i].len != v2.refs[j].len) ||
+		    (memcmp(v1.refs[i].id, v2.refs[j].id, 32) != 0)) {
+			a = v1.start[i + 1];
+			b = v2.start[j + 1];
+			if (a <= b) i++;
+			if (b <= a) j++;
+			continue;
+		}
+		a = (v1.start[i] + 7) & ~7ULL;
+		while ((i < v1.n) && (j < v2.n) &&
+		       (v1.start[i] == v2.start[j]) &&
+		       (v1.refs[i].len == v2.refs[j].len) &&
+		       (memcmp(v1.refs[i].id, v2.refs[j].id, 32) == 0)) {
+			i++;
+			j++;
+		}
+		b = v1.start[i] & ~7ULL;
+		if (a < b) store_same(st, &src1, &src2, &pos, a, b);
+	}
+
+	// Everything else, up to the end of the longer version
+	if (sigint_recv == 0) {
+		diff_range(st, &src1, pos, &src2, pos, 0, pos, pos);
+	}
+
+	pack.close(&pack);
+	free(v1.refs);
+	free(v1.start);
+	free(v2.refs);
+	free(v2.start);
+}
+
+
+// Diff daemon
+//
+// With -D, hexdiff listens on a Unix socket and answers compare requests
+// against files it keeps open, so repeated queries against the same large
+// images skip the open and stay in the page cache. Files are read with
+// pread() rather than mapped: a file truncated under a mapping would raise
+// SIGBUS and take down the whole service, where a short read only ends the
+// compare early. A file whose size, mtime or inode has changed is opened
+// afresh on the next request. Each cached file also carries a lazily built
+// index of SHA-256 block digests; blocks at the same alignment whose
+// digests match are taken as equal without comparing them.
+// Requests are served by a pool of -j workers. With -C, hexdiff sends its
+// request to a daemon and prints the results as usual.
+//
+// The protocol is a fixed request header followed by the two paths, then a
+// stream of fixed-size records ending with HD_END.
+#define HD_MAGIC 0x31445848U       // "HXD1"
+#define HD_SHOW_ALL 1
+#define HD_CACHE 16                // files kept open
+#define HD_BLOCK CHUNK_SIZE        // bytes per block digest
+
+enum hd_type { HD_SAME, HD_DIFF, HD_GAP, HD_RANGE, HD_SUMMARY, HD_ERROR,
+               HD_END };
+
+struct hd_request {
+	uint32_t magic;
+	uint8_t mode;
+	uint8_t flags;
+	uint16_t path1_len;
+	uint16_t path2_len;
+	uint16_t pad;
+	uint64_t skip1;
+	uint64_t skip2;
+	uint64_t len;
+};
+
+struct hd_record {
+	uint8_t type;
+	uint8_t pad[7];
+	uint64_t a;                // skip1, or off1 of a range
+	uint64_t b;                // skip2, or off2 of a range
+	uint64_t c;                // cnt, length, or message length
+	uint8_t buf1[8];
+	uint8_t buf2[8];
+};
+
+struct hd_file {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	int fd;
+	uint8_t (*hashes)[32];
+	uint8_t *hashed;
+	int refs;
+	unsigned long long int used;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct hd_file *files[HD_CACHE];
+	unsigned long long int clock;
+	int listen_fd;
+} hd = {PTHREAD_MUTEX_INITIALIZER, {NULL}, 0, -1};
+
+
+static size_t mem_read(struct source *src, uint8_t *buf, size_t len,
+                       unsigned long long int off)
+{
+	struct hd_file *f = src->priv;
+	size_t done;
+	ssize_t n;
+
+	if (off >= (unsigned long long int)f->size) return 0;
+	if (len > f->size - off) len = f->size - off;
+	for (done = 0; done < len; done += n) {
+		n = pread(f->fd, buf + done, len - done, off + done);
+		if ((n < 0) && (errno == EINTR)) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0) break;
+	}
+	return done;
+}
+
+
+static void hd_file_free(struct hd_file *f)
+{
+	close(f->fd);
+	free(f->hashes);
+	free(f->hashed);
+	free(f->path);
+	free(f);
+}
+
+
+// Find or open a file in the cache. Returns NULL with errno set on error.
+static struct hd_file *hd_get(const char *path)
+{
+	struct hd_file *f, **slot;
+	struct stat sb;
+	int fd;
+
+	if (stat(path, &sb) != 0) return NULL;
+
+	pthread_mutex_lock(&hd.lock);
+	for (int i = 0; i < HD_CACHE; i++) {
+		f = hd.files[i];
+		if ((f == NULL) || (strcmp(f->path, path) != 0)) continue;
+		if ((f->dev == sb.st_dev) && (f->ino == sb.st_ino) &&
+		    (f->size == sb.st_size) &&
+		    (f->mtime.tv_sec == sb.st_mtim.tv_sec) &&
+		    (f->mtime.tv_nsec == sb.st_mtim.tv_nsec)) {
+			f->refs++;
+			f->used = ++hd.clock;
+			pthread_mutex_unlock(&hd.lock);
+			return f;
+		}
+		// Changed since it was cached; drop it once nobody uses it
+		if (f->refs == 0) {
+			hd_file_free(f);
+			hd.files[i] = NULL;
+		}
+	}
+
+	// Use an empty slot, or else evict the least recently used file
+	slot = NULL;
+	for (int i = 0; i < HD_CACHE; i++) {
+		if (hd.files[i] == NULL) {
+			slot = &hd.files[i];
+			break;
+		}
+		if ((hd.files[i]->refs == 0) &&
+		    ((slot == NULL) || ((*slot)->used > hd.files[i]->used))) {
+			slot = &hd.files[i];
+		}
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		pthread_mutex_unlock(&hd.lock);
+		return NULL;
+	}
+
+	f = xcalloc(1, sizeof(*f));
+	f->fd = fd;
+	f->path = strdup(path);
+	f->dev = sb.st_dev;
+	f->ino = sb.st_ino;
+	f->size = sb.st_size;
+	f->mtime = sb.st_mtim;
+	f->hashes = xcalloc(sb.st_size / HD_BLOCK + 1, sizeof(*f->hashes));
+	f->hashed = xcalloc(sb.st_size / HD_BLOCK + 1, 1);
+	f->refs = 1;
+	f->used = ++hd.clock;
+
+	// With every slot busy, the file is used once and not cached
+	if (slot != NULL) {
+		if (*slot != NULL) hd_file_free(*slot);
+		*slot = f;
+	}
+	pthread_mutex_unlock(&hd.lock);
+
+	return f;
+}
+
+
+static void hd_put(struct hd_file *f)
+{
+	int cached = 0;
+
+	pthread_mutex_lock(&hd.lock);
+	for (int i = 0; i < HD_CACHE; i++) {
+		if (hd.files[i] == f) cached = 1;
+	}
+	if ((--f->refs == 0) && !cached) hd_file_free(f);
+	pthread_mutex_unlock(&hd.lock);
+}
+
+
+// Digest of block i, computing it on first use, or NULL if the block can
+// no longer be read in full. Workers racing to fill in the same block store
+// the same value.
+static uint8_t *hd_hash(struct hd_file *f, unsigned long long int i)
+{
+	struct source src;
+	uint8_t *buf;
+	size_t n;
+
+	if (!__atomic_load_n(&f->hashed[i], __ATOMIC_ACQUIRE)) {
+		memset(&src, 0, sizeof(src));
+		src.priv = f;
+		buf = chunk_get();
+		n = mem_read(&src, buf, HD_BLOCK, i * HD_BLOCK);
+		if (n == HD_BLOCK) sha256(buf, HD_BLOCK, f->hashes[i]);
+		chunk_put(buf);
+		if (n != HD_BLOCK) return NULL;
+		__atomic_store_n(&f->hashed[i], 1, __ATOMIC_RELEASE);
+	}
+	return f->hashes[i];
+}
+
+
+static void hd_write(struct outbuf *out, enum hd_type type, uint64_t a, uint64_t b,
+                     uint64_t c, const uint8_t *buf1, const uint8_t *buf2)
+{
+	struct hd_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.a = a;
+	rec.b = b;
+	rec.c = c;
+	if (buf1 != NULL) memcpy(rec.buf1, buf1, 8);
+	if (buf2 != NULL) memcpy(rec.buf2, buf2, 8);
+	ob_write(out, &rec, sizeof(rec));
+}
+
+
+static void hd_same(struct diff_state *st, const uint8_t *buf1,
+                    const uint8_t *buf2, unsigned long long int skip1,
+                    unsigned long long int skip2, unsigned long long int cnt)
+{
+	hd_write(st->out, HD_SAME, skip1, skip2, cnt, buf1, buf2);
+}
+
+
+static void hd_diff(struct diff_state *st, const uint8_t *buf1,
+                    const uint8_t *buf2, unsigned long long int skip1,
+                    unsigned long long int skip2, unsigned long long int cnt)
+{
+	hd_write(st->out, HD_DIFF, skip1, skip2, cnt, buf1, buf2);
+}
+
+
+static void hd_gap(struct diff_state *st)
+{
+	hd_write(st->out, HD_GAP, 0, 0, 0, NULL, NULL);
+}
+
+
+static void hd_range(struct diff_state *st, unsigned long long int off1,
+                     unsigned long long int off2, unsigned long long int len)
+{
+	hd_write(st->out, HD_RANGE, off1, off2, len, NULL, NULL);
+}
+
+
+// The summary totals travel in the row buffers
+static void hd_summary(struct diff_state *st)
+{
+	hd_write(st->out, HD_SUMMARY, st->compared, st->diff_bytes,
+	         st->diff_rows, (uint8_t *)&st->first1,
+	         (uint8_t *)&st->first2);
+}
+
+
+static const struct diff_sink hd_sink = {
+	hd_same, hd_diff, hd_gap, hd_range, hd_summary, NULL
+};
+
+
+static void hd_error(struct outbuf *out, const char *msg,
+                     const char *path)
+{
+	char text[PATH_MAX + 64];
+	int len;
+
+	len = snprintf(text, sizeof(text), "%s: %s", path, msg);
+	if (len < 0) len = 0;
+	if ((size_t)len >= sizeof(text)) len = sizeof(text) - 1;
+	hd_write(out, HD_ERROR, 0, 0, len, NULL, NULL);
+	ob_write(out, text, len);
+}
+
+
+// Compare two cached files, taking blocks with matching digests as equal
+static void hd_compare(struct diff_state *st,
+                       struct hd_file *f1, unsigned long long int off1,
+                       struct hd_file *f2, unsigned long long int off2,
+                       unsigned long long int len)
+{
+	struct source src1, src2;
+	unsigned long long int common, cnt, n;
+
+	memset(&src1, 0, sizeof(src1));
+	memset(&src2, 0, sizeof(src2));
+	src1.name = f1->path;
+	src1.read = mem_read;
+	src1.priv = f1;
+	src2.name = f2->path;
+	src2.read = mem_read;
+	src2.priv = f2;
+
+	common = 0;
+	if ((off1 < (unsigned long long int)f1->size) &&
+	    (off2 < (unsigned long long int)f2->size)) {
+		common = (f1->size - off1 < f2->size - off2) ?
+		         f1->size - off1 : f2->size - off2;
+		common &= ~7ULL;
+	}
+	if ((len != 0) && (((len + 7) & ~7ULL) < common)) {
+		common = (len + 7) & ~7ULL;
+	}
+
+	// Blocks can only be taken by hash where both sides reach a block
+	// boundary together, a whole number of rows from off1. Otherwise the
+	// whole range goes to diff_range() in one piece.
+	cnt = 0;
+	if (((off1 - off2) % HD_BLOCK == 0) && (off1 % 8 == 0)) {
+		for (; (cnt < common) && (sigint_recv == 0); cnt += n) {
+			n = HD_BLOCK - (off1 + cnt) % HD_BLOCK;
+			if (n > common - cnt) n = common - cnt;
+
+			if ((n == HD_BLOCK) && ((st->mode != MODE_ROWS) ||
+			     ((st->eq_run >= 2) && !st->show_all))) {
+				uint8_t *h1 = hd_hash(f1, (off1 + cnt) /
+				                      HD_BLOCK);
+				uint8_t *h2 = hd_hash(f2, (off2 + cnt) /
+				                      HD_BLOCK);
+
+				if ((h1 != NULL) && (h2 != NULL) &&
+				    (memcmp(h1, h2, 32) == 0)) {
+					st->eq_run += n / 8;
+					st->compared += n;
+					continue;
+				}
+			}
+			diff_range(st, &src1, off1 + cnt, &src2, off2 + cnt, n,
+			           off1 + cnt, off2 + cnt);
+		}
+	}
+
+	if ((sigint_recv == 0) && ((len == 0) || (len > cnt))) {
+		diff_range(st, &src1, off1 + cnt, &src2, off2 + cnt,
+		           (len == 0) ? 0 : len - cnt, off1 + cnt, off2 + cnt);
+	}
+}
+
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	for (size_t done = 0; done < len; done += n) {
+		n = read(fd, (uint8_t *)buf + done, len - done);
+		if ((n < 0) && (errno == EINTR)) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0) return 0;
+	}
+	return 1;
+}
+
+
+// Serve requests on one connection until the client hangs up
+static void hd_serve(int conn)
+{
+	struct hd_request req;
+	struct hd_file *f1, *f2;
+	struct diff_state st;
+	char *path1, *path2;
+	struct outbuf ob;
+	FILE *out;
+
+	if ((out = fdopen(dup(conn), "w")) == NULL) return;
+	ob_init_file(&ob, out);
+
+	// A path no file can have ends the connection, like a bad header
+	while (read_full(conn, &req, sizeof(req)) && (req.magic == HD_MAGIC) &&
+	       (req.mode <= MODE_SUMMARY) && (req.path1_len < PATH_MAX) &&
+	       (req.path2_len < PATH_MAX)) {
+		path1 = xcalloc(req.path1_len + 1, 1);
+		path2 = xcalloc(req.path2_len + 1, 1);
+		if (!read_full(conn, path1, req.path1_len) ||
+		    !read_full(conn, path2, req.path2_len)) {
+			free(path1);
+			free(path2);
+			break;
+		}
+
+		f1 = hd_get(path1);
+		f2 = (f1 != NULL) ? hd_get(path2) : NULL;
+		if ((f1 == NULL) || (f2 == NULL)) {
+			hd_error(&ob, strerror(errno),
+			         (f1 == NULL) ? path1 : path2);
+		} else {
+			diff_init(&st, &ob, req.flags & HD_SHOW_ALL, req.mode);
+			st.sink = &hd_sink;
+			hd_compare(&st, f1, req.skip1, f2, req.skip2, req.len);
+			diff_finish(&st);
+		}
+		if (f1 != NULL) hd_put(f1);
+		if (f2 != NULL) hd_put(f2);
+		hd_write(&ob, HD_END, 0, 0, 0, NULL, NULL);
+		ob_flush(&ob);
+
+		free(path1);
+		free(path2);
+	}
+
+	free(ob.buf);
+	fclose(out);
+}
+
+
+static void hd_worker(void *arg, int index)
+{
+	int conn;
+
+	while (sigint_recv == 0) {
+		// Idle until the next request, so don't sit on chunks
+		pool_flush();
+		if ((conn = accept(hd.listen_fd, NULL, NULL)) < 0) {
+			if ((errno == EINTR) || sigint_recv) continue;
+			fprintf(stderr, "accept: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		hd_serve(conn);
+		close(conn);
+	}
+}
+
+
+static void socket_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr->sun_path, path);
+}
+
+
+static void run_daemon(const char *path, int jobs)
+{
+	struct sockaddr_un addr;
+	struct worker *workers;
+	sigset_t set, old;
+
+	socket_addr(&addr, path);
+	if ((hd.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "socket: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	unlink(path);
+	if ((bind(hd.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+	    (listen(hd.listen_fd, 64) != 0)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	// Clients that hang up early shouldn't take the daemon with them
+	signal(SIGPIPE, SIG_IGN);
+
+	// SIGINT is left to this thread, which shuts the socket down so every
+	// worker waiting in accept() wakes up to see it
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	workers = start_workers(jobs, hd_worker, NULL);
+	sigdelset(&old, SIGINT);
+	while (sigint_recv == 0) sigsuspend(&old);
+	shutdown(hd.listen_fd, SHUT_RDWR);
+	join_workers(workers, jobs);
+
+	close(hd.listen_fd);
+	unlink(path);
+}
+
+
+// Send a request to the daemon and print the results
+static void run_client(struct outbuf *out, const char *path,
+                       const char *fname1, const char *fname2,
+                       unsigned long long int skip1,
+                       unsigned long long int skip2,
+                       unsigned long long int max_len, int show_all,
+                       enum diff_mode mode)
+{
+	struct sockaddr_un addr;
+	struct hd_request req;
+	struct hd_record rec;
+	struct diff_state st;
+	char path1[PATH_MAX], path2[PATH_MAX], msg[PATH_MAX + 64];
+	int fd;
+	FILE *conn;
+
+	// The daemon has its own working directory
+	if ((realpath(fname1, path1) == NULL) ||
+	    (realpath(fname2, path2) == NULL)) {
+		fprintf(stderr, "%s: %s\n", (realpath(fname1, path1) == NULL) ?
+		        fname1 : fname2, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	socket_addr(&addr, path);
+	if (((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+	    (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+	    ((conn = fdopen(fd, "r+")) == NULL)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.magic = HD_MAGIC;
+	req.mode = mode;
+	req.flags = show_all ? HD_SHOW_ALL : 0;
+	req.path1_len = strlen(path1);
+	req.path2_len = strlen(path2);
+	req.skip1 = skip1;
+	req.skip2 = skip2;
+	req.len = max_len;
+	fwrite(&req, sizeof(req), 1, conn);
+	fwrite(path1, 1, req.path1_len, conn);
+	fwrite(path2, 1, req.path2_len, conn);
+	fflush(conn);
+
+	diff_init(&st, out, show_all, mode);
+	if ((mode == MODE_ROWS) && (out_sink != &html_sink)) {
+		print_header(out);
+	}
+	while (fread(&rec, sizeof(rec), 1, conn) == 1) {
+		switch (rec.type) {
+		case HD_SAME:
+			st.sink->same(&st, rec.buf1, rec.buf2, rec.a, rec.b,
+			              rec.c);
+			break;
+		case HD_DIFF:
+			st.sink->diff(&st, rec.buf1, rec.buf2, rec.a, rec.b,
+			              rec.c);
+			break;
+		case HD_GAP:
+			st.sink->gap(&st);
+			break;
+		case HD_RANGE:
+			st.sink->range(&st, rec.a, rec.b, rec.c);
+			break;
+		case HD_SUMMARY:
+			st.compared = rec.a;
+			st.diff_bytes = rec.b;
+			st.diff_rows = rec.c;
+			memcpy(&st.first1, rec.buf1, 8);
+			memcpy(&st.first2, rec.buf2, 8);
+			st.sink->summary(&st);
+			break;
+		case HD_ERROR:
+			if (rec.c >= sizeof(msg)) rec.c = sizeof(msg) - 1;
+			msg[fread(msg, 1, rec.c, conn)] = '\0';
+			fprintf(stderr, "%s\n", msg);
+			exit(EXIT_FAILURE);
+		case HD_END:
+			fclose(conn);
+			return;
+		}
+	}
+
+	fprintf(stderr, "%s: connection lost\n", path);
+	exit(EXIT_FAILURE);
+}
+
+
+// String sets
+//
+// With --strings, each input is scanned on its own thread for runs of at
+// least strings_min bytes that printicize() would leave alone. The
+// printable test is done on eight bytes at a time, so binary data between
+// the strings goes by quickly. Every distinct string is kept once in a
+// hash set, with the offset where it first occurs, so memory grows with the
+// number of distinct strings and not with the size of the inputs. The
+// strings found in only one of the inputs are then listed: removed ones at
+// their file1 offset and added ones at their file2 offset.
+//
+// A string longer than STR_SHOW is kept as its first STR_SHOW bytes and the
+// SHA-256 of the whole of it, which is what it's matched by, and only that
+// much is printed. Runs that go on past a chunk are hashed as they go, so
+// all-printable input doesn't pile up in memory.
+#define STR_ARENA (1024 * 1024)
+#define STR_SHOW 4096
+#define STR_KEY(len) (((len) > STR_SHOW) ? STR_SHOW + 32 : (len))
+
+struct str_entry {
+	uint64_t hash;
+	unsigned long long int off;
+	const uint8_t *text;       // STR_KEY(len) bytes, NULL for an empty slot
+	size_t len;
+};
+
+struct str_set {
+	struct source *src;
+	unsigned long long int off;
+	unsigned long long int len;
+	struct str_entry *slots;
+	size_t mask;
+	size_t n;
+	uint8_t *arena;            // newest block, linked to the one before
+	uint8_t *arena_pos;
+	size_t arena_left;
+	uint8_t *run;              // key of the run carried over from earlier
+	size_t run_len;            // chunks, and its whole length
+	struct sha256_ctx run_sha;
+	unsigned long long int run_off;
+};
+
+struct str_scan {
+	struct str_set set[2];
+	int jobs;
+};
+
+static size_t strings_min;
+
+
+// High bit set in each byte of w that is not printable ASCII. With the high
+// bits set first, the subtractions can't borrow across bytes: a byte is
+// below 0x20 if its high bit goes, and is 0x7f if it survives taking 0x7f.
+static uint64_t str_unprintable(uint64_t w)
+{
+	const uint64_t high = 0x8080808080808080ULL;
+	uint64_t low, del;
+
+	low = (w | high) - 0x2020202020202020ULL;
+	del = (w | high) - 0x7f7f7f7f7f7f7f7fULL;
+	return (w | ~low | del) & high;
+}
+
+
+static void block_hash(const uint8_t *p, size_t len, uint64_t h[2])
+{
+	uint64_t a = 0x9e3779b97f4a7c15ULL ^ len, b = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t w;
+
+	for (size_t i = 0; i < len; i += 8) {
+		w = 0;
+		memcpy(&w, p + i, (len - i < 8) ? len - i : 8);
+		a = (a ^ w) * 0xff51afd7ed558ccdULL;
+		a ^= a >> 32;
+		b = (b + w) * 0xc4ceb9fe1a85ec53ULL;
+		b ^= b >> 29;
+	}
+	h[0] = a;
+	h[1] = b;
+}
+
+
+static uint64_t str_hash(const uint8_t *text, size_t len)
+{
+	uint64_t h[2];
+
+	block_hash(text, len, h);
+	return h[0] ^ h[1];
+}
+
+
+// Slot holding the string with this key, or the empty slot where it would
+// go
+static struct str_entry *str_find(const struct str_set *set, uint64_t hash,
+                                  const uint8_t *text, size_t len)
+{
+	struct str_entry *e;
+
+	for (size_t i = hash & set->mask; ; i = (i + 1) & set->mask) {
+		e = &set->slots[i];
+		if ((e->text == NULL) ||
+		    ((e->hash == hash) && (e->len == len) &&
+		     (memcmp(e->text, text, STR_KEY(len)) == 0))) {
+			return e;
+		}
+	}
+}
+
+
+static void str_grow(struct str_set *set)
+{
+	struct str_entry *old = set->slots;
+	size_t size = set->mask + 1, i;
+
+	set->mask = 2 * size - 1;
+	set->slots = xcalloc(2 * size, sizeof(*set->slots));
+	for (size_t j = 0; j < size; j++) {
+		if (old[j].text == NULL) continue;
+		for (i = old[j].hash & set->mask; set->slots[i].text != NULL;
+		     i = (i + 1) & set->mask);
+		set->slots[i] = old[j];
+	}
+	free(old);
+}
+
+
+// Add a string of len bytes, given by its key, unless it's already in the
+// set
+static void str_add(struct str_set *set, const uint8_t *text, size_t len,
+                    unsigned long long int off)
+{
+	size_t key = STR_KEY(len), size;
+	uint64_t hash = str_hash(text, key);
+	struct str_entry *e = str_find(set, hash, text, len);
+	uint8_t *block;
+
+	if (e->text != NULL) return;
+
+	if (key > set->arena_left) {
+		size = sizeof(void *) + STR_ARENA;
+		block = xcalloc(1, size);
+		memcpy(block, &set->arena, sizeof(void *));
+		set->arena = block;
+		set->arena_pos = block + sizeof(void *);
+		set->arena_left = size - sizeof(void *);
+	}
+	memcpy(set->arena_pos, text, key);
+	e->hash = hash;
+	e->off = off;
+	e->text = set->arena_pos;
+	e->len = len;
+	set->arena_pos += key;
+	set->arena_left -= key;
+	if (++set->n * 2 > set->mask) str_grow(set);
+}
+
+
+// Append to the run carried over from earlier chunks
+static void str_carry(struct str_set *set, const uint8_t *p, size_t len)
+{
+	size_t n;
+
+	if (set->run_len == 0) sha256_init(&set->run_sha);
+	sha256_update(&set->run_sha, p, len);
+	if (set->run_len < STR_SHOW) {
+		n = (len < STR_SHOW - set->run_len) ? len :
+		    STR_SHOW - set->run_len;
+		memcpy(set->run + set->run_len, p, n);
+	}
+	set->run_len += len;
+}
+
+
+// A run ends at buf + end, having started at buf + start or, if some of it
+// was carried over, in an earlier chunk
+static void str_end(struct str_set *set, const uint8_t *buf, size_t start,
+                    size_t end, unsigned long long int base)
+{
+	if (set->run_len > 0) {
+		if (set->run_len + (end - start) >= strings_min) {
+			str_carry(set, buf + start, end - start);
+			if (set->run_len > STR_SHOW) {
+				sha256_final(&set->run_sha,
+				             set->run + STR_SHOW);
+			}
+			str_add(set, set->run, set->run_len, set->run_off);
+		}
+		set->run_len = 0;
+	} else if (end - start > STR_SHOW) {
+		memcpy(set->run, buf + start, STR_SHOW);
+		sha256(buf + start, end - start, set->run + STR_SHOW);
+		str_add(set, set->run, end - start, base + start);
+	} else if (end - start >= strings_min) {
+		str_add(set, buf + start, end - start, base + start);
+	}
+}
+
+
+// Find the runs in a chunk read from offset base
+static void str_chunk(struct str_set *set, const uint8_t *buf, size_t len,
+                      unsigned long long int base)
+{
+	const uint64_t all = 0x8080808080808080ULL;
+	uint64_t w, m;
+	size_t i, start, p;
+
+	start = 0;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, buf + i, 8);
+		if ((m = str_unprintable(w)) == 0) continue;
+		if (m == all) {
+			if ((start < i) || (set->run_len > 0)) {
+				str_end(set, buf, start, i, base);
+			}
+			start = i + 8;
+			continue;
+		}
+		for (; m != 0; m &= m - 1) {
+			p = i + __builtin_ctzll(m) / 8;
+			if ((start < p) || (set->run_len > 0)) {
+				str_end(set, buf, start, p, base);
+			}
+			start = p + 1;
+		}
+	}
+	for (; i < len; i++) {
+		if ((buf[i] >= 0x20) && (buf[i] <= 0x7e)) continue;
+		if ((start < i) || (set->run_len > 0)) {
+			str_end(set, buf, start, i, base);
+		}
+		start = i + 1;
+	}
+
+	if (start < len) {
+		if (set->run_len == 0) set->run_off = base + start;
+		str_carry(set, buf + start, len - start);
+	}
+}
+
+
+static void str_scan(void *arg, int index)
+{
+	struct str_scan *ss = arg;
+	struct str_set *set;
+	unsigned long long int cnt;
+	size_t want, n;
+	uint8_t *buf;
+
+	buf = chunk_get();
+	for (int s = index; s < 2; s += ss->jobs) {
+		set = &ss->set[s];
+		for (cnt = 0; sigint_recv == 0; cnt += n) {
+			want = CHUNK_SIZE;
+			if ((set->len != 0) && (set->len - cnt < want)) {
+				want = set->len - cnt;
+			}
+			if (want == 0) break;
+			if (prof.on) prof_switch(STAGE_READ);
+			n = set->src->read(set->src, buf, want, set->off + cnt);
+			if (prof.on) {
+				prof_switch(STAGE_COMPARE);
+				prof_bytes(n);
+			}
+			str_chunk(set, buf, n, set->off + cnt);
+			if (n < want) break;
+		}
+		str_end(set, buf, 0, 0, set->off + cnt);
+		if (prof.on) prof_switch(STAGE_OTHER);
+	}
+	chunk_put(buf);
+}
+
+
+static int str_cmp(const void *a, const void *b)
+{
+	const struct str_entry *ea = a, *eb = b;
+
+	return (ea->off > eb->off) - (ea->off < eb->off);
+}
+
+
+// Strings in a but not in b, in offset order
+static struct str_entry *str_only(const struct str_set *a,
+                                  const struct str_set *b, size_t *n)
+{
+	struct str_entry *list, *e;
+
+	list = xcalloc(a->n + 1, sizeof(*list));
+	*n = 0;
+	for (size_t i = 0; i <= a->mask; i++) {
+		e = &a->slots[i];
+		if ((e->text != NULL) &&
+		    (str_find(b, e->hash, e->text, e->len)->text == NULL)) {
+			list[(*n)++] = *e;
+		}
+	}
+	qsort(list, *n, sizeof(*list), str_cmp);
+	return list;
+}
+
+
+static void str_free(struct str_set *set)
+{
+	uint8_t *block, *prev;
+
+	for (block = set->arena; block != NULL; block = prev) {
+		memcpy(&prev, block, sizeof(void *));
+		free(block);
+	}
+	free(set->slots);
+	free(set->run);
+}
+
+
+// The text of a string, with how long it was if there's more to it
+static void str_print(struct outbuf *out, const struct str_entry *e)
+{
+	if (e->len > STR_SHOW) {
+		ob_write(out, e->text, STR_SHOW);
+		ob_printf(out, "... (%zu bytes)", e->len);
+	} else {
+		ob_write(out, e->text, e->len);
+	}
+	ob_printf(out, "%s\n", ansi_reset);
+}
+
+
+// Print the strings removed from src1 and added in src2, or just how many
+// with summary set
+static void run_strings(struct outbuf *out, struct source *src1,
+                        unsigned long long int off1, struct source *src2,
+                        unsigned long long int off2,
+                        unsigned long long int len, int jobs, int summary)
+{
+	struct str_entry *removed, *added;
+	struct str_scan ss;
+	size_t n1, n2;
+
+	memset(&ss, 0, sizeof(ss));
+	ss.set[0].src = src1;
+	ss.set[0].off = off1;
+	ss.set[1].src = src2;
+	ss.set[1].off = off2;
+	for (int i = 0; i < 2; i++) {
+		ss.set[i].len = len;
+		ss.set[i].mask = 1023;
+		ss.set[i].slots = xcalloc(1024, sizeof(struct str_entry));
+		ss.set[i].run = xcalloc(1, STR_SHOW + 32);
+	}
+	ss.jobs = (jobs > 1) ? 2 : 1;
+	run_workers(ss.jobs, str_scan, &ss);
+
+	removed = str_only(&ss.set[0], &ss.set[1], &n1);
+	added = str_only(&ss.set[1], &ss.set[0], &n2);
+	for (size_t i = 0; (i < n1) && !summary; i++) {
+		ob_printf(out, "%s- 0x%010llx  ", ansi_red, removed[i].off);
+		str_print(out, &removed[i]);
+	}
+	for (size_t i = 0; (i < n2) && !summary; i++) {
+		ob_printf(out, "%s+ 0x%010llx  ", ansi_green, added[i].off);
+		str_print(out, &added[i]);
+	}
+	ob_printf(out, "%s%zu of %zu strings removed, %zu of %zu added\n",
+	          ansi_reset, n1, ss.set[0].n, n2, ss.set[1].n);
+
+	free(removed);
+	free(added);
+	str_free(&ss.set[0]);
+	str_free(&ss.set[1]);
+}
+
+
+// Git drivers
+//
+// --git speaks git's external diff convention, for use as
+//   git config diff.hexdiff.command "hexdiff --git"
+// with "*.bin diff=hexdiff" in .gitattributes. Git passes
+//   path old-file old-hex old-mode new-file new-hex new-mode
+// plus the new path and a rename message for renames. Since git log -p runs
+// this for every commit touching the file, the default is a one-line
+// summary; --git=rows prints the usual rows instead.
+//
+// --textconv writes one file as a plain hex dump, one row per line, for
+//   git config diff.hexdiff.textconv "hexdiff --textconv"
+// so git's own line diff can be used on it. The dump reads back with hex:.
+static int git_null_hex(const char *hex)
+{
+	return (strcmp(hex, ".") == 0) || (strspn(hex, "0") == strlen(hex));
+}
+
+
+static void run_git(struct outbuf *out, char **args, int nargs,
+                    int show_all, enum diff_mode mode)
+{
+	const char *path, *new_path;
+	struct source src1, src2;
+	struct diff_state st;
+
+	path = args[0];
+	new_path = (nargs == 9) ? args[7] : path;
+	ob_printf(out, "%shexdiff a/%s b/%s\n", ansi_reset, path, new_path);
+	if ((nargs == 9) && (strcmp(path, new_path) != 0)) {
+		ob_printf(out, "rename from %s\nrename to %s\n", path,
+		          new_path);
+	}
+
+	// Added and deleted files have no other side to compare against
+	if (strcmp(args[3], ".") == 0) {
+		source_open(&src2, args[4]);
+		ob_printf(out, "new file mode %s, %llu bytes\n", args[6],
+		          source_size(&src2));
+		src2.close(&src2);
+		return;
+	}
+	if (strcmp(args[6], ".") == 0) {
+		source_open(&src1, args[1]);
+		ob_printf(out, "deleted file mode %s, %llu bytes\n", args[3],
+		          source_size(&src1));
+		src1.close(&src1);
+		return;
+	}
+
+	if (strcmp(args[3], args[6]) != 0) {
+		ob_printf(out, "old mode %s\nnew mode %s\n", args[3], args[6]);
+	}
+	// Same blob, so only the mode or the name changed
+	if (!git_null_hex(args[2]) && (strcmp(args[2], args[5]) == 0)) {
+		return;
+	}
+
+	source_open(&src1, args[1]);
+	source_open(&src2, args[4]);
+	if (mode == MODE_ROWS) print_header(out);
+	diff_init(&st, out, show_all, mode);
+	diff_range(&st, &src1, 0, &src2, 0, 0, 0, 0);
+	diff_finish(&st);
+	src1.close(&src1);
+	src2.close(&src2);
+}
+
+
+static void run_textconv(struct outbuf *out, const char *fname)
+{
+	struct source src;
+	unsigned long long int off;
+	uint8_t *buf;
+	char *p;
+	size_t n, i, j;
+
+	source_open(&src, fname);
+	buf = chunk_get();
+	off = 0;
+	while ((n = src.read(&src, buf, CHUNK_SIZE, off)) > 0) {
+		for (i = 0; i < n; i += 8) {
+			if (out->cap - out->len < 64) out->flush(out, 64);
+			if ((off + i) >> 40) {
+				ob_printf(out, "0x%010llx  ", off + i);
+				p = out->buf + out->len;
+			} else {
+				p = put_addr(out->buf + out->len, off + i);
+			}
+			for (j = 0; (j < 8) && (i + j < n); j++) {
+				p[2 * j] = hex_digits[buf[i + j] >> 4];
+				p[2 * j + 1] = hex_digits[buf[i + j] & 0xf];
+				p[17 + j] = ((buf[i + j] < 0x20) ||
+				             (buf[i + j] > 0x7e)) ? '.' :
+				            buf[i + j];
+			}
+			// Pad out a short last row so the ASCII still lines up
+			memset(p + 2 * j, ' ', 16 - 2 * j);
+			p[16] = ' ';
+			p[17 + j] = '\n';
+			out->len = p + 18 + j - out->buf;
+		}
+		off += n;
+		if (n < CHUNK_SIZE) break;
+	}
+	chunk_put(buf);
+	src.close(&src);
+}
+
+
+static void open_output(struct outbuf *out, const char *path, int jobs)
+{
+	size_t len;
+	FILE *file;
+
+	len = (path != NULL) ? strlen(path) : 0;
+	if (path == NULL) {
+		ob_init_file(out, stdout);
+	} else if ((len > 3) && (strcmp(path + len - 3, ".gz") == 0)) {
+		zw_open(out, path, ZFMT_GZIP, jobs);
+	} else if ((len > 4) && (strcmp(path + len - 4, ".zst") == 0)) {
+		zw_open(out, path, ZFMT_ZSTD, jobs);
+	} else {
+		if ((file = fopen(path, "w")) == NULL) {
+			fprintf(stderr, "fopen: %s: %s\n", path,
+			        strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		ob_init_file(out, file);
+	}
+}
+
+
+static void close_output(struct outbuf *out)
+{
+	if (out->flush == zw_flush) {
+		zw_close(out);
+		return;
+	}
+	ob_flush(out);
+	if ((out->file != stdout) && (fclose(out->file) != 0)) {
+		fprintf(stderr, "close: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(out->buf);
+}
+
+
+int main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{"alloc", no_argument, NULL, 'A'},
+		{"checksum", required_argument, NULL, 'B'},
+		{"color", required_argument, NULL, 'Y'},
+		{"compact", no_argument, NULL, 'K'},
+		{"cpus", required_argument, NULL, 'U'},
+		{"engine", required_argument, NULL, 'E'},
+		{"follow", optional_argument, NULL, 'F'},
+		{"git", optional_argument, NULL, 'G'},
+		{"html", no_argument, NULL, 'H'},
+		{"key-fd", required_argument, NULL, 'k'},
+		{"load-addr", required_argument, NULL, 'L'},
+		{"numa", required_argument, NULL, 'M'},
+		{"output", required_argument, NULL, 'o'},
+		{"pcap", no_argument, NULL, 'N'},
+		{"perf-counters", no_argument, NULL, 'P'},
+		{"profile", no_argument, NULL, 'p'},
+		{"sector-size", required_argument, NULL, 'Z'},
+		{"strings", optional_argument, NULL, 'W'},
+		{"symbols", required_argument, NULL, 'S'},
+		{"textconv", no_argument, NULL, 'X'},
+		{"transitions", optional_argument, NULL, 'T'},
+		{"transitions-csv", required_argument, NULL, 'V'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt, show_all, core, jobs, resident, html_out, compact, git;
+	int textconv, mode_set, follow, alloc, pcap;
+	unsigned long long int follow_timeout;
+	unsigned long long int max_len, skip1, skip2;
+	char *fname1, *fname2, *daemon_path, *client_path, *out_path;
+	char *sym_path, *cpu_list;
+	int numa, color;
+	enum diff_mode mode;
+	struct source src1, src2;
+	struct sigaction sigint_action;
+	struct diff_state st;
+	struct outbuf out;
+
+
+	// Parse the input arguments
+	show_all = 0;
+	core = 0;
+	resident = 0;
+	jobs = 1;
+	max_len = 0;
+	mode = MODE_ROWS;
+	html_out = 0;
+	compact = 0;
+	git = 0;
+	textconv = 0;
+	mode_set = 0;
+	follow = 0;
+	follow_timeout = 0;
+	alloc = 0;
+	pcap = 0;
+	daemon_path = NULL;
+	client_path = NULL;
+	out_path = NULL;
+	sym_path = NULL;
+	cpu_list = NULL;
+	numa = 0;
+	color = 1;
+	while ((opt = getopt_long(argc, argv, "aC:cD:hj:lm:n:o:rs", long_opts,
+	                          NULL)) != -1) {
+		switch (opt) {
+		case 'A':
+			alloc = 1;
+			break;
+		case 'a':
+			show_all = 1;
+			break;
+		case 'B':
+			if (!ck_parse(optarg)) show_help(argv, 0);
+			break;
+		case 'C':
+			client_path = optarg;
+			break;
+		case 'c':
+			core = 1;
+			break;
+		case 'D':
+			daemon_path = optarg;
+			break;
+		case 'E':
+			for (engine = 0; engine <= ENGINE_AUTO; engine++) {
+				if (strcmp(optarg, engine_names[engine]) == 0) {
+					break;
+				}
+			}
+			if (engine > ENGINE_AUTO) show_help(argv, 0);
+			break;
+		case 'F':
+			follow = 1;
+			if (optarg != NULL) {
+				follow_timeout = strtod(optarg, NULL) * 1000;
+			}
+			break;
+		case 'G':
+			git = 1;
+			if ((optarg != NULL) && (strcmp(optarg, "rows") == 0)) {
+				mode = MODE_ROWS;
+				mode_set = 1;
+			} else if (optarg != NULL) {
+				show_help(argv, 0);
+			}
+			break;
+		case 'h':
+			show_help(argv, 1);
+		case 'H':
+			html_out = 1;
+			break;
+		case 'j':
+			tune.on = strcmp(optarg, "auto") == 0;
+			jobs = tune.on ? 1 : atoi(optarg);
+			if (jobs < 1) show_help(argv, 0);
+			break;
+		case 'K':
+			compact = 1;
+			break;
+		case 'k':
+			xts_cfg.key_fd = atoi(optarg);
+			break;
+		case 'L':
+			symbols.base = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			mode = MODE_RANGES;
+			mode_set = 1;
+			break;
+		case 'M':
+			if (strcmp(optarg, "auto") == 0) {
+				numa = 1;
+			} else if (strcmp(optarg, "off") == 0) {
+				numa = 0;
+			} else {
+				show_help(argv, 0);
+			}
+			break;
+		case 'm':
+			pool.cap = parse_size(optarg);
+			break;
+		case 'n':
+			max_len = strtoull(optarg, NULL, 0);
+			break;
+		case 'N':
+			pcap = 1;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'P':
+			prof.counters = 1;
+			prof.on = 1;
+			break;
+		case 'p':
+			prof.on = 1;
+			break;
+		case 'r':
+			resident = 1;
+			break;
+		case 'S':
+			sym_path = optarg;
+			break;
+		case 's':
+			mode = MODE_SUMMARY;
+			mode_set = 1;
+			break;
+		case 'W':
+			strings_min = 4;
+			if (optarg != NULL) strings_min = atoi(optarg);
+			if (strings_min < 1) show_help(argv, 0);
+			break;
+		case 'T':
+			trans.on = 1;
+			if (optarg != NULL) {
+				trans.top = strtoull(optarg, NULL, 0);
+			}
+			break;
+		case 'U':
+			cpu_list = optarg;
+			break;
+		case 'V':
+			trans.on = 1;
+			trans.csv = optarg;
+			break;
+		case 'X':
+			textconv = 1;
+			break;
+		case 'Y':
+			if (strcmp(optarg, "always") == 0) {
+				color = 1;
+			} else if (strcmp(optarg, "never") == 0) {
+				color = 0;
+			} else if (strcmp(optarg, "auto") == 0) {
+				color = -1;
+			} else {
+				show_help(argv, 0);
+			}
+			break;
+		case 'Z':
+			xts_cfg.sector = atoi(optarg);
+			if ((xts_cfg.sector < 512) || (xts_cfg.sector > 4096) ||
+			    (xts_cfg.sector & (xts_cfg.sector - 1))) {
+				show_help(argv, 0);
+			}
+			break;
+		default:
+			show_help(argv, 0);
+		}
+	}
+
+	if (tune.on) jobs = tune_jobs();
+	xts_cfg.jobs = jobs;
+	if ((cpu_list != NULL) || numa) place_init(cpu_list, numa);
+	if (color < 0) color = (out_path == NULL) && isatty(STDOUT_FILENO);
+	if (!color) {
+		ansi_green = ansi_red = ansi_reset = empty_str;
+		ansi_reset_len = 0;
+	}
+
+	// Set up signal handler for SIGINT, before the daemon's loops start
+	// checking for it
+	memset(&sigint_action, 0, sizeof(sigint_action));
+	sigint_action.sa_handler = sigint_handler;
+	sigaction(SIGINT, &sigint_action, NULL);
+
+	if (daemon_path != NULL) {
+		if ((optind < argc) || cksum.on) show_help(argv, 0);
+		run_daemon(daemon_path, jobs);
+		return 0;
+	}
+
+	if (textconv) {
+		if (argc - optind != 1) show_help(argv, 0);
+		open_output(&out, out_path, jobs);
+		run_textconv(&out, argv[optind]);
+		close_output(&out);
+		return 0;
+	}
+
+	if (git) {
+		if ((argc - optind != 7) && (argc - optind != 9)) {
+			show_help(argv, 0);
+		}
+		if (!mode_set) mode = MODE_SUMMARY;
+		if (sym_path != NULL) load_symbols(sym_path);
+		open_output(&out, out_path, jobs);
+		if (compact) out_sink = &compact_sink;
+		run_git(&out, argv + optind, argc - optind, show_all, mode);
+		close_output(&out);
+		return 0;
+	}
+
+	if ((argc - optind == 5) && (strcmp(argv[optind], "store") == 0)) {
+		if (core || resident || follow || alloc || pcap || html_out ||
+		    (strings_min > 0) || (client_path != NULL)) {
+			fprintf(stderr, "store can't be used with -c, -C, -r, "
+			        "--alloc, --follow, --html,\n--pcap or "
+			        "--strings\n");
+			exit(EXIT_FAILURE);
+		}
+		if (sym_path != NULL) load_symbols(sym_path);
+		open_output(&out, out_path, jobs);
+		if (compact) out_sink = &compact_sink;
+		if (prof.on) {
+			prof.start = prof_now();
+			prof_thread();
+		}
+		if (strcmp(argv[optind + 1], "add") == 0) {
+			store_add(&out, argv[optind + 2], argv[optind + 3],
+			          argv[optind + 4]);
+		} else if (strcmp(argv[optind + 1], "diff") == 0) {
+			if (mode == MODE_ROWS) print_header(&out);
+			diff_init(&st, &out, show_all, mode);
+			store_diff(&st, argv[optind + 2], argv[optind + 3],
+			           argv[optind + 4]);
+			diff_finish(&st);
+			if (trans.on) print_transitions(&out);
+		} else {
+			show_help(argv, 0);
+		}
+		close_output(&out);
+		if (prof.on) print_profile();
+		return 0;
+	}
+
+	// Get the filenames and any skip values
+	if ((argc - optind) < 2) show_help(argv, 0);
+	fname1 = argv[optind++];
+	fname2 = argv[optind++];
+	skip1 = (optind < argc) ? strtoull(argv[optind++], NULL, 0) : 0;
+	skip2 = (optind < argc) ? strtoull(argv[optind++], NULL, 0) : 0;
+	if (optind < argc) show_help(argv, 0); //Leftover arguments
+
+	if (html_out && (core || (mode != MODE_ROWS))) {
+		fprintf(stderr, "--html only applies to row output\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (trans.on && (html_out || (client_path != NULL))) {
+		fprintf(stderr, "--transitions needs a local, text run\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (follow && (core || resident || (client_path != NULL))) {
+		fprintf(stderr, "--follow can't be used with -c, -r or -C\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (alloc && (core || html_out || (client_path != NULL))) {
+		fprintf(stderr, "--alloc can't be used with -c, --html or "
+		        "-C\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((strings_min > 0) &&
+	    (core || resident || html_out || follow || alloc || trans.on ||
+	     (client_path != NULL) || (mode == MODE_RANGES))) {
+		fprintf(stderr, "--strings can't be used with -c, -C, -l, -r, "
+		        "--alloc, --follow,\n--html or --transitions\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pcap && (core || resident || html_out || follow || alloc ||
+	             (strings_min > 0) || (client_path != NULL))) {
+		fprintf(stderr, "--pcap can't be used with -c, -C, -r, "
+		        "--alloc, --follow, --html\nor --strings\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (html_out && compact) {
+		fprintf(stderr, "--compact and --html can't be combined\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cksum.on && (html_out || pcap || (strings_min > 0) ||
+	                 (client_path != NULL))) {
+		fprintf(stderr, "--checksum can't be used with -C, --html, "
+		        "--pcap or --strings\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((engine != ENGINE_BULK) && (client_path != NULL)) {
+		fprintf(stderr, "--engine needs a local run\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (sym_path != NULL) load_symbols(sym_path);
+
+	open_output(&out, out_path, jobs);
+	if (compact) out_sink = &compact_sink;
+	if (html_out) {
+		out_sink = &html_sink;
+		html_begin(&out);
+	}
+
+	if (client_path != NULL) {
+		run_client(&out, client_path, fname1, fname2, skip1, skip2,
+		           max_len, show_all, mode);
+		if (html_out) html_end(&out);
+		close_output(&out);
+		return 0;
+	}
+
+	if (prof.on) {
+		prof.start = prof_now();
+		prof_thread();
+	}
+
+	// Open the inputs. Seeking to the skip offsets happens on first read.
+	source_open(&src1, fname1);
+	source_open(&src2, fname2);
+	if (tune.on) tune_inputs(&src1, &src2, jobs);
+	if (cksum.on && (!source_seekable(&src1) || !source_seekable(&src2) ||
+	                 follow)) {
+		fprintf(stderr, "--checksum needs inputs that can be read "
+		        "again\n");
+		exit(EXIT_FAILURE);
+	}
+	if (follow) {
+		follow_open(&src2, follow_timeout);
+		follow_out = &out;
+	}
+
+	if (core) {
+		diff_cores(&out, &src1, &src2, show_all, mode, jobs);
+	} else if (pcap) {
+		diff_pcaps(&out, &src1, &src2, show_all, mode);
+	} else if (strings_min > 0) {
+		run_strings(&out, &src1, skip1, &src2, skip2, max_len, jobs,
+		            mode == MODE_SUMMARY);
+	} else {
+		// Begin printing output
+		if ((mode == MODE_ROWS) && !html_out) print_header(&out);
+		diff_init(&st, &out, show_all, mode);
+		if (resident) {
+			diff_resident(&st, &src1, skip1, &src2, skip2,
+			              max_len);
+		} else {
+			diff_range(&st, &src1, skip1, &src2, skip2, max_len,
+			           skip1, skip2);
+		}
+		diff_finish(&st);
+		if (alloc) {
+			print_alloc(&out, &src1, skip1, &src2, skip2,
+			            max_len);
+		}
+	}
+	if (trans.on) print_transitions(&out);
+	if (html_out) html_end(&out);
+	close_output(&out);
+	if (prof.on) print_profile();
+	if (prof.on && tune.on) print_tune();
+
+	src1.close(&src1);
+	src2.close(&src2);
+
+	return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * ptybench - measure hexdiff's output cost on a pseudo-terminal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Redirecting hexdiff to /dev/null hides what a terminal costs: the tty
+// layer, and a reader that can only take the rows so fast. Here hexdiff
+// runs with a pseudo-terminal as its stdout, and the master side is read
+// at a set rate, as a terminal emulator would. Each workload is run with
+// color on and off, and the time to the first byte, the time until
+// hexdiff has exited and its output is drained, and the rows per second
+// are reported, as the median of the runs.
+//
+// The workloads are two files that match throughout, compared with -a so
+// every row goes through print_same(), and two files that differ in every
+// byte, so every row goes through print_diff().
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <pty.h>
+
+#define MAX_RUNS 99
+#define MAX_ARGS 64
+
+// Inputs of the same and diff workloads
+static char inputs[2][2][PATH_MAX];
+
+struct result {
+	unsigned long long int rows;
+	unsigned long long int bytes;
+	double first;              // seconds to the first byte
+	double total;              // seconds until the output is drained
+};
+
+
+__attribute__((noreturn))
+static void show_help(char **argv, int verbose)
+{
+	fprintf(stderr,
+	        "Usage: %s [-b bytes] [-n runs] [-r rate] [-s size] "
+	        "[-x hexdiff] [-- options]\n", argv[0]);
+	if (verbose) {
+		printf(" -b bytes  read size on the terminal side (default "
+		       "4K)\n"
+		       " -h        show help\n"
+		       " -n runs   runs of each workload (default 5)\n"
+		       " -r rate   bytes per second the terminal takes, 0 "
+		       "for no limit\n"
+		       "           (default 0)\n"
+		       " -s size   size of the compared files (default 1M)\n"
+		       " -x path   hexdiff to run (default ./hexdiff)\n"
+		       " options   more hexdiff options, such as --compact\n"
+		       "\n"
+		       "Sizes and rates take K, M and G suffixes.\n");
+	}
+	exit(EXIT_FAILURE);
+}
+
+
+// Parse a byte count, with an optional K, M or G suffix
+static unsigned long long int parse_size(const char *str)
+{
+	unsigned long long int val;
+	char *end;
+
+	val = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'k': case 'K': val <<= 10; break;
+	case 'm': case 'M': val <<= 20; break;
+	case 'g': case 'G': val <<= 30; break;
+	}
+	return val;
+}
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void sleep_for(double secs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = secs;
+	ts.tv_nsec = (secs - ts.tv_sec) * 1e9;
+	while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR));
+}
+
+
+// Write size bytes of noise to a new temporary file, or its complement
+// when invert is set, so that every byte differs from the first
+static void make_input(char *path, size_t size, int invert)
+{
+	uint64_t state = 0x9e3779b97f4a7c15ULL, buf[512];
+	size_t n;
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (size_t done = 0; done < size; done += n) {
+		for (int i = 0; i < 512; i++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			buf[i] = invert ? ~state : state;
+		}
+		n = (size - done < sizeof(buf)) ? size - done : sizeof(buf);
+		if (write(fd, buf, n) != (ssize_t)n) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+}
+
+
+// Run hexdiff on a new pseudo-terminal, reading its output at up to rate
+// bytes per second, bufsize bytes at a time
+static void run_one(char **args, double rate, size_t bufsize,
+                    struct result *r)
+{
+	struct winsize ws = { .ws_row = 50, .ws_col = 160 };
+	double start, ahead;
+	char *buf;
+	ssize_t n;
+	int master, status;
+	pid_t pid;
+
+	if ((buf = malloc(bufsize)) == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	memset(r, 0, sizeof(*r));
+
+	start = now();
+	pid = forkpty(&master, NULL, NULL, &ws);
+	if (pid < 0) {
+		fprintf(stderr, "forkpty: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		execv(args[0], args);
+		fprintf(stderr, "%s: %s\n", args[0], strerror(errno));
+		_exit(127);
+	}
+
+	// The master reads EIO once the last of the output is taken and
+	// hexdiff has closed its side
+	for (;;) {
+		n = read(master, buf, bufsize);
+		if ((n < 0) && (errno == EINTR)) continue;
+		if (n <= 0) break;
+		if (r->bytes == 0) r->first = now() - start;
+		r->bytes += n;
+		for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL;
+		     p++) {
+			r->rows++;
+		}
+		if (rate > 0) {
+			ahead = r->bytes / rate - (now() - start);
+			if (ahead > 0) sleep_for(ahead);
+		}
+	}
+	r->total = now() - start;
+	close(master);
+	free(buf);
+
+	while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR));
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		fprintf(stderr, "%s failed\n", args[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+static void remove_inputs(void)
+{
+	for (int w = 0; w < 2; w++) {
+		for (int i = 0; i < 2; i++) {
+			if (inputs[w][i][0] != '\0') unlink(inputs[w][i]);
+		}
+	}
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+
+int main(int argc, char **argv)
+{
+	static const char *const names[] = { "same", "diff" };
+	char *args[MAX_ARGS], *tmp;
+	double first[MAX_RUNS], total[MAX_RUNS], rate;
+	unsigned long long int size;
+	const char *hexdiff;
+	struct result r;
+	size_t bufsize;
+	int opt, runs, n, extra;
+
+
+	// Parse the input arguments
+	bufsize = 4096;
+	runs = 5;
+	rate = 0;
+	size = 1024 * 1024;
+	hexdiff = "./hexdiff";
+	while ((opt = getopt(argc, argv, "b:hn:r:s:x:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bufsize = parse_size(optarg);
+			if (bufsize == 0) show_help(argv, 0);
+			break;
+		case 'h':
+			show_help(argv, 1);
+		case 'n':
+			runs = atoi(optarg);
+			if ((runs < 1) || (runs > MAX_RUNS)) show_help(argv, 0);
+			break;
+		case 'r':
+			rate = parse_size(optarg);
+			break;
+		case 's':
+			size = parse_size(optarg);
+			if (size == 0) show_help(argv, 0);
+			break;
+		case 'x':
+			hexdiff = optarg;
+			break;
+		default:
+			show_help(argv, 0);
+		}
+	}
+	extra = argc - optind;
+	if (extra + 7 > MAX_ARGS) show_help(argv, 0);
+
+	// Matching files for the same workload, complementary ones for diff
+	if ((tmp = getenv("TMPDIR")) == NULL) tmp = "/tmp";
+	atexit(remove_inputs);
+	for (int w = 0; w < 2; w++) {
+		for (int i = 0; i < 2; i++) {
+			snprintf(inputs[w][i], PATH_MAX, "%s/ptybench.XXXXXX",
+			         tmp);
+			make_input(inputs[w][i], size, (w == 1) && (i == 1));
+		}
+	}
+
+	printf("workload  color      rows        MB  first ms  total ms"
+	       "      rows/s\n");
+	for (int w = 0; w < 2; w++) {
+		for (int color = 1; color >= 0; color--) {
+			n = 0;
+			args[n++] = (char *)hexdiff;
+			args[n++] = "--color";
+			args[n++] = color ? "always" : "never";
+			if (w == 0) args[n++] = "-a";
+			for (int i = 0; i < extra; i++) {
+				args[n++] = argv[optind + i];
+			}
+			args[n++] = inputs[w][0];
+			args[n++] = inputs[w][1];
+			args[n] = NULL;
+
+			for (int i = 0; i < runs; i++) {
+				run_one(args, rate, bufsize, &r);
+				first[i] = r.first;
+				total[i] = r.total;
+			}
+			qsort(first, runs, sizeof(double), cmp_double);
+			qsort(total, runs, sizeof(double), cmp_double);
+			printf("%-8s  %-5s  %8llu  %8.1f  %8.2f  %8.1f  "
+			       "%10.0f\n", names[w], color ? "on" : "off",
+			       r.rows, r.bytes / 1e6, 1000 * first[runs / 2],
+			       1000 * total[runs / 2],
+			       r.rows / total[runs / 2]);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}